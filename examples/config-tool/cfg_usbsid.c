@@ -40,6 +40,7 @@
 #include "cfg_usbsid.h"
 #include "cfg_skpico.h"
 #include "macros.h"
+#include "../../src/config_tlv.h"  /* Shared with the firmware */
 
 /* Compile with:
  * gcc -g3 -L/usr/local/lib inih/ini.c cfg_usbsid.c -o cfg_usbsid $(pkg-config --libs --cflags libusb-1.0)
@@ -402,7 +403,96 @@ void save_config(int reboot)
   return;
 }
 
-void write_config(Config * config)
+void print_cfg_buffer(const uint8_t *buf, size_t len)
+{
+  printf("[PRINT CFG BUFFER START (len: %ld)]\n", len);
+  for (int i = 0; i < (int)len; ++i) {
+    if (i == 0)
+      printf("[R%03d] ", i);
+    printf("%02x", buf[i]);
+    if (i == (len - 1)) {
+      printf("\n");
+    } else if ((i != 0) && (i % 16 == 15)) {
+      printf("\n[R%03d] ", i);
+    } else {
+      printf(" ");
+    }
+  }
+  printf("[PRINT CFG BUFFER END]\n");
+  return;
+}
+
+/* Sends a tagged config request and reads the reply into reply
+ * Returns the reply payload length or -1 on error or when the firmware does not support it */
+int config_tlv_transfer(uint8_t command, uint8_t flags, const uint8_t * payload, uint8_t length, uint8_t * reply)
+{
+  uint8_t request[(1 + CONFIG_TLV_MAX_REQUEST)] = {0};
+  if ((CONFIG_TLV_REQ_HEADER + length + CONFIG_TLV_CRC_SIZE) > CONFIG_TLV_MAX_REQUEST) return -1;
+  request[0] = ((COMMAND << 6) | CONFIG);
+  request[1] = command;
+  request[2] = CONFIG_TLV_VERSION;
+  request[3] = flags;
+  request[4] = length;
+  if (length > 0) memcpy(&request[5], payload, length);
+  uint16_t crc = config_tlv_crc16(&request[2], (CONFIG_TLV_REQ_HEADER - 1 + length));
+  request[5 + length] = (crc >> 8) & 0xFF;
+  request[6 + length] = crc & 0xFF;
+  write_chars(request, (1 + CONFIG_TLV_REQ_HEADER + length + CONFIG_TLV_CRC_SIZE));
+
+  /* The reply arrives in 64 byte chunks, older firmware does not reply at all */
+  int total = 0, expected = (CONFIG_TLV_REPLY_HEADER + CONFIG_TLV_CRC_SIZE);
+  while (total < expected) {
+    int actual = 0;
+    if (libusb_bulk_transfer(devh, ep_in_addr, (reply + total), 64, &actual, 1000) < 0 || actual == 0) {
+      if (debug == 1) printf("No tagged config reply, firmware too old?\n");
+      return -1;
+    }
+    total += actual;
+    if (total >= CONFIG_TLV_REPLY_HEADER) {
+      expected = (CONFIG_TLV_REPLY_HEADER + ((reply[3] << 8) | reply[4]) + CONFIG_TLV_CRC_SIZE);
+      if (expected > CONFIG_TLV_MAX_REPLY) return -1;
+    }
+  }
+  int n = ((reply[3] << 8) | reply[4]);
+  uint16_t reply_crc = ((reply[CONFIG_TLV_REPLY_HEADER + n] << 8) | reply[CONFIG_TLV_REPLY_HEADER + n + 1]);
+  if (debug == 1) print_cfg_buffer(reply, expected);
+  if (reply[0] != command || reply_crc != config_tlv_crc16(&reply[1], (CONFIG_TLV_REPLY_HEADER - 1 + n))) {
+    printf("Tagged config reply verification failed\n");
+    return -1;
+  }
+  if (reply[2] != CONFIG_TLV_OK) {
+    printf("Tagged config request failed with status %d\n", reply[2]);
+    return -1;
+  }
+  if (reply[1] > CONFIG_TLV_VERSION) {
+    printf("Firmware config schema version %d is newer than %d, update the config tool\n", reply[1], CONFIG_TLV_VERSION);
+  }
+  return n;
+}
+
+/* Writes the given fields in as few transfers as possible, flags are sent with the last one */
+int write_config_tlv(Config * config, const uint8_t * tags, size_t n_tags, uint8_t flags)
+{
+  uint8_t payload[CONFIG_TLV_MAX_REQUEST];
+  uint8_t reply[CONFIG_TLV_MAX_REPLY];
+  size_t max = (CONFIG_TLV_MAX_REQUEST - CONFIG_TLV_REQ_HEADER - CONFIG_TLV_CRC_SIZE);
+  size_t length = 0;
+  for (size_t i = 0; i < n_tags; i++) {
+    uint8_t record[CONFIG_TLV_MAX_REQUEST];
+    size_t size = config_tlv_encode_field(config, tags[i], record, max);
+    if (size == 0) continue;
+    if ((length + size) > max) {  /* Full, send what we have */
+      if (config_tlv_transfer(CONFIG_TLV_WRITE, 0, payload, length, reply) < 0) return -1;
+      length = 0;
+    }
+    memcpy(&payload[length], record, size);
+    length += size;
+  }
+  if (config_tlv_transfer(CONFIG_TLV_WRITE, flags, payload, length, reply) < 0) return -1;
+  return 0;
+}
+
+void write_config_legacy(Config * config)
 {
   /* General */
   write_config_command(SET_CONFIG,0x0,clockspeed_n(config->clock_rate),0,0);
@@ -439,22 +529,18 @@ void write_config(Config * config)
   return;
 }
 
-void print_cfg_buffer(const uint8_t *buf, size_t len)
-{
-  printf("[PRINT CFG BUFFER START (len: %ld)]\n", len);
-  for (int i = 0; i < (int)len; ++i) {
-    if (i == 0)
-      printf("[R%03d] ", i);
-    printf("%02x", buf[i]);
-    if (i == (len - 1)) {
-      printf("\n");
-    } else if ((i != 0) && (i % 16 == 15)) {
-      printf("\n[R%03d] ", i);
-    } else {
-      printf(" ");
-    }
+void write_config(Config * config)
+{ /* Same fields as the legacy path, in one or two transfers */
+  static const uint8_t tags[] = {
+    0x02,                                /* clock_rate */
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15,  /* socketOne */
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26,  /* socketTwo */
+    0x30, 0x31,                          /* LED */
+    0x40, 0x41, 0x42, 0x43,              /* RGBLED */
+  };
+  if (write_config_tlv(config, tags, count_of(tags), (CONFIG_TLV_APPLY | CONFIG_TLV_SAVE)) != 0) {
+    write_config_legacy(config);
   }
-  printf("[PRINT CFG BUFFER END]\n");
   return;
 }
 
@@ -670,7 +756,7 @@ void sid_autodetect(void)
   return;
 }
 
-void read_config(void)
+void read_config_legacy(void)
 {
   memset(config, 0, count_of(config));
   config_buffer[1] = 0x30;
@@ -687,6 +773,20 @@ void read_config(void)
   return;
 }
 
+void read_config(void)
+{
+  uint8_t reply[CONFIG_TLV_MAX_REPLY];
+  int n = config_tlv_transfer(CONFIG_TLV_READ, 0, NULL, 0, reply);
+  if (n < 0) {  /* Older firmware */
+    read_config_legacy();
+    return;
+  }
+  int skipped = 0;
+  int applied = config_tlv_decode(&usbsid_config, &reply[CONFIG_TLV_REPLY_HEADER], n, &skipped);
+  if (debug == 1) printf("Config schema version %d, %d fields, %d unknown\n", reply[1], applied, skipped);
+  return;
+}
+
 void read_socket_config(void)
 {
   memset(socket_config, 0, count_of(socket_config));
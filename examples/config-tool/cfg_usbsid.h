@@ -74,6 +74,9 @@ enum
   WRITE_CONFIG     = 0x36,  /* Write full config as bytes */
   READ_SOCKETCFG   = 0x37,  /* Read socket config as bytes */
   RELOAD_CONFIG    = 0x38,  /* Reload and apply stored config from flash */
+  SAVE_STATUS      = 0x39,  /* Read the persisted status of the last save */
+  CONFIG_TLV_READ  = 0x3A,  /* Read tagged config fields, see config_tlv.h */
+  CONFIG_TLV_WRITE = 0x3B,  /* Write tagged config fields, see config_tlv.h */
 
   SINGLE_SID       = 0x40,
   DUAL_SID         = 0x41,
@@ -91,6 +94,14 @@ enum
   TEST_SID2        = 0x54,
   TEST_SID3        = 0x55,
   TEST_SID4        = 0x56,
+  SET_CLOCK_HZ     = 0x57,  /* Set SID clock in Hz, replies with a clock report */
+  CLOCK_INFO       = 0x58,  /* Read the clock report */
+  MEASURE_CLOCK    = 0x59,  /* Measure the external clock, replies with a clock report after the gate */
+  TEST_STATUS      = 0x5A,  /* Read the SID test or detection status report */
+  TEST_STOP        = 0x5B,  /* Abort a running SID test, replies with a status report */
+  TEST_REPORT      = 0x5C,  /* Read the characterization report of a SID */
+  CYCLE_COUNT      = 0x5D,  /* Read the timer and the PHI2 cycles since boot */
+  SID_MUTE         = 0x5E,  /* Mute voices of a SID, byte 1 SID in bits 4-5, voices in bits 0-2, volume in bit 3 */
 
   LOAD_MIDI_STATE  = 0x60,
   SAVE_MIDI_STATE  = 0x61,
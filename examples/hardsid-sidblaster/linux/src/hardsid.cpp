@@ -1,4 +1,5 @@
 #include "hardsid.hpp"
+#include "usbsid.hpp"
 
 #define HARDSID_VERSION			0x0200
 
@@ -9,56 +10,85 @@
 #define HSDBG(...)  ((void)0)
 #endif
 
-extern void usbsid_reset(void);
-extern int usbsid_open(void);
-extern int usbsid_read(uint16_t addr, int chipno);
-extern void usbsid_store(uint16_t addr, uint8_t val, int chipno);
-extern int WaitForCycle(int cycle);
+/* The HardSID API has no handle, all calls go to one driver instance */
+static usbsid_ctx *us = NULL;
+
+/* Cycles since the last write per DeviceID, sent along with the next write as a CYCLED_WRITE
+ * Long pauses are sent as delays once they reach HARDSID_DELAY_CYCLES so the device keeps up */
+#define HARDSID_DELAY_CYCLES 5000
+#define HARDSID_MAX_IDS USBSID_MAX_SIDS
+static uint32_t delta_cycles[HARDSID_MAX_IDS];
+static uint32_t write_buffer_cycles = 0;  /* HardSID_SetWriteBufferSize, kept for when the driver opens */
+
+/* Sends the cycles that passed since the last write so the device timeline is complete */
+static void HardSID_SendDelta(uint8_t DeviceID) {
+  if (delta_cycles[DeviceID] > 0) {
+    usbsid_delay_cycled(us, (int)DeviceID, delta_cycles[DeviceID]);
+    delta_cycles[DeviceID] = 0;
+  }
+}
 
 
 uint16_t HardSID_Version( void ) {
   return( HARDSID_VERSION );
 }
-int us = -1;
 uint8_t HardSID_Devices(void) {
   HSDBG("%s\r\n", __func__);
-  if (us < 0) us = usbsid_open();
-  HSDBG("%s us: %d\r\n", __func__, us);
-  if (us < 0) exit(1);
-  return (MAXSID);
+  if (us == NULL) {
+    us = usbsid_create();
+    usbsid_set_ahead(us, write_buffer_cycles);
+    int rc = usbsid_open(us);
+    HSDBG("%s rc: %d\r\n", __func__, rc);
+    if (rc < 0) exit(1);
+  }
+  return (uint8_t)usbsid_sids(us);
 }
 
 uint8_t HardSID_SIDCount(void) {
   HSDBG("%s\r\n", __func__);
-	return (MAXSID);
+	return (HardSID_Devices());
 }
 
 uint8_t HardSID_Read(uint8_t DeviceID, int Cycles, uint8_t SID_reg ) {
   HSDBG("HardSID_Read: 0x%04x %d 0x%04x\r\n", DeviceID, Cycles, SID_reg);
-  HardSID_Delay(DeviceID, Cycles);
-  int r = usbsid_read((uint16_t)SID_reg, (int)DeviceID);
+  if (DeviceID >= HARDSID_MAX_IDS) return 0xFF;
+  HardSID_Delay(DeviceID, (uint16_t)(Cycles < 0 ? 0 : Cycles > 0xFFFF ? 0xFFFF : Cycles));
+  HardSID_SendDelta(DeviceID);
+  int r = usbsid_read(us, (uint16_t)SID_reg, (int)DeviceID);
   return (uint8_t)r;
 }
 
 void HardSID_Delay(uint8_t DeviceID, uint16_t Cycles) {
   HSDBG("%s\r\n", __func__);
-  if (Cycles > 0) {
-    WaitForCycle(Cycles);
+  if (DeviceID >= HARDSID_MAX_IDS) return;
+  delta_cycles[DeviceID] += Cycles;
+  if (delta_cycles[DeviceID] >= HARDSID_DELAY_CYCLES) {
+    HardSID_SendDelta(DeviceID);
   }
 }
 
 void HardSID_Write(uint8_t DeviceID, int Cycles, uint8_t SID_reg, uint8_t Data) {
   HSDBG("HardSID_Write: 0x%02x %d $%02x $%02x\r\n", DeviceID, Cycles, SID_reg, Data);
-  usbsid_store((uint16_t)SID_reg, Data, (int)DeviceID);
-  HardSID_Delay(DeviceID, Cycles);
+  if (DeviceID >= HARDSID_MAX_IDS) return;
+  uint32_t cycles = (delta_cycles[DeviceID] + (uint32_t)(Cycles < 0 ? 0 : Cycles));  /* Time never runs backwards */
+  usbsid_store_cycled(us, (uint16_t)SID_reg, Data, (int)DeviceID, cycles);
+  delta_cycles[DeviceID] = 0;
 }
 
+/* Sends everything buffered for DeviceID and returns once it left the host */
 void HardSID_Flush(uint8_t DeviceID) {
   HSDBG("HardSID_Flush: 0x%04x\r\n", DeviceID);
+  if (DeviceID >= HARDSID_MAX_IDS) return;
+  HardSID_SendDelta(DeviceID);
+  usbsid_wait(us, (int)DeviceID);
 }
 
+/* Sends everything buffered without waiting */
 void HardSID_SoftFlush(uint8_t DeviceID) {
   HSDBG("HardSID_SoftFlush: 0x%04x\r\n", DeviceID);
+  if (DeviceID >= HARDSID_MAX_IDS) return;
+  HardSID_SendDelta(DeviceID);
+  usbsid_flush(us);
 }
 
 bool HardSID_Lock(uint8_t DeviceID) {
@@ -76,25 +106,33 @@ void HardSID_Filter( uint8_t DeviceID, bool Filter ) {
 
 void HardSID_Reset( uint8_t DeviceID ) {
   HSDBG("HardSID_Reset: 0x%04x\r\n", DeviceID);
-  usbsid_reset();
+  if (DeviceID < HARDSID_MAX_IDS) delta_cycles[DeviceID] = 0;
+  usbsid_reset(us, (int)DeviceID);
 }
 
 void HardSID_Reset2(uint8_t DeviceID, uint8_t Volume) {
   (void)Volume; /* TODO: Implement */
   HSDBG("HardSID_Reset2: 0x%04x 0x%04x\r\n", DeviceID, Volume);
-  usbsid_reset();
+  if (DeviceID < HARDSID_MAX_IDS) delta_cycles[DeviceID] = 0;
+  usbsid_reset(us, (int)DeviceID);
 }
 
+/* Returns once the device has played everything written so far */
 void HardSID_Sync( uint8_t DeviceID ) {
   HSDBG("HardSID_Sync: 0x%04x\r\n", DeviceID);
+  if (DeviceID >= HARDSID_MAX_IDS) return;
+  HardSID_SendDelta(DeviceID);
+  usbsid_sync(us, (int)DeviceID);
 }
 
 void HardSID_Mute( uint8_t DeviceID, uint8_t Channel, bool Mute ) {
   HSDBG("HardSID_Mute: 0x%04x 0x%04x 0x%04x\r\n", DeviceID, Channel, Mute);
+  usbsid_mute(us, (int)DeviceID, (int)Channel, Mute);
 }
 
 void HardSID_MuteAll( uint8_t DeviceID, bool Mute ) {
-  HSDBG("HardSID_Mute: 0x%04x 0x%04x\r\n", DeviceID, Mute);
+  HSDBG("HardSID_MuteAll: 0x%04x 0x%04x\r\n", DeviceID, Mute);
+  usbsid_mute_all(us, (int)DeviceID, Mute);
 }
 
 uint8_t HardSID_Try_Write(uint8_t DeviceID, int Cycles, uint8_t SID_reg, uint8_t Data) {
@@ -109,12 +147,16 @@ bool HardSID_ExternalTiming(uint8_t DeviceID) {
 }
 
 void HardSID_GetSerial(char* output, int bufferSize, uint8_t DeviceID) {
-  (void)output;
   HSDBG("HardSID_GetSerial: 0x%04x %d\r\n", DeviceID, bufferSize);
+  usbsid_serial(us, (int)DeviceID, output, bufferSize);
 }
 
+/* Bounds how far the writes may run ahead of playback, in units of USBSID_BUFFER_UNIT_CYCLES
+ * 0 restores the default */
 void HardSID_SetWriteBufferSize(uint8_t bufferSize) {
   HSDBG("HardSID_SetWriteBufferSize: 0x%04x\r\n", bufferSize);
+  write_buffer_cycles = ((uint32_t)bufferSize * USBSID_BUFFER_UNIT_CYCLES);
+  if (us != NULL) usbsid_set_ahead(us, write_buffer_cycles);
 }
 
 int HardSID_SetSIDType(uint8_t DeviceID, int sidtype_) {
@@ -148,4 +190,5 @@ uint8_t ReadFromHardSID(uint8_t DeviceID, uint8_t SID_reg) {
 
 void MuteHardSID_Line(int Mute) {
   HSDBG("MuteHardSID_Line\r\n");
+  usbsid_mute_line(us, (Mute != 0));
 }
@@ -2,23 +2,69 @@
 
 #pragma GCC diagnostic ignored "-Wnarrowing"
 
-unsigned char result[LEN_IN_BUFFER];
-int out_buffer_length;
+/* SID address layouts, indexed by SIDTYPE */
+static const usbsid_sidtype sidtypes[] = {
+    /* SIDTYPE0 */ { 1, { 0xD400, 0x0,    0x0,    0x0    }, { 0x1F, 0x0,  0x0,  0x0  } },
+    /* SIDTYPE1 */ { 2, { 0xD400, 0xD420, 0x0,    0x0    }, { 0x1F, 0x3F, 0x0,  0x0  } },
+    /* SIDTYPE2 */ { 2, { 0xD400, 0xD440, 0x0,    0x0    }, { 0x1F, 0x5F, 0x0,  0x0  } },
+    /* SIDTYPE3 */ { 3, { 0xD400, 0xD420, 0xD440, 0x0    }, { 0x1F, 0x3F, 0x5F, 0x0  } },
+    /* SIDTYPE4 */ { 4, { 0xD400, 0xD420, 0xD440, 0xD460 }, { 0x1F, 0x3F, 0x5F, 0x7F } },  /* SKPico only */
+    /* SIDTYPE5 */ { 4, { 0xD400, 0xD440, 0xD420, 0xD460 }, { 0x1F, 0x5F, 0x3F, 0x7F } },  /* SKPico only */
+};
 
 
-int usbSIDSetup(void)
+static inline int64_t usbSIDNowNs(void)
 {
-    printf("[USBSID] Starting setup\r\n");
-    rc = read_completed = write_completed = -1;
-    out_buffer_length = (ASYNC_THREADING == 0) ? LEN_OUT_BUFFER : LEN_OUT_BUFFER/* LEN_OUT_BUFFER_ASYNC */;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
 
-    /* - set line encoding: here 9600 8N1
-     * 9000000 = 0x895440 -> 0x40, 0x54, 0x89 in little endian
-     */
-    unsigned char encoding[] = { 0x40, 0x54, 0x89, 0x00, 0x00, 0x00, 0x08 };
+static inline uint32_t usbSIDNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+/* Nanoseconds per cycle at the rate the device reports, clock_hz until it did */
+static inline double usbSIDNominalNs(usbsid_dev *dev)
+{
+    return (dev->nominal_millihz != 0 ? (1e12 / dev->nominal_millihz) : dev->us->cycle_ns);
+}
+
+/* True when serial is in the comma separated us->serials, or that list is empty */
+static bool usbSIDSerialWanted(usbsid_ctx *us, const char *serial)
+{
+    if (us->serials[0] == '\0') return true;
+    size_t len = strlen(serial);
+    for (const char *p = us->serials; *p != '\0';) {
+        const char *end = strchr(p, ',');
+        size_t n = (end != NULL ? (size_t)(end - p) : strlen(p));
+        if (n == len && strncmp(p, serial, n) == 0) return true;
+        if (end == NULL) break;
+        p = (end + 1);
+    }
+    return false;
+}
+
+/* Sends the mute mask of a SID, queued in order with the writes. The firmware masks what it puts
+ * on the bus and sends the affected registers again, writes keep their value on the device */
+static void usbSIDSendMute(usbsid_dev *dev, int sidno)
+{
+    unsigned char buff[3] = { ((COMMAND << 6) | CONFIG), SID_MUTE, (uint8_t)((sidno << 4) | (dev->mute[sidno] & 0xF)) };
+    usbSIDWrite(dev, buff);
+}
+
+int usbSIDSetup(usbsid_ctx *us)
+{
+    printf("[USBSID] Starting setup\r\n");
+    libusb_device **list = NULL;
+    ssize_t count;
+    int rc = -1;
 
-     /* Initialize libusb */
-    rc = libusb_init(NULL);
+     /* Initialize libusb, every instance has its own context */
+    rc = libusb_init(&us->ctx);
     // rc = libusb_init_context(&ctx, /*options=NULL, /*num_options=*/0);  // NOTE: REQUIRES LIBUSB 1.0.27!!
     if (rc < 0) {
         fprintf(stderr, "Error initializing libusb: %d %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
@@ -27,16 +73,106 @@ int usbSIDSetup(void)
     printf("[USBSID] libusb_init complete\r\n");
 
     /* Set debugging output to min/max (4) level */
-    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, 0);
+    libusb_set_option(us->ctx, LIBUSB_OPTION_LOG_LEVEL, 0);
 
-    /* Look for a specific device and open it. */
-    devh = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
-    if (!devh) {
-        fprintf(stderr, "Error opening USB device with VID & PID: %d %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+    /* Open every device with our VID & PID, not just the first one */
+    count = libusb_get_device_list(us->ctx, &list);
+    if (count < 0) {
+        rc = (int)count;
+        fprintf(stderr, "Error listing USB devices: %d %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+        goto out;
+    }
+    for (ssize_t i = 0; i < count && us->n_devices < USBSID_MAX_DEVICES; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) < 0) continue;
+        if (desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID) continue;
+        usbsid_dev *dev = new usbsid_dev();
+        dev->us = us;
+        rc = libusb_open(list[i], &dev->devh);
+        if (rc < 0) {
+            fprintf(stderr, "Error opening USB device on bus %d address %d: %d %s: %s\n",
+                libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]), rc, libusb_error_name(rc), libusb_strerror(rc));
+            delete dev;
+            continue;
+        }
+        if (libusb_get_string_descriptor_ascii(dev->devh, desc.iSerialNumber, (unsigned char *)dev->serial, (USBSID_SERIAL_LEN - 1)) < 0) {
+            snprintf(dev->serial, USBSID_SERIAL_LEN, "bus%d-%d", libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+        }
+        if (!usbSIDSerialWanted(us, dev->serial)) {  /* Left for another instance */
+            libusb_close(dev->devh);
+            delete dev;
+            continue;
+        }
+        us->devices[us->n_devices++] = dev;
+    }
+    libusb_free_device_list(list, 1);
+    if (us->n_devices == 0) {
+        fprintf(stderr, "Error no USBSID-Pico found with VID & PID %04x:%04x%s%s\n", VENDOR_ID, PRODUCT_ID,
+            (us->serials[0] != '\0' ? " and serial in " : ""), us->serials);
+        rc = -1;
+        goto out;
+    }
+    printf("[USBSID] found %d device(s)\r\n", us->n_devices);
+
+    /* Sort by serial so DeviceIDs don't depend on which port enumerated first */
+    std::sort(us->devices, (us->devices + us->n_devices), [](const usbsid_dev *a, const usbsid_dev *b) {
+        return (strcmp(a->serial, b->serial) < 0);
+    });
+
+    /* A board that fails to open, e.g. claimed by another process, is left out and the rest carry on */
+    {
+        int opened = 0;
+        for (int d = 0; d < us->n_devices; d++) {
+            usbsid_dev *dev = us->devices[d];
+            if (usbSIDOpen(us, dev) < 0) {
+                fprintf(stderr, "Error opening %s, skipping it\n", dev->serial);
+                usbSIDClose(dev);
+                delete dev;
+                continue;
+            }
+            us->devices[opened++] = dev;
+        }
+        for (int d = opened; d < us->n_devices; d++) us->devices[d] = NULL;
+        us->n_devices = opened;
+    }
+    if (us->n_devices == 0) {
         rc = -1;
         goto out;
     }
-    printf("[USBSID] libusb_open_device_with_vid_pid complete\r\n");
+    rc = 0;
+
+    fprintf(stdout, "[USBSID] opened %d device(s) with %d SID(s)\r\n", us->n_devices, us->n_sids);
+
+    if (ASYNC_THREADING == 1) {
+        us->exit_thread = 0;
+        pthread_create(&us->ptid, NULL, &usbSIDStart, us);
+        us->thread_started = true;
+        fprintf(stdout, "[USBSID] pthread_create complete\r\n");
+    }
+
+    /* Start unmuted, the firmware keeps the masks of a previous session */
+    for (int s = 0; s < us->n_sids; s++) {
+        usbSIDSendMute(us->sid_map[s].dev, us->sid_map[s].sidno);
+    }
+
+    return rc;
+out:
+    usbSIDExit(us);
+    return rc;
+}
+
+int usbSIDOpen(usbsid_ctx *us, usbsid_dev *dev)
+{
+    libusb_device_handle *devh = dev->devh;
+    int rc;
+    dev->read_completed = dev->write_completed = -1;
+    dev->cycle_ns = us->cycle_ns;
+    dev->out_buffer_length = (ASYNC_THREADING == 0) ? LEN_OUT_BUFFER : LEN_OUT_BUFFER_ASYNC;
+
+    /* - set line encoding: here 9600 8N1
+     * 9000000 = 0x895440 -> 0x40, 0x54, 0x89 in little endian
+     */
+    unsigned char encoding[] = { 0x40, 0x54, 0x89, 0x00, 0x00, 0x00, 0x08 };
 
     /* As we are dealing with a CDC-ACM device, it's highly probable that
      * Linux already attached the cdc-acm driver to this device.
@@ -51,11 +187,10 @@ int usbSIDSetup(void)
         rc = libusb_claim_interface(devh, if_num);
         if (rc < 0) {
             fprintf(stderr, "Error claiming interface: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-            rc = -1;
-            goto out;
+            return -1;
         }
     }
-    printf("[USBSID] libusb_claim_interface complete\r\n");
+    printf("[USBSID] %s libusb_claim_interface complete\r\n", dev->serial);
 
     /* Start configuring the device:
      * - set line state
@@ -63,103 +198,167 @@ int usbSIDSetup(void)
     rc = libusb_control_transfer(devh, 0x21, 0x22, ACM_CTRL_DTR | ACM_CTRL_RTS, 0, NULL, 0, 0);
     if (rc < 0) {
         fprintf(stderr, "Error configuring line state during control transfer: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-        rc = -1;
-        goto out;
+        return -1;
     }
-    printf("[USBSID] DTR RTS complete\r\n");
+    printf("[USBSID] %s DTR RTS complete\r\n", dev->serial);
 
     rc = libusb_control_transfer(devh, 0x21, 0x20, 0, 0, encoding, sizeof(encoding), 0);
     if (rc < 0) {
         fprintf(stderr, "Error configuring line encoding during control transfer: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-        rc = -1;
-        goto out;
+        return -1;
     }
-    printf("[USBSID] set encoding complete\r\n");
+    printf("[USBSID] %s set encoding complete\r\n", dev->serial);
 
-    if (ASYNC_THREADING == 0) {
-        out_buffer = libusb_dev_mem_alloc(devh, LEN_OUT_BUFFER);
-        if (out_buffer == NULL) {
-            fprintf(stderr, "libusb_dev_mem_alloc failed on out_buffer, allocating with malloc\n");
-            out_buffer = (uint8_t*)malloc( (sizeof(uint8_t)) * 3 );
-        }
-        printf("[USBSID] alloc out_buffer complete\r\n");
-        transfer_out = libusb_alloc_transfer(0);
-        printf("[USBSID] alloc transfer_out complete\r\n");
-        libusb_fill_bulk_transfer(transfer_out, devh, ep_out_addr, out_buffer, LEN_OUT_BUFFER, sid_out, &write_completed, 0);
-        printf("[USBSID] libusb_fill_bulk_transfer transfer_out complete\r\n");
-
-        in_buffer = libusb_dev_mem_alloc(devh, LEN_IN_BUFFER);
-        if (in_buffer == NULL) {
-            fprintf(stderr, "libusb_dev_mem_alloc failed on in_buffer, allocating with malloc\n");
-            in_buffer = (uint8_t*)malloc( (sizeof(uint8_t)) * 1 );
-        }
-        printf("[USBSID] alloc in_buffer complete\r\n");
-        transfer_in = libusb_alloc_transfer(0);
-        printf("[USBSID] alloc transfer_in complete\r\n");
-        libusb_fill_bulk_transfer(transfer_in, devh, ep_in_addr, in_buffer, LEN_IN_BUFFER, sid_in, &read_completed, 0);
-        printf("[USBSID] libusb_fill_bulk_transfer transfer_in complete\r\n");
-    } else {
-        out_buffer = libusb_dev_mem_alloc(devh, LEN_OUT_BUFFER /* LEN_OUT_BUFFER_ASYNC */);
-        printf("[USBSID] alloc out_buffer complete\r\n");
-        transfer_out = libusb_alloc_transfer(0);
-        printf("[USBSID] alloc transfer_out complete\r\n");
-        libusb_fill_bulk_transfer(transfer_out, devh, ep_out_addr, out_buffer, LEN_OUT_BUFFER /* LEN_OUT_BUFFER_ASYNC */, sid_out, &write_completed, 0);
-        printf("[USBSID] libusb_fill_bulk_transfer transfer_out complete\r\n");
-        rc = libusb_submit_transfer(transfer_out);
+    dev->out_buffer = libusb_dev_mem_alloc(devh, dev->out_buffer_length);
+    if (dev->out_buffer == NULL) {
+        fprintf(stderr, "libusb_dev_mem_alloc failed on out_buffer, allocating with malloc\n");
+        dev->out_buffer = (uint8_t*)malloc( (sizeof(uint8_t)) * dev->out_buffer_length );
+    }
+    dev->transfer_out = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(dev->transfer_out, devh, EP_OUT_ADDR, dev->out_buffer, LEN_OUT_BUFFER, sid_out, &dev->write_completed, 0);
+
+    dev->in_buffer = libusb_dev_mem_alloc(devh, LEN_IN_BUFFER);
+    if (dev->in_buffer == NULL) {
+        fprintf(stderr, "libusb_dev_mem_alloc failed on in_buffer, allocating with malloc\n");
+        dev->in_buffer = (uint8_t*)malloc( (sizeof(uint8_t)) * 1 );
+    }
+    dev->transfer_in = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(dev->transfer_in, devh, EP_IN_ADDR, dev->in_buffer, LEN_IN_BUFFER, sid_in, &dev->read_completed, 0);
+    printf("[USBSID] %s transfers complete\r\n", dev->serial);
+
+    if (ASYNC_THREADING == 1) {
+        rc = usbSIDAsyncSetup(dev);
         if (rc < 0) {
-            fprintf(stderr, "Error during transfer_out submit transfer: %s\n", libusb_error_name(rc));
-            rc = -1;
-            goto out;
+            return -1;
         }
-        printf("[USBSID] libusb_submit_transfer transfer_out complete\r\n");
+        printf("[USBSID] %s async transfer pool complete\r\n", dev->serial);
     }
 
-    fprintf(stdout, "[USBSID] opened\r\n");
+    usbSIDReadSocketConfig(dev);
 
+    /* Only now, the socket config and first cycle count are read with plain bulk transfers on the same endpoint */
     if (ASYNC_THREADING == 1) {
-        pthread_create(&ptid, NULL, &usbSIDStart, NULL);
-        fprintf(stdout, "[USBSID] pthread_create complete\r\n");
+        uint64_t cycles;
+        uint32_t millihz;
+        if (usbSIDReadCycleCount(dev, &cycles, &millihz) == 0) {
+            dev->drift_base_ns = usbSIDNowNs();
+            dev->drift_base_cycles = cycles;
+            dev->drift_started = true;
+            dev->nominal_millihz = millihz;  /* Pacing follows the clock the device plays at, not clock_hz */
+            dev->cycle_ns = usbSIDNominalNs(dev);
+            printf("[USBSID] %s runs at %.3f Hz\r\n", dev->serial, (millihz / 1e3));
+        } else {
+            dev->drift_off = true;
+            printf("[USBSID] %s does not report its cycle count, drift estimation off\r\n", dev->serial);
+        }
+        dev->probe_sent_ns = usbSIDNowNs();
+        rc = usbSIDArmReads(dev);
+        if (rc < 0) {
+            return -1;
+        }
     }
 
-    return rc;
-out:
-    usbSIDExit();
-    return rc;
+    /* Map the SIDs of this device to the next free DeviceIDs, last so a device that fails is never mapped */
+    dev->first_id = us->n_sids;
+    for (int s = 0; s < dev->numsids && us->n_sids < USBSID_MAX_SIDS; s++) {
+        us->sid_map[us->n_sids].dev = dev;
+        us->sid_map[us->n_sids].sidno = s;
+        us->n_sids++;
+    }
+    printf("[USBSID] %s %d SID(s) as DeviceID %d to %d\r\n", dev->serial, dev->numsids, dev->first_id, (us->n_sids - 1));
+    return 0;
 }
 
-int usbSIDExit(void)
+int usbSIDReadSocketConfig(usbsid_dev *dev)
 {
-    printf("[USBSID] Closing\r\n");
-    if (rc < 0) usbSIDPause();
-    fprintf(stdout, "[USBSID] usbSIDPause complete\r\n");
+    unsigned char buff[LEN_OUT_BUFFER_ASYNC] = { 0 };
+    int len = 0, rc;
+    dev->numsids = dev->us->sidtype->numsids;  /* Fallback when the device does not answer */
 
-    if (ASYNC_THREADING == 1) {
-        exit_thread = 1;
-        pthread_join(ptid, NULL);
-        fprintf(stdout, "[USBSID] Thread joined\r\n");
+    buff[0] = ((COMMAND << 6) | CONFIG);
+    buff[1] = READ_SOCKETCFG;
+    rc = libusb_bulk_transfer(dev->devh, EP_OUT_ADDR, buff, (ASYNC_THREADING == 0 ? 6 : LEN_OUT_BUFFER_ASYNC), &len, 1000);
+    if (rc >= 0) {
+        memset(buff, 0, LEN_OUT_BUFFER_ASYNC);
+        rc = libusb_bulk_transfer(dev->devh, EP_IN_ADDR, buff, LEN_OUT_BUFFER_ASYNC, &len, 1000);
+    }
+    if (rc < 0 || len < 10 || buff[0] != READ_SOCKETCFG || buff[1] != 0x7F || buff[9] != 0xFF) {
+        fprintf(stderr, "Warning: %s socket config not readable, assuming %d SIDs\n", dev->serial, dev->numsids);
+        return -1;
+    }
 
-        fprintf(stdout, "[USBSID] Thread exited\r\n");
+    int one = ((buff[2] >> 4) & 0xF) ? ((buff[2] & 0xF) ? 2 : 1) : 0;  /* enabled, dualsid */
+    int two = ((buff[5] >> 4) & 0xF) ? ((buff[5] & 0xF) ? 2 : 1) : 0;
+    dev->numsids = (buff[8] & 0xF) ? 1 : (one + two);  /* act as one puts both sockets on the first SID */
+    return 0;
+}
+
+/* Parses a CYCLE_COUNT reply, the cycles and the clock the device runs at */
+static bool usbSIDParseCycles(const uint8_t *report, uint64_t *cycles, uint32_t *millihz)
+{
+    if (report[0] != CYCLE_COUNT || report[1] != 0) return false;
+    uint64_t c = 0;
+    uint32_t m = 0;
+    for (int i = 0; i < 8; i++) c = ((c << 8) | report[10 + i]);
+    for (int i = 0; i < 4; i++) m = ((m << 8) | report[18 + i]);
+    *cycles = c;
+    *millihz = m;
+    return true;
+}
+
+int usbSIDReadCycleCount(usbsid_dev *dev, uint64_t *cycles, uint32_t *millihz)
+{
+    unsigned char buff[LEN_OUT_BUFFER_ASYNC] = { 0 };
+    int len = 0, rc;
+
+    buff[0] = ((COMMAND << 6) | CONFIG);
+    buff[1] = CYCLE_COUNT;
+    rc = libusb_bulk_transfer(dev->devh, EP_OUT_ADDR, buff, LEN_OUT_BUFFER_ASYNC, &len, 250);
+    if (rc >= 0) {
+        memset(buff, 0, LEN_OUT_BUFFER_ASYNC);
+        rc = libusb_bulk_transfer(dev->devh, EP_IN_ADDR, buff, LEN_OUT_BUFFER_ASYNC, &len, 250);
+    }
+    if (rc < 0 || len < CYCLE_REPORT_SIZE || !usbSIDParseCycles(buff, cycles, millihz)) {
+        return -1;
+    }
+    return 0;
+}
+
+void usbSIDClose(usbsid_dev *dev)
+{
+    libusb_device_handle *devh = dev->devh;
+    int rc;
+    if (devh == NULL) return;
+
+    if (ASYNC_THREADING == 1) {
+        usbSIDAsyncFree(dev);
     }
 
-    rc = libusb_cancel_transfer(transfer_out);
-    if (rc < 0 && rc != -5)
-        fprintf(stderr, "Failed to cancel transfer %d - %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-    fprintf(stdout, "[USBSID] libusb_cancel_transfer transfer_out complete\r\n");
+    if (dev->transfer_out != NULL) {
+        rc = libusb_cancel_transfer(dev->transfer_out);
+        if (rc < 0 && rc != -5)
+            fprintf(stderr, "Failed to cancel transfer %d - %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+        libusb_free_transfer(dev->transfer_out);
+    }
 
-    rc = libusb_cancel_transfer(transfer_in);
-    if (rc < 0 && rc != -5)
-        fprintf(stderr, "Failed to cancel transfer %d - %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-    fprintf(stdout, "[USBSID] libusb_cancel_transfer transfer_in complete\r\n");
+    if (dev->transfer_in != NULL) {
+        rc = libusb_cancel_transfer(dev->transfer_in);
+        if (rc < 0 && rc != -5)
+            fprintf(stderr, "Failed to cancel transfer %d - %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+        libusb_free_transfer(dev->transfer_in);
+    }
 
-    rc = libusb_dev_mem_free(devh, in_buffer, LEN_IN_BUFFER);
-    if (rc < 0)
-        fprintf(stderr, "Failed to free in_buffer DMA memory: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-    fprintf(stdout, "[USBSID] libusb_dev_mem_free in_buffer complete\r\n");
+    if (dev->in_buffer != NULL) {
+        rc = libusb_dev_mem_free(devh, dev->in_buffer, LEN_IN_BUFFER);
+        if (rc < 0)
+            fprintf(stderr, "Failed to free in_buffer DMA memory: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+    }
 
-    rc = libusb_dev_mem_free(devh, out_buffer, out_buffer_length);
-    if (rc < 0)
-        fprintf(stderr, "Failed to free out_buffer DMA memory: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
-    fprintf(stdout, "[USBSID] libusb_dev_mem_free out_buffer complete\r\n");
+    if (dev->out_buffer != NULL) {
+        rc = libusb_dev_mem_free(devh, dev->out_buffer, dev->out_buffer_length);
+        if (rc < 0)
+            fprintf(stderr, "Failed to free out_buffer DMA memory: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+    }
 
     for (int if_num = 0; if_num < 2; if_num++) {
         if (libusb_kernel_driver_active(devh, if_num)) {
@@ -167,148 +366,505 @@ int usbSIDExit(void)
             fprintf(stderr, "libusb_detach_kernel_driver error: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
         }
         libusb_release_interface(devh, if_num);
-        fprintf(stdout, "[USBSID] libusb_release_interface if_num %d complete\r\n", if_num);
     }
 
-    if (devh) {
-        libusb_close(devh);
-        fprintf(stdout, "[USBSID] libusb_close complete\r\n");
+    libusb_close(devh);
+    dev->devh = NULL;
+    fprintf(stdout, "[USBSID] %s closed\r\n", dev->serial);
+}
+
+int usbSIDExit(usbsid_ctx *us)
+{
+    if (us->ctx == NULL) return 0;  /* Never opened or already closed */
+    printf("[USBSID] Closing\r\n");
+
+    if (ASYNC_THREADING == 1 && us->thread_started) {
+        us->exit_thread = 1;
+        libusb_interrupt_event_handler(us->ctx);
+        pthread_join(us->ptid, NULL);
+        us->thread_started = false;
+        fprintf(stdout, "[USBSID] Thread joined\r\n");
+    }
+
+    for (int d = 0; d < us->n_devices; d++) {
+        usbsid_dev *dev = us->devices[d];
+        if (dev->drift_span_ns > 0) {
+            printf("[USBSID] %s PHI2 %+.2f ppm against %.3f Hz on the host clock, over %.0f s\r\n",
+                dev->serial, dev->drift_ppm, (1e9 / usbSIDNominalNs(dev)), (dev->drift_span_ns / 1e9));
+        }
+        usbSIDClose(dev);
+        delete us->devices[d];
+        us->devices[d] = NULL;
     }
+    us->n_devices = us->n_sids = 0;
 
-    libusb_exit(ctx);
+    libusb_exit(us->ctx);
+    us->ctx = NULL;
     fprintf(stdout, "[USBSID] libusb_exit complete\r\n");
 
-    devh = NULL;
+    usbSIDPrintJitter(us);
+    if ((us->reads_cached + us->reads_device) > 0) {
+        printf("[USBSID] reads: %lu from the shadow cache, %lu from the device\r\n", (unsigned long)us->reads_cached, (unsigned long)us->reads_device);
+    }
     fprintf(stdout, "[USBSID] linux driver closed\r\n");
     return 0;
 }
 
-void *usbSIDStart(void*)
+/* Async write engine
+ *
+ * Every device has its own ring and transfer pool, one event thread serves all of them
+ * The producer of a ring is the thread writing to that device, the event thread the consumer
+ * Other threads never queue into a ring, usbsid_flush only raises the flush_request flag of each device
+ * Writes are packed into 64 byte WRITE packets of up to 31 address/value pairs
+ * Cycled writes are packed into CYCLED_WRITE packets of up to 15 address/value/cycles records
+ * Every async packet is a full 64 bytes so the firmware never sees two packets glued together
+ * The free lists are only touched by the event thread, completion callbacks run on it too
+ *
+ * A partial WRITE packet is held back until it fills up, its oldest write is coalesce_us old,
+ * a command packet or an ASYNC_FLUSH follows, or usbsid_flush raised flush_request
+ *
+ * Reads are queued like any other packet so they are sent in order behind the writes
+ * ASYNC_READS IN transfers are kept posted, their data is appended to the rx ring as it arrives
+ * The reader knows how many bytes came in before its request and waits for its own reply
+ */
+
+int usbSIDAsyncSetup(usbsid_dev *dev)
+{
+    dev->ring_head = dev->ring_tail = 0;
+    dev->pump_head = 0;
+    dev->flush_request = false;
+    dev->in_flight = 0;
+    dev->n_free = 0;
+    dev->dma = true;
+    printf("[USBSID] coalescing writes for %u us\r\n", dev->us->coalesce_us.load());
+    for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+        dev->buffer[i] = (dev->dma ? libusb_dev_mem_alloc(dev->devh, LEN_OUT_BUFFER_ASYNC) : NULL);
+        if (dev->buffer[i] == NULL) {
+            if (dev->dma) {
+                fprintf(stderr, "libusb_dev_mem_alloc failed on async buffers, allocating with malloc\n");
+                for (int j = 0; j < i; j++) libusb_dev_mem_free(dev->devh, dev->buffer[j], LEN_OUT_BUFFER_ASYNC);
+                dev->dma = false;
+                i = -1;
+                continue;
+            }
+            dev->buffer[i] = (uint8_t*)malloc( (sizeof(uint8_t)) * LEN_OUT_BUFFER_ASYNC );
+        }
+        if (dev->transfer[i] == NULL) dev->transfer[i] = libusb_alloc_transfer(0);
+        if (dev->transfer[i] == NULL) {
+            fprintf(stderr, "Error allocating async transfer %d\n", i);
+            return -1;
+        }
+        dev->slot[i].dev = dev;
+        dev->slot[i].index = i;
+        libusb_fill_bulk_transfer(dev->transfer[i], dev->devh, EP_OUT_ADDR, dev->buffer[i], LEN_OUT_BUFFER_ASYNC, sid_async_out, &dev->slot[i], 0);
+        dev->free[dev->n_free++] = i;
+    }
+
+    dev->rx_head = dev->rx_want = 0;
+    dev->rx_posted = 0;
+    for (int i = 0; i < ASYNC_READS; i++) {
+        dev->buffer_rx[i] = (uint8_t*)malloc( (sizeof(uint8_t)) * LEN_OUT_BUFFER_ASYNC );
+        dev->transfer_rx[i] = libusb_alloc_transfer(0);
+        if (dev->buffer_rx[i] == NULL || dev->transfer_rx[i] == NULL) {
+            fprintf(stderr, "Error allocating read transfer %d\n", i);
+            return -1;
+        }
+        /* Max packet size, a reply ends the transfer with a short packet */
+        libusb_fill_bulk_transfer(dev->transfer_rx[i], dev->devh, EP_IN_ADDR, dev->buffer_rx[i], LEN_OUT_BUFFER_ASYNC, sid_async_in, dev, 0);
+    }
+    return 0;
+}
+
+void usbSIDAsyncFree(usbsid_dev *dev)
 {
+    /* Reads still posted when the event thread never ran, e.g. a failed setup */
+    for (int i = 0; i < ASYNC_READS; i++) {
+        if (dev->transfer_rx[i] != NULL) libusb_cancel_transfer(dev->transfer_rx[i]);
+    }
+    for (int tries = 0; dev->rx_posted.load() > 0 && tries < 100; tries++) {
+        struct timeval tv = { 0, ASYNC_IDLE_US };
+        libusb_handle_events_timeout_completed(dev->us->ctx, &tv, NULL);
+    }
+    for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+        if (dev->transfer[i] != NULL) libusb_free_transfer(dev->transfer[i]);
+        dev->transfer[i] = NULL;
+        if (dev->buffer[i] == NULL) continue;
+        if (dev->dma) {
+            libusb_dev_mem_free(dev->devh, dev->buffer[i], LEN_OUT_BUFFER_ASYNC);
+        } else {
+            free(dev->buffer[i]);
+        }
+        dev->buffer[i] = NULL;
+    }
+    dev->n_free = 0;
+    for (int i = 0; i < ASYNC_READS; i++) {
+        if (dev->transfer_rx[i] != NULL) libusb_free_transfer(dev->transfer_rx[i]);
+        dev->transfer_rx[i] = NULL;
+        free(dev->buffer_rx[i]);
+        dev->buffer_rx[i] = NULL;
+    }
+}
+
+int usbSIDArmReads(usbsid_dev *dev)
+{
+    for (int i = 0; i < ASYNC_READS; i++) {
+        dev->rx_posted++;
+        int rc = libusb_submit_transfer(dev->transfer_rx[i]);
+        if (rc < 0) {
+            fprintf(stderr, "Error posting read transfer: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+            dev->rx_posted--;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Wakes the event thread if it is blocked waiting for events */
+static inline void usbSIDWake(usbsid_ctx *us)
+{
+    if (us->async_idle.exchange(0)) libusb_interrupt_event_handler(us->ctx);
+}
+
+void usbSIDQueue(usbsid_dev *dev, uint8_t kind, uint8_t d0, uint8_t d1, uint8_t d2, uint16_t cycles)
+{
+    uint32_t head = dev->ring_head.load(std::memory_order_relaxed);
+    uint32_t tail = dev->ring_tail.load(std::memory_order_acquire);
+    while ((head - tail) >= ASYNC_RING_SIZE) {
+        usbSIDWake(dev->us);  /* Ring full, wait for the event thread to catch up */
+        std::this_thread::yield();
+        tail = dev->ring_tail.load(std::memory_order_acquire);
+    }
+    usbsid_queued *q = &dev->ring[head & (ASYNC_RING_SIZE - 1)];
+    q->kind = kind;
+    q->data[0] = d0, q->data[1] = d1, q->data[2] = d2;
+    q->cycles = cycles;
+    q->time_us = usbSIDNowUs();
+    dev->ring_head.store((head + 1), std::memory_order_release);
+    /* Only wake the event thread when there is something to send or a window to start */
+    uint32_t per_packet = (kind == ASYNC_CYCLED ? ASYNC_CYCLED_WRITES : ASYNC_WRITES);
+    bool packed = (kind == ASYNC_WRITE || kind == ASYNC_CYCLED);
+    if (!packed || dev->us->coalesce_us == 0 || head == tail || ((head + 1 - tail) % per_packet) == 0) {
+        usbSIDWake(dev->us);
+    }
+}
+
+int usbSIDPump(usbsid_dev *dev)
+{
+    /* Taken before the head, so everything queued before the request is sent */
+    bool flush = dev->flush_request.exchange(false, std::memory_order_acq_rel);
+    uint32_t tail = dev->ring_tail.load(std::memory_order_relaxed);
+    uint32_t head = dev->ring_head.load(std::memory_order_acquire);
+    uint32_t window = dev->us->coalesce_us.load(std::memory_order_relaxed);
+    int due_us = ASYNC_IDLE_US, rc;
+    dev->pump_head = head;
+    while (tail != head && dev->n_free > 0) {
+        usbsid_queued *q = &dev->ring[tail & (ASYNC_RING_SIZE - 1)];
+        if (q->kind == ASYNC_FLUSH) {  /* Nothing in progress to flush */
+            dev->ring_tail.store(++tail, std::memory_order_release);
+            continue;
+        }
+        int n = 0;
+        uint8_t kind = q->kind;
+        if (kind == ASYNC_WRITE || kind == ASYNC_CYCLED) {
+            /* Hold back a partial packet that has nothing behind it and is still within the window */
+            int max = (kind == ASYNC_WRITE ? ASYNC_WRITES : ASYNC_CYCLED_WRITES);
+            while ((tail + n) != head && n < max && dev->ring[(tail + n) & (ASYNC_RING_SIZE - 1)].kind == kind) n++;
+            if (!flush && n < max && (tail + n) == head) {
+                int age = (int)(usbSIDNowUs() - q->time_us);
+                if (age < (int)window) {
+                    due_us = ((int)window - age);
+                    break;
+                }
+            }
+        }
+
+        int i = dev->free[--dev->n_free];
+        uint8_t *buff = dev->buffer[i];
+        memset(buff, 0, LEN_OUT_BUFFER_ASYNC);
+        if (kind == ASYNC_PACKET || kind == ASYNC_READ) {
+            memcpy(buff, q->data, 3);
+            tail++;
+        } else {
+            for (int w = 0; w < n; w++, tail++) {
+                q = &dev->ring[tail & (ASYNC_RING_SIZE - 1)];
+                if (kind == ASYNC_WRITE) {
+                    buff[1 + (w * 2)] = q->data[0];
+                    buff[2 + (w * 2)] = q->data[1];
+                } else {
+                    buff[1 + (w * 4)] = q->data[0];
+                    buff[2 + (w * 4)] = q->data[1];
+                    buff[3 + (w * 4)] = (q->cycles >> 8);
+                    buff[4 + (w * 4)] = (q->cycles & 0xFF);
+                }
+            }
+            buff[0] = (kind == ASYNC_WRITE ? ((WRITE << 6) | (n * 2)) : ((CYCLED_WRITE << 6) | (n * 4)));
+            if (tail != head && dev->ring[tail & (ASYNC_RING_SIZE - 1)].kind == ASYNC_FLUSH) tail++;
+        }
+        dev->ring_tail.store(tail, std::memory_order_release);  /* Slots are free once copied */
+
+        dev->in_flight++;
+        rc = libusb_submit_transfer(dev->transfer[i]);
+        if (rc < 0) {
+            fprintf(stderr, "Error during async transfer submit: %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
+            dev->in_flight--;
+            dev->free[dev->n_free++] = i;
+            break;
+        }
+    }
+    if (flush && tail != head) dev->flush_request = true;  /* Out of transfers, keep it for the next pump */
+    return due_us;
+}
+
+void usbSIDWaitIdle(usbsid_dev *dev)
+{
+    usbSIDQueue(dev, ASYNC_FLUSH, 0x0, 0x0, 0x0);
+    while (!dev->us->exit_thread && (dev->ring_tail.load() != dev->ring_head.load() || dev->in_flight.load() > 0)) {
+        usbSIDWake(dev->us);
+        struct timespec ts = { 0, (ASYNC_WAIT_POLL_US * 1000) };  /* Sleep, the device may NAK for a while */
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* True when any device has something the pump has not looked at yet */
+static bool usbSIDPending(usbsid_ctx *us)
+{
+    for (int d = 0; d < us->n_devices; d++) {
+        usbsid_dev *dev = us->devices[d];
+        if ((dev->ring_head.load() != dev->pump_head || dev->flush_request.load()) && dev->n_free > 0) return true;
+    }
+    return false;
+}
+
+static bool usbSIDBusy(usbsid_ctx *us)
+{
+    for (int d = 0; d < us->n_devices; d++) {
+        usbsid_dev *dev = us->devices[d];
+        if (dev->ring_tail.load() != dev->ring_head.load() || dev->in_flight.load() > 0) return true;
+    }
+    return false;
+}
+
+void *usbSIDStart(void *arg)
+{
+    usbsid_ctx *us = (usbsid_ctx *)arg;
     fprintf(stdout, "[USBSID] Thread started\r\n");
-    pthread_detach(pthread_self());
-    fprintf(stdout, "[USBSID] Thread detached\r\n");
 
-    while(!exit_thread) {
-        while (!write_completed)
-            libusb_handle_events_completed(ctx, &write_completed);
+    struct timeval tv;
+    while(!us->exit_thread) {
+        int due_us = ASYNC_IDLE_US;
+        for (int d = 0; d < us->n_devices; d++) {
+            due_us = std::min(due_us, usbSIDPump(us->devices[d]));
+        }
+        /* Announce idle before the last check, a write queued after it wakes us up */
+        us->async_idle = 1;
+        if (usbSIDPending(us)) {
+            us->async_idle = 0;
+            continue;
+        }
+        tv = { 0, due_us };
+        libusb_handle_events_timeout_completed(us->ctx, &tv, NULL);
+        us->async_idle = 0;
+    }
+
+    /* Send what is left before the transfers are freed */
+    us->coalesce_us = 0;
+    for (int tries = 0; usbSIDBusy(us) && tries < 100; tries++) {
+        for (int d = 0; d < us->n_devices; d++) usbSIDPump(us->devices[d]);
+        tv = { 0, ASYNC_IDLE_US };
+        libusb_handle_events_timeout_completed(us->ctx, &tv, NULL);
+    }
+
+    /* Take down the posted reads, their callbacks have to run before the transfers are freed */
+    for (int d = 0; d < us->n_devices; d++) {
+        for (int i = 0; i < ASYNC_READS; i++) {
+            if (us->devices[d]->transfer_rx[i] != NULL) libusb_cancel_transfer(us->devices[d]->transfer_rx[i]);
+        }
+    }
+    for (int tries = 0; tries < 100; tries++) {
+        int posted = 0;
+        for (int d = 0; d < us->n_devices; d++) posted += us->devices[d]->rx_posted.load();
+        if (posted == 0) break;
+        tv = { 0, ASYNC_IDLE_US };
+        libusb_handle_events_timeout_completed(us->ctx, &tv, NULL);
     }
     fprintf(stdout, "[USBSID] Thread finished\r\n");
     pthread_exit(NULL);
     return NULL;
 }
 
-void usbSIDWrite(unsigned char *buff)
+void usbSIDWrite(usbsid_dev *dev, unsigned char *buff)
 {
-    write_completed = 0;
-    memcpy(out_buffer, buff, 3);
     if (ASYNC_THREADING == 0) {
-        libusb_submit_transfer(transfer_out);
-        libusb_handle_events_completed(ctx, NULL);
+        dev->write_completed = 0;
+        memcpy(dev->out_buffer, buff, 3);
+        libusb_submit_transfer(dev->transfer_out);
+        libusb_handle_events_completed(dev->us->ctx, NULL);
+    } else {
+        usbSIDQueue(dev, ASYNC_PACKET, buff[0], buff[1], buff[2]);
     }
 }
 
-void usbSIDRead_toBuff(unsigned char *writebuff)
+void usbSIDRead_toBuff(usbsid_dev *dev, unsigned char *writebuff)
 {
-    if (ASYNC_THREADING == 0) {  /* Reading not supported with async write */
-        read_completed = 0;
-        memcpy(out_buffer, writebuff, 4);
-        libusb_submit_transfer(transfer_out);
-        libusb_handle_events_completed(ctx, NULL);
-        libusb_submit_transfer(transfer_in);
-        libusb_handle_events_completed(ctx, &read_completed);
+    if (ASYNC_THREADING == 0) {
+        /* IN is posted before OUT so both are in flight and the reply is picked up in one round trip */
+        dev->read_completed = dev->write_completed = 0;
+        memcpy(dev->out_buffer, writebuff, 3);
+        libusb_submit_transfer(dev->transfer_in);
+        libusb_submit_transfer(dev->transfer_out);
+        libusb_handle_events_completed(dev->us->ctx, &dev->read_completed);
+        libusb_handle_events_completed(dev->us->ctx, &dev->write_completed);
+    } else {  /* Queued behind the writes, the reply comes in on a posted transfer */
+        if (usbSIDReadAsync(dev, writebuff, dev->in_buffer, LEN_IN_BUFFER) < 0) {
+            dev->in_buffer[0] = 0xFF;
+        }
     }
 }
 
-unsigned char usbSIDRead(unsigned char *writebuff, unsigned char *buff)
+int usbSIDReadAsync(usbsid_dev *dev, const uint8_t *packet, uint8_t *reply, int n)
 {
-    if (ASYNC_THREADING == 0) {  /* Reading not supported with async write */
-        usbSIDRead_toBuff(writebuff);
-        memcpy(buff, in_buffer, 1);
-    } else {
-        buff[0] = 0xFF;
+    /* Replies arrive in request order, this one starts where the last one asked for ends
+     * A late reply to a read that timed out lands before it and is skipped */
+    uint32_t at = dev->rx_want;
+    dev->rx_want = (at + n);
+    usbSIDQueue(dev, ASYNC_READ, packet[0], packet[1], packet[2]);
+    uint32_t start = usbSIDNowUs();
+    while ((int32_t)(dev->rx_head.load(std::memory_order_acquire) - dev->rx_want) < 0) {
+        if (dev->rx_posted.load() == 0 || (usbSIDNowUs() - start) > ASYNC_READ_TIMEOUT_US) {
+            fprintf(stderr, "Error: %s read timed out\n", dev->serial);
+            return -1;
+        }
+        std::this_thread::yield();
+    }
+    for (int i = 0; i < n; i++) {
+        reply[i] = dev->rx[(at + i) & (ASYNC_RX_SIZE - 1)];
     }
+    return n;
+}
+
+unsigned char usbSIDRead(usbsid_dev *dev, unsigned char *writebuff, unsigned char *buff)
+{
+    usbSIDRead_toBuff(dev, writebuff);
+    memcpy(buff, dev->in_buffer, 1);
 
     return buff[0];
 }
 
-void usbSIDPause(void)
+void usbSIDPause(usbsid_dev *dev)
 {
-    unsigned char buff[4] = {0x2, 0x0, 0x0, 0x0};
-    usbSIDWrite(buff);
+    unsigned char buff[3] = {((COMMAND << 6) | PAUSE), 0x0, 0x0};
+    usbSIDWrite(dev, buff);
 }
 
-void usbSIDReset(void)
+void usbSIDReset(usbsid_dev *dev)
 {
-    unsigned char buff[4] = {0x3, 0x0, 0x0, 0x0};
-    usbSIDWrite(buff);
+    unsigned char buff[3] = {((COMMAND << 6) | RESET_SID), 0x0, 0x0};
+    usbSIDWrite(dev, buff);
 }
 
-void LIBUSB_CALL sid_out(struct libusb_transfer *transfer)
+void usbSIDMute(usbsid_dev *dev, bool mute)
 {
+    unsigned char buff[3] = {((COMMAND << 6) | (mute ? MUTE : UNMUTE)), 0x0, 0x0};
+    usbSIDWrite(dev, buff);
+}
 
-    write_completed = (*(int *)transfer->user_data);
-
+void LIBUSB_CALL sid_out(struct libusb_transfer *transfer)
+{
+    int *write_completed = (int *)transfer->user_data;
 
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        rc = transfer->status;
+        int rc = transfer->status;
         if (rc != LIBUSB_TRANSFER_CANCELLED) {
 		    fprintf(stderr, "Warning: transfer out interrupted with status %d, %s: %s\n", rc, libusb_error_name(rc), libusb_strerror(rc));
             print_libusb_transfer(transfer);
         }
-		libusb_free_transfer(transfer);
+        *write_completed = 1;
         return;
     }
 
-    if (transfer->actual_length != out_buffer_length) {
-        fprintf(stderr, "Sent data length %d is different from the defined buffer length: %d or actual length %d\n", transfer->length, out_buffer_length, transfer->actual_length);
+    if (transfer->actual_length != transfer->length) {
+        fprintf(stderr, "Sent data length %d is different from the defined buffer length: %d\n", transfer->actual_length, transfer->length);
         print_libusb_transfer(transfer);
     }
 
     #ifdef USBSID_DEBUG
     {
         USBSIDDBG("SID_OUT: ");
-        for (int i = 0; i <= sizeof(transfer->buffer); i++) USBSIDDBG("$%02x ", transfer->buffer[i]);
+        for (int i = 0; i < transfer->length; i++) USBSIDDBG("$%02x ", transfer->buffer[i]);
         USBSIDDBG("\r\n");
     }
     #endif
 
-    if (ASYNC_THREADING == 1) {
-        rc = libusb_submit_transfer(transfer);
-        if (rc < 0) {
-            fprintf(stderr, "Error during transfer_out submit transfer: %s\n", libusb_error_name(rc));
+    *write_completed = 1;
+}
+
+void LIBUSB_CALL sid_async_out(struct libusb_transfer *transfer)
+{
+    usbsid_slot *slot = (usbsid_slot *)transfer->user_data;
+    usbsid_dev *dev = slot->dev;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "Warning: async transfer out interrupted with status %d, %s: %s\n", transfer->status, libusb_error_name(transfer->status), libusb_strerror(transfer->status));
+        print_libusb_transfer(transfer);
+    }
+
+    /* Back on the free list, the event thread refills it on its next pump */
+    dev->free[dev->n_free++] = slot->index;
+    dev->in_flight--;
+}
+
+void LIBUSB_CALL sid_async_in(struct libusb_transfer *transfer)
+{
+    usbsid_dev *dev = (usbsid_dev *)transfer->user_data;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        uint32_t head = dev->rx_head.load(std::memory_order_relaxed);
+        for (int i = 0; i < transfer->actual_length; i++) {
+            dev->rx[(head + i) & (ASYNC_RX_SIZE - 1)] = transfer->buffer[i];
+        }
+        uint32_t end = (head + transfer->actual_length);
+        if (dev->probe_pending.load(std::memory_order_acquire) && !dev->probe_done.load(std::memory_order_relaxed)
+            && (int32_t)(end - dev->probe_end) >= 0) {  /* Stamped here, the producer may not look for a while */
+            uint8_t report[CYCLE_REPORT_SIZE];
+            for (int i = 0; i < CYCLE_REPORT_SIZE; i++) {
+                report[i] = dev->rx[(dev->probe_end - LEN_OUT_BUFFER_ASYNC + i) & (ASYNC_RX_SIZE - 1)];
+            }
+            dev->probe_ns = usbSIDNowNs();
+            dev->probe_ok = usbSIDParseCycles(report, &dev->probe_cycles, &dev->probe_millihz);
+            dev->probe_done.store(true, std::memory_order_release);
         }
+        dev->rx_head.store(end, std::memory_order_release);
+    } else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "Warning: read transfer interrupted with status %d, %s: %s\n", transfer->status, libusb_error_name(transfer->status), libusb_strerror(transfer->status));
+        print_libusb_transfer(transfer);
     }
 
-    write_completed = 1;
+    /* Repost right away, it goes to the back of the endpoint queue so replies stay in order */
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED || dev->us->exit_thread || libusb_submit_transfer(transfer) < 0) {
+        dev->rx_posted--;
+    }
 }
 
 void LIBUSB_CALL sid_in(struct libusb_transfer *transfer)
 {
-
-    read_completed = (*(int *)transfer->user_data);
+    int *read_completed = (int *)transfer->user_data;
 
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        rc = transfer->status;
+        int rc = transfer->status;
 		if (rc != LIBUSB_TRANSFER_CANCELLED) {
             fprintf(stderr, "Warning: transfer in interrupted with status '%s'\n", libusb_error_name(rc));
             print_libusb_transfer(transfer);
         }
-        libusb_free_transfer(transfer);
+        transfer->buffer[0] = 0xFF;
+        *read_completed = 1;
         return;
     }
 
-    /* if (transfer->actual_length != LEN_IN_BUFFER) {
-        fprintf(stderr, "Received data length %d is different from the defined buffer length: %d or actual length: %d\n", transfer->length, LEN_IN_BUFFER, transfer->actual_length);
-        print_libusb_transfer(transfer_in);
-    } */
-
-    read_completed = 1;
-    memcpy(result, in_buffer, 1); /* Copy read data to result */
+    *read_completed = 1;
     #ifdef USBSID_DEBUG
     {
         USBSIDDBG("SID_IN: ");
-        for (int i = 0; i <= sizeof(transfer->buffer); i++) USBSIDDBG("$%02x ", transfer->buffer[i]);
+        for (int i = 0; i < transfer->actual_length; i++) USBSIDDBG("$%02x ", transfer->buffer[i]);
         USBSIDDBG("\r\n");
     }
     #endif
@@ -342,21 +898,23 @@ void print_libusb_transfer(struct libusb_transfer *p_t)
 	return;
 }
 
-uint16_t sid_address(uint16_t addr)
+uint16_t sid_address(usbsid_ctx *us, uint16_t addr)
 {
+  const usbsid_sidtype *t = us->sidtype;
+  int sidtype = (int)(t - sidtypes);
   /* Set address for SID no# */
   /* D500, DE00 or DF00 is the second sid in SIDTYPE1, 3 & 4 */
   /* D500, DE00 or DF00 is the third sid in all other SIDTYPE */
   switch (addr) {
     case 0xD400 ... 0xD499:
-      switch (SIDTYPE) {
+      switch (sidtype) {
         case SIDTYPE1:
         case SIDTYPE3:
         case SIDTYPE4:
           return addr; /* $D400 -> $D479 */
           break;
         case SIDTYPE2:
-          return ((addr & SIDLMASK) >= 0x20) ? (SID2ADDR | (addr & SID1MASK)) : addr;
+          return ((addr & SIDLMASK) >= 0x20) ? (t->addr[1] | (addr & t->mask[0])) : addr;
           break;
         case SIDTYPE5:
           return ((addr & SIDLMASK) >= 0x20) && ((addr & SIDLMASK) <= 0x39) /* $D420~$D439 -> $D440~$D459 */
@@ -369,19 +927,19 @@ uint16_t sid_address(uint16_t addr)
       break;
     case 0xD500 ... 0xD599:
     case 0xDE00 ... 0xDF99:
-      switch (SIDTYPE) {
+      switch (sidtype) {
         case SIDTYPE1:
         case SIDTYPE2:
-          return (SID2ADDR | (addr & SID1MASK));
+          return (t->addr[1] | (addr & t->mask[0]));
           break;
         case SIDTYPE3:
-          return (SID3ADDR | (addr & SID1MASK));
+          return (t->addr[2] | (addr & t->mask[0]));
           break;
         case SIDTYPE4:
-          return (SID3ADDR | (addr & SID2MASK));
+          return (t->addr[2] | (addr & t->mask[1]));
           break;
         case SIDTYPE5:
-          return (SID1ADDR | (addr & SIDUMASK));
+          return (t->addr[0] | (addr & SIDUMASK));
           break;
       }
       break;
@@ -389,63 +947,461 @@ uint16_t sid_address(uint16_t addr)
       return addr;
       break;
   }
+  return addr;  /* SIDTYPE0 and unmapped ranges */
+}
+
+int64_t CycleFromTimestamp(usbsid_ctx *us, timestamp_t timestamp)
+{
+  auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp - us->start_time);
+  return (int64_t)(nsec.count() * us->inv_cycle_ns);
+}
+
+/* Host side pacing
+ *
+ * Deadlines are absolute on CLOCK_MONOTONIC and follow the cycle count since the start
+ * of the timeline, so rounding never adds up. The bulk of a wait is a clock_nanosleep
+ * until just before the deadline, the last stretch is spun. The spin tail follows the
+ * measured oversleep of clock_nanosleep. Waits shorter than WAIT_MIN_NS are carried over
+ * to the next call instead of waking up for them.
+ */
+static const int64_t jitter_limit_ns[JITTER_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000
+};
+
+/* Sleeps until deadline_ns, spinning the last spin_ns when spin is set
+ * Returns how late the wake up was */
+static int64_t usbSIDSleepUntil(usbsid_ctx *us, int64_t deadline_ns, bool spin)
+{
+    int64_t wake_ns = (spin ? (deadline_ns - us->spin_ns) : deadline_ns);
+    int64_t now = usbSIDNowNs();
+    if (wake_ns > now) {
+        struct timespec ts = { (time_t)(wake_ns / 1000000000), (long)(wake_ns % 1000000000) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        now = usbSIDNowNs();
+        if (spin) {  /* Spin tail is twice the average oversleep, within bounds */
+            us->oversleep_avg_ns += (((now - wake_ns) - us->oversleep_avg_ns) / 8);
+            us->spin_ns = std::max((int64_t)SPIN_MIN_NS, std::min((int64_t)SPIN_MAX_NS, (us->oversleep_avg_ns * 2)));
+        }
+    }
+    while (spin && now < deadline_ns) {
+        now = usbSIDNowNs();
+    }
+    return (now - deadline_ns);
+}
+
+int WaitForCycle(usbsid_ctx *us, int cycle)
+{
+    int64_t now = usbSIDNowNs();
+    if (!us->wait_started) {
+        us->wait_start_ns = now;
+        us->wait_cycles = 0;
+        us->wait_started = true;
+    }
+    us->wait_cycles += cycle;
+    int64_t deadline = us->wait_start_ns + (int64_t)(us->wait_cycles * us->cycle_ns);
+    int64_t wait_nsec = (deadline - now);
+    if (wait_nsec < -WAIT_LATE_NS) {  /* Host stalled, restart the timeline instead of bursting to catch up */
+        us->wait_start_ns = now;
+        us->wait_cycles = 0;
+        return 0;
+    }
+    if (wait_nsec < WAIT_MIN_NS) {
+        return 0;
+    }
+    /* Cycle boundary, send what was written before the host sleeps */
+    usbsid_flush(us);
+    int64_t late = usbSIDSleepUntil(us, deadline, true);
+    int bucket = 0;
+    while (bucket < (JITTER_BUCKETS - 1) && late >= jitter_limit_ns[bucket]) bucket++;
+    us->jitter_hist[bucket]++;
+    return (int)(wait_nsec * us->inv_cycle_ns);
+}
+
+void usbsid_jitter_histogram(usbsid_ctx *us, uint64_t *hist)
+{
+    memcpy(hist, us->jitter_hist, sizeof(us->jitter_hist));
+}
 
+void usbSIDPrintJitter(usbsid_ctx *us)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < JITTER_BUCKETS; i++) total += us->jitter_hist[i];
+    if (total == 0) return;
+    printf("[USBSID] WaitForCycle wake up lateness over %lu waits, spin tail %ld ns\r\n", (unsigned long)total, (long)us->spin_ns);
+    for (int i = 0; i < JITTER_BUCKETS; i++) {
+        if (i < (JITTER_BUCKETS - 1)) {
+            printf("[USBSID]   < %6ld ns: %lu\r\n", (long)jitter_limit_ns[i], (unsigned long)us->jitter_hist[i]);
+        } else {
+            printf("[USBSID]  >= %6ld ns: %lu\r\n", (long)jitter_limit_ns[i - 1], (unsigned long)us->jitter_hist[i]);
+        }
+    }
 }
 
-int64_t CycleFromTimestamp(timestamp_t timestamp)
+/* Host side pacing for cycled writes ~ the device delay_timer does the exact timing
+ * The host only sleeps when a device timeline runs too far ahead, so its queue stays short */
+void usbSIDPace(usbsid_dev *dev)
 {
-  auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp - m_StartTime);
-  return (int64_t)(nsec.count() * m_InvCPUcycleDurationNanoSeconds);
+    usbsid_ctx *us = dev->us;
+    int64_t now = usbSIDNowNs();
+    usbSIDDrift(dev, now);
+    int64_t clock_ns = (int64_t)(dev->clock * dev->cycle_ns);
+    if (!dev->pace_started) {
+        dev->pace_start_ns = (now - clock_ns);
+        dev->pace_started = true;
+    }
+    int64_t ahead = (int64_t)dev->clock - (int64_t)((now - dev->pace_start_ns) / dev->cycle_ns);
+    if (ahead < -(int64_t)us->ahead_cycles) {  /* Host stalled, restart the timeline instead of bursting to catch up */
+        dev->pace_start_ns = (now - clock_ns);
+        return;
+    }
+    if (ahead > (int64_t)us->ahead_cycles) {
+        usbSIDQueue(dev, ASYNC_FLUSH, 0x0, 0x0, 0x0);  /* Only this device, other rings have their own producers */
+        usbSIDSleepUntil(us, (dev->pace_start_ns + clock_ns - (int64_t)((us->ahead_cycles / 2) * dev->cycle_ns)), false);
+    }
 }
 
-int WaitForCycle(int cycle)
+/* Drift estimation
+ *
+ * Every DRIFT_PROBE_NS a CYCLE_COUNT request is queued like a read. The device answers with
+ * its PHI2 cycles since boot, derived from its own timer, and the event thread stamps the reply
+ * with the host clock. The cycles between the first and the latest sample over the host time
+ * between them is the device clock as seen by the host, the long span averages out the USB jitter.
+ * Once the span covers DRIFT_MIN_NS the pacing follows that rate so the device queue stays centred.
+ */
+void usbSIDDrift(usbsid_dev *dev, int64_t now)
 {
-    // HDBG("[cycles]%d\r\n", cycle);
-    timestamp_t now = std::chrono::high_resolution_clock::now();
-    double dur_ = cycle * m_CPUcycleDuration;
-    duration_t dur = (duration_t)(int64_t)dur_;
-    auto target_time = m_NextTime + dur;
-    auto target_delta = target_time - now;
-    auto wait_msec = std::chrono::duration_cast<std::chrono::milliseconds>(target_delta);
-    // auto wait_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(target_delta);
-    auto wait_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(target_delta * 1000);
-    // HDBG("[now]%d [dur_]%d [dur]%d [target_time]%d [target_delta]%d [wait_msec]%d [wait_nsec]%d\r\n", now, dur_, dur, target_time, target_delta, wait_msec, wait_nsec);
-    if (wait_msec.count() > 0) {
-        /* for (int i = 0; i < (int)m_Devices.size(); ++i) {
-        m_Devices[i]->SoftFlush();
-        } */
-        // POOP
-        // HDBG("Waiting for %lu milliseconds\r\n", wait_msec);
-        std::this_thread::sleep_for(wait_msec);
+    usbsid_ctx *us = dev->us;
+    if (dev->drift_off) return;
+    if (!dev->probe_pending.load(std::memory_order_relaxed)) {
+        if ((now - dev->probe_sent_ns) < DRIFT_PROBE_NS) return;
+        /* Counted like a read, the reply ends a full packet after the last reply asked for */
+        dev->probe_end = (dev->rx_want + LEN_OUT_BUFFER_ASYNC);
+        dev->rx_want = dev->probe_end;
+        dev->probe_sent_ns = now;
+        dev->probe_pending.store(true, std::memory_order_release);
+        usbSIDQueue(dev, ASYNC_READ, ((COMMAND << 6) | CONFIG), CYCLE_COUNT, 0x0);
+        return;
+    }
+    if (!dev->probe_done.load(std::memory_order_acquire)) {
+        if ((now - dev->probe_sent_ns) > DRIFT_LOST_NS) {
+            fprintf(stderr, "Warning: %s cycle count probe lost, drift estimation off\n", dev->serial);
+            dev->drift_off = true;
+            dev->probe_pending = false;
+            dev->rx_want = dev->rx_head.load(std::memory_order_acquire);  /* No reply coming, reads start over from here */
+        }
+        return;
+    }
+    dev->probe_done = false;
+    dev->probe_pending = false;
+    if (!dev->probe_ok) return;
+
+    if (dev->probe_millihz != 0 && dev->probe_millihz != dev->nominal_millihz) {  /* Device clock changed, fit the new rate */
+        dev->nominal_millihz = dev->probe_millihz;
+        dev->drift_started = false;
+        dev->drift_span_ns = 0;
+        dev->drift_ppm = 0;
+        dev->cycle_ns = usbSIDNominalNs(dev);
+        dev->pace_started = false;
+    }
+    int64_t span = (dev->probe_ns - dev->drift_base_ns);
+    if (!dev->drift_started || span <= 0) {
+        dev->drift_base_ns = dev->probe_ns;
+        dev->drift_base_cycles = dev->probe_cycles;
+        dev->drift_started = true;
+        return;
+    }
+    double rate = ((double)(dev->probe_cycles - dev->drift_base_cycles) * 1e9 / span);
+    double ppm = (((rate * usbSIDNominalNs(dev) / 1e9) - 1.0) * 1e6);
+    if (ppm > DRIFT_MAX_PPM || ppm < -DRIFT_MAX_PPM) {  /* Not a drift, start over */
+        dev->drift_base_ns = dev->probe_ns;
+        dev->drift_base_cycles = dev->probe_cycles;
+        dev->drift_span_ns = 0;
+        dev->drift_ppm = 0;
+        dev->cycle_ns = usbSIDNominalNs(dev);
+        dev->pace_started = false;
+        return;
+    }
+    dev->drift_ppm = ppm;
+    dev->drift_span_ns = span;
+    if (span < DRIFT_MIN_NS || !us->drift_correct) return;
+
+    /* Only the rate changes, the distance to the host clock stays the same */
+    double cycle_ns = (1e9 / rate);
+    if (dev->pace_started) {
+        dev->pace_start_ns = (now - (int64_t)((now - dev->pace_start_ns) * (cycle_ns / dev->cycle_ns)));
     }
-    while (now < target_time) {
-        now = std::chrono::high_resolution_clock::now();
+    dev->cycle_ns = cycle_ns;
+}
+
+/* Advances the timeline of a SID and queues the part the device timeline has not covered yet
+ * as delay records, returns the remaining delay for the next record */
+static uint16_t usbSIDAdvance(usbsid_dev *dev, int sidno, uint32_t cycles)
+{
+    dev->sid_clock[sidno] += cycles;
+    uint64_t delay = (dev->sid_clock[sidno] > dev->clock) ? (dev->sid_clock[sidno] - dev->clock) : 0;
+    dev->clock += delay;
+    while (delay > 0xFFFF) {  /* Longer delays are sent as separate delay records */
+        usbSIDQueue(dev, ASYNC_CYCLED, 0xFF, 0xFF, 0x0, 0xFFFF);
+        delay -= 0xFFFF;
     }
-    m_CurrentTime       = now;
-    m_NextTime          = target_time;
-    int waited_cycles   = (int)(wait_nsec.count() * m_InvCPUcycleDurationNanoSeconds);
-    // HDBG("wait_nsec: %d\r\n", wait_nsec);
-    // HDBG("m_InvCPUcycleDurationNanoSeconds: %f\r\n", (double)m_InvCPUcycleDurationNanoSeconds);
-    // HDBG("[waited_cycles]%d\r\n", waited_cycles);
-    return waited_cycles;
+    return (uint16_t)delay;
+}
+
+static inline bool usbSIDMapped(usbsid_ctx *us, int chipno)
+{
+    return (us != NULL && chipno >= 0 && chipno < us->n_sids);
+}
+
+/* A C64 address ($D400 and up) goes through the SIDTYPE mapping and selects the SID counted from chipno,
+ * slots past the SIDTYPE SID count mirror the first ones like on a C64. A register address (below $D400)
+ * stays on chipno. Leaves the register in addr */
+static inline void usbSIDRoute(usbsid_ctx *us, uint16_t *addr, int *chipno)
+{
+    if (us == NULL || *addr < 0xD400) return;
+    uint16_t mapped = sid_address(us, *addr);
+    *chipno += (((mapped >> 5) & 0x3) % us->sidtype->numsids);
+    *addr = (mapped & 0x1F);
+}
+
+/* Changes the mute mask of a SID on the device */
+static void usbSIDSetMute(usbsid_ctx *us, int chipno, uint8_t bits, bool mute)
+{
+    if (!usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    int sidno = us->sid_map[chipno].sidno;
+    uint8_t next = (mute ? (dev->mute[sidno] | bits) : (dev->mute[sidno] & ~bits));
+    if (next == dev->mute[sidno]) return;
+    dev->mute[sidno] = next;
+    usbSIDSendMute(dev, sidno);
 }
 
-void usbsid_reset(void)
+usbsid_ctx *usbsid_create(void)
+{
+    usbsid_ctx *us = new usbsid_ctx();
+    us->coalesce_us = ASYNC_COALESCE_US;
+    us->read_stale_us = USBSID_READ_STALE_US;
+    us->ahead_cycles = USBSID_AHEAD_CYCLES;
+    us->drift_correct = true;
+    us->sidtype = &sidtypes[SIDTYPE];
+    us->spin_ns = SPIN_DEFAULT_NS;
+    us->oversleep_avg_ns = (SPIN_DEFAULT_NS / 2);
+    us->start_time = std::chrono::high_resolution_clock::now();
+    usbsid_set_clock(us, CLOCK_PAL);
+
+    const char *env = getenv("USBSID_COALESCE_US");
+    if (env != NULL) us->coalesce_us = (uint32_t)strtoul(env, NULL, 10);
+    env = getenv("USBSID_SIDTYPE");
+    if (env != NULL) usbsid_set_sidtype(us, atoi(env));
+    env = getenv("USBSID_CLOCK");
+    if (env != NULL) usbsid_set_clock(us, (uint32_t)strtoul(env, NULL, 10));
+    env = getenv("USBSID_READ_STALE_US");
+    if (env != NULL) us->read_stale_us = (uint32_t)strtoul(env, NULL, 10);
+    env = getenv("USBSID_DRIFT_CORRECT");
+    if (env != NULL) us->drift_correct = (atoi(env) != 0);
+    usbsid_set_serials(us, getenv("USBSID_SERIALS"));
+    return us;
+}
+void usbsid_destroy(usbsid_ctx *us)
+{
+    if (us == NULL) return;
+    usbSIDExit(us);
+    delete us;
+}
+int usbsid_set_serials(usbsid_ctx *us, const char *serials)
+{
+    if (us->n_devices > 0) return -1;  /* Already open */
+    snprintf(us->serials, USBSID_SERIALS_LEN, "%s", (serials != NULL ? serials : ""));
+    return 0;
+}
+int usbsid_open(usbsid_ctx *us)
+{
+    return usbSIDSetup(us);
+}
+int usbsid_close(usbsid_ctx *us)
+{
+    return usbSIDExit(us);
+}
+void usbsid_reset(usbsid_ctx *us, int chipno)
+{
+    if (!usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    us->wait_started = dev->pace_started = false;
+    dev->clock = 0;
+    memset(dev->sid_clock, 0, sizeof(dev->sid_clock));
+    memset(dev->shadow, 0, sizeof(dev->shadow));
+    usbSIDReset(dev);
+}
+int usbsid_sids(usbsid_ctx *us)
+{
+    return (us != NULL ? us->n_sids : 0);
+}
+void usbsid_serial(usbsid_ctx *us, int chipno, char *output, int size)
+{
+    if (size <= 0) return;
+    snprintf(output, size, "%s", (usbSIDMapped(us, chipno) ? us->sid_map[chipno].dev->serial : ""));
+}
+/* Write-only registers are answered from the shadow cache, only the live registers
+ * go to the device and only when their cached value is older than read_stale_us */
+int usbsid_read(usbsid_ctx *us, uint16_t addr, int chipno)
+{
+    usbSIDRoute(us, &addr, &chipno);
+    if (!usbSIDMapped(us, chipno)) return 0xFF;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    int sidno = us->sid_map[chipno].sidno;
+    uint8_t reg = (addr & 0x1f);
+    uint32_t now = usbSIDNowUs();
+    if (!SID_LIVE_REG(reg) || (us->read_stale_us > 0 && (now - dev->shadow_read_us[sidno][reg]) <= us->read_stale_us)) {
+        us->reads_cached++;
+        return dev->shadow[sidno][reg];
+    }
+    unsigned char result;
+    unsigned char buff[3] = { (READ << 6), (reg + (0x20 * sidno)), 0x0 };   /* 3 Byte buffer */
+    usbSIDRead(dev, buff, &result);
+    dev->shadow[sidno][reg] = result;
+    dev->shadow_read_us[sidno][reg] = now;
+    us->reads_device++;
+    return result;
+}
+void usbsid_store(usbsid_ctx *us, uint16_t addr, uint8_t val, int chipno)
+{
+    usbSIDRoute(us, &addr, &chipno);
+    if (!usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    int sidno = us->sid_map[chipno].sidno;
+    uint8_t reg = ((addr & 0x1f) + (0x20 * sidno));
+    dev->shadow[sidno][(addr & 0x1f)] = val;
+    if (ASYNC_THREADING == 1) {
+        usbSIDQueue(dev, ASYNC_WRITE, reg, val, 0x0);
+        return;
+    }
+    unsigned char buff[3] = { (WRITE << 6), reg, val };   /* 3 Byte buffer */
+    usbSIDWrite(dev, buff);
+}
+void usbsid_store_cycled(usbsid_ctx *us, uint16_t addr, uint8_t val, int chipno, uint32_t cycles)
+{
+    if (us == NULL) return;
+    usbSIDRoute(us, &addr, &chipno);
+    if (ASYNC_THREADING == 0) {  /* No device side timing without the async engine */
+        if (cycles > 0) WaitForCycle(us, (int)cycles);
+        usbsid_store(us, addr, val, chipno);
+        return;
+    }
+    if (!usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    int sidno = us->sid_map[chipno].sidno;
+    uint16_t delay = usbSIDAdvance(dev, sidno, cycles);
+    dev->shadow[sidno][(addr & 0x1f)] = val;
+    usbSIDQueue(dev, ASYNC_CYCLED, ((addr & 0x1f) + (0x20 * sidno)), val, 0x0, delay);
+    usbSIDPace(dev);
+}
+void usbsid_delay_cycled(usbsid_ctx *us, int chipno, uint32_t cycles)
+{
+    if (us == NULL) return;
+    if (ASYNC_THREADING == 0) {
+        if (cycles > 0) WaitForCycle(us, (int)cycles);
+        return;
+    }
+    if (!usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    uint16_t delay = usbSIDAdvance(dev, us->sid_map[chipno].sidno, cycles);
+    if (delay > 0) {  /* $FF:$FF with cycles is a delay without a write */
+        usbSIDQueue(dev, ASYNC_CYCLED, 0xFF, 0xFF, 0x0, delay);
+    }
+    usbSIDPace(dev);
+}
+void usbsid_flush(usbsid_ctx *us)
+{
+    if (ASYNC_THREADING == 1 && us != NULL) {
+        for (int d = 0; d < us->n_devices; d++) {
+            us->devices[d]->flush_request.store(true, std::memory_order_release);
+        }
+        usbSIDWake(us);
+    }
+}
+void usbsid_set_coalesce(usbsid_ctx *us, uint32_t window_us)
+{
+    us->coalesce_us = window_us;
+    usbsid_flush(us);
+}
+void usbsid_set_clock(usbsid_ctx *us, uint32_t clock_hz)
+{
+    if (clock_hz == 0) return;
+    us->clock_hz = clock_hz;
+    us->cycle_ns = ((double)ratio_t::den / clock_hz);
+    us->inv_cycle_ns = (1.0 / us->cycle_ns);
+    us->wait_started = false;
+    for (int d = 0; d < us->n_devices; d++) {  /* Devices that report their clock keep pacing on it */
+        us->devices[d]->cycle_ns = usbSIDNominalNs(us->devices[d]);
+        us->devices[d]->pace_started = false;
+    }
+}
+int usbsid_set_sidtype(usbsid_ctx *us, int sidtype)
+{
+    if (sidtype < SIDTYPE0 || sidtype > SIDTYPE5) {
+        fprintf(stderr, "Warning: unknown SIDTYPE %d, keeping SIDTYPE%d\n", sidtype, (int)(us->sidtype - sidtypes));
+        return -1;
+    }
+    us->sidtype = &sidtypes[sidtype];
+    return 0;
+}
+void usbsid_set_read_stale(usbsid_ctx *us, uint32_t stale_us)
+{
+    us->read_stale_us = stale_us;
+}
+void usbsid_wait(usbsid_ctx *us, int chipno)
+{
+    if (ASYNC_THREADING == 0 || !usbSIDMapped(us, chipno)) return;  /* Sync writes are never queued */
+    usbSIDWaitIdle(us->sid_map[chipno].dev);
+}
+void usbsid_sync(usbsid_ctx *us, int chipno)
 {
-    usbSIDReset();
+    if (ASYNC_THREADING == 0 || !usbSIDMapped(us, chipno)) return;
+    usbsid_dev *dev = us->sid_map[chipno].dev;
+    usbSIDWaitIdle(dev);
+    if (dev->pace_started) {  /* The device plays its queue on the host timeline, sleep until about its end */
+        usbSIDSleepUntil(us, (dev->pace_start_ns + (int64_t)(dev->clock * dev->cycle_ns)), false);
+    }
+    /* Barrier ~ the device handles packets in order, the reply to this read comes after the last write played */
+    int sidno = us->sid_map[chipno].sidno;
+    unsigned char result;
+    unsigned char buff[3] = { (READ << 6), (uint8_t)(0x1B + (0x20 * sidno)), 0x0 };  /* OSC3, reading it has no side effects */
+    if (usbSIDReadAsync(dev, buff, &result, 1) == 1) {
+        dev->shadow[sidno][0x1B] = result;
+        dev->shadow_read_us[sidno][0x1B] = usbSIDNowUs();
+    }
+    dev->pace_started = false;  /* Nothing left queued, the next write starts a new timeline */
+}
+void usbsid_set_ahead(usbsid_ctx *us, uint32_t cycles)
+{
+    us->ahead_cycles = (cycles > 0 ? cycles : USBSID_AHEAD_CYCLES);
+}
+void usbsid_mute(usbsid_ctx *us, int chipno, int voice, bool mute)
+{
+    if (voice < 0 || voice > 2) return;
+    usbSIDSetMute(us, chipno, MUTE_VOICE(voice), mute);
 }
-int usbsid_open(void)
+void usbsid_mute_all(usbsid_ctx *us, int chipno, bool mute)
 {
-    return usbSIDSetup();
+    usbSIDSetMute(us, chipno, MUTE_VOLUME, mute);
 }
-int usbsid_read(uint16_t addr, int chipno)
+void usbsid_mute_line(usbsid_ctx *us, bool mute)
 {
-    unsigned char buff[3] = { 0x1, (addr + (0x20 * chipno)), 0x0 };   /* 3 Byte buffer */
-    usbSIDRead(buff, result);
-    return result[0];
+    if (us == NULL) return;
+    for (int d = 0; d < us->n_devices; d++) {
+        usbSIDMute(us->devices[d], mute);
+    }
 }
-void usbsid_store(uint16_t addr, uint8_t val, int chipno)
+double usbsid_drift_ppm(usbsid_ctx *us, int chipno)
 {
-    unsigned char buff[3] = { 0x0, ((addr & 0x1f) + (0x20 * chipno)), val };   /* 3 Byte buffer */
-    usbSIDWrite(buff);
+    if (!usbSIDMapped(us, chipno)) return 0.0;
+    return us->sid_map[chipno].dev->drift_ppm;
+}
+void usbsid_set_drift_correction(usbsid_ctx *us, bool correct)
+{
+    us->drift_correct = correct;
+    if (correct) return;
+    for (int d = 0; d < us->n_devices; d++) {  /* Back to the nominal rate */
+        us->devices[d]->cycle_ns = usbSIDNominalNs(us->devices[d]);
+        us->devices[d]->pace_started = false;
+    }
 }
@@ -8,6 +8,8 @@
 #include <chrono>
 #include <thread>
 #include <cstdint>
+#include <atomic>
+#include <algorithm>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,21 +36,170 @@
 #define LEN_OUT_BUFFER 3
 #define LEN_OUT_BUFFER_ASYNC 64
 
-int ep_out_addr = 0x02;
-int ep_in_addr  = 0x82;
-struct libusb_device_handle *devh = NULL;
-struct libusb_transfer *transfer_out = NULL;  /* OUT-going transfers (OUT from host PC to USB-device) */
-struct libusb_transfer *transfer_in = NULL;  /* IN-coming transfers (IN to host PC from USB-device) */
-libusb_context *ctx = NULL;
-uint8_t * in_buffer;
-uint8_t * out_buffer;
-int read_completed, write_completed;
-int actual_length = 0, rc = -1, sids_found = 0, usid_dev = -1;
-pthread_t ptid;
-int exit_thread = 0;
+/* Async write engine */
+#define ASYNC_TRANSFERS 8     /* Pre-allocated OUT transfers, all can be in flight at once */
+#define ASYNC_RING_SIZE 4096  /* Queued writes between usbsid_store and the event thread, power of 2 */
+#define ASYNC_WRITES    ((LEN_OUT_BUFFER_ASYNC - 1) / 2)  /* Address/value pairs per WRITE packet */
+#define ASYNC_CYCLED_WRITES ((LEN_OUT_BUFFER_ASYNC - 4) / 4)  /* Address/value/cycles records per CYCLED_WRITE packet */
+#define ASYNC_IDLE_US   10000 /* Event thread wakes up at least this often when idle */
+#define ASYNC_READS     4     /* Pre-posted IN transfers, read replies land in the rx ring */
+#define ASYNC_RX_SIZE   256   /* Received bytes not yet picked up by a reader, power of 2 */
+#define ASYNC_READ_TIMEOUT_US 1000000  /* Includes the time queued cycled writes take to play */
+#define ASYNC_WAIT_POLL_US 100  /* Sleep between checks while waiting for the queue to drain */
+#ifndef ASYNC_COALESCE_US
+#define ASYNC_COALESCE_US 500 /* Default time a partial WRITE packet waits for more writes, 0 sends right away */
+#endif
+#ifndef USBSID_AHEAD_CYCLES
+#define USBSID_AHEAD_CYCLES 20000  /* Default for how far cycled writes may run ahead of the host clock before it sleeps */
+#endif
+#define USBSID_BUFFER_UNIT_CYCLES 1000  /* Cycles per unit of HardSID_SetWriteBufferSize */
+#ifndef USBSID_READ_STALE_US
+#define USBSID_READ_STALE_US 0  /* Live register reads this soon after the previous one come from the cache, 0 always reads */
+#endif
 
-extern unsigned char result[LEN_IN_BUFFER]; /* variable where read data is copied into */
-extern int out_buffer_length;
+/* Registers only the SID itself knows, all others are read from the shadow cache */
+#define SID_LIVE_REG(reg) ((reg) >= 0x19 && (reg) <= 0x1C)  /* POTX, POTY, OSC3, ENV3 */
+
+/* Per SID mute mask, sent with SID_MUTE and applied by the firmware to what goes out on the bus */
+#define MUTE_VOICE(voice) (1 << (voice))  /* Waveform bits of the voice control register are cleared */
+#define MUTE_VOLUME 0x08  /* Master volume nibble is cleared */
+
+/* USBSID-Pico command byte ~ mirrors globals.h in the firmware */
+enum
+{
+  PACKET_TYPE  = 0xC0,  /* 0b11000000 ~ 192  */
+  BYTE_MASK    = 0x3F,  /*   0b111111 ~  63  */
+  COMMAND_MASK = 0x1F,  /*    0b11111 ~  31  */
+
+  /* BYTE 0 - top 2 bits */
+  WRITE        =   0,   /*        0b0 ~ 0x00 */
+  READ         =   1,   /*        0b1 ~ 0x40 */
+  CYCLED_WRITE =   2,   /*       0b10 ~ 0x80 */
+  COMMAND      =   3,   /*       0b11 ~ 0xC0 */
+  /* BYTE 0 - lower 6 bits for byte count */
+  /* BYTE 0 - lower 5 bits for Commands */
+  PAUSE        =  10,   /*     0b1010 ~ 0x0A */
+  UNPAUSE      =  11,   /*     0b1011 ~ 0x0B */
+  MUTE         =  12,   /*     0b1100 ~ 0x0C */
+  UNMUTE       =  13,   /*     0b1101 ~ 0x0D */
+  RESET_SID    =  14,   /*     0b1110 ~ 0x0E */
+  DISABLE_SID  =  15,   /*     0b1111 ~ 0x0F */
+  ENABLE_SID   =  16,   /*    0b10000 ~ 0x10 */
+  CLEAR_BUS    =  17,   /*    0b10001 ~ 0x11 */
+  CONFIG       =  18,   /*    0b10010 ~ 0x12 */
+};
+enum
+{
+  READ_SOCKETCFG = 0x37,  /* Read socket config as bytes */
+  CYCLE_COUNT    = 0x5D,  /* Read the timer and the PHI2 cycles since boot */
+  SID_MUTE       = 0x5E,  /* Mute voices of a SID on the device, SID in bits 4-5, mask in bits 0-3 */
+};
+
+/* Drift estimation */
+#define CYCLE_REPORT_SIZE 22      /* [command, status, timer us 64, PHI2 cycles 64, achieved mHz] */
+#define DRIFT_PROBE_NS  1000000000LL   /* Time between CYCLE_COUNT probes */
+#define DRIFT_LOST_NS   2000000000LL   /* A probe without reply after this long is given up */
+#define DRIFT_MIN_NS    10000000000LL  /* Fit span needed before the pacing is corrected */
+#define DRIFT_MAX_PPM   2000      /* Larger deviations mean the clock changed, the fit restarts */
+
+/* Devices */
+#define USBSID_MAX_DEVICES 4
+#define USBSID_MAX_SIDS    (USBSID_MAX_DEVICES * 4)
+#define USBSID_SERIAL_LEN  32
+#define USBSID_SERIALS_LEN (USBSID_MAX_DEVICES * USBSID_SERIAL_LEN)
+
+/* Queued async entries */
+enum
+{
+  ASYNC_WRITE  = 0,  /* data is register and value, packed with other writes */
+  ASYNC_PACKET = 1,  /* data is a complete 3 byte packet, sent on its own */
+  ASYNC_FLUSH  = 2,  /* No data, sends the WRITE packet in progress */
+  ASYNC_CYCLED = 3,  /* data is register and value, written cycles after the previous write */
+  ASYNC_READ   = 4,  /* data is a complete 3 byte packet, its reply comes in on the rx ring */
+};
+
+typedef struct {
+  uint8_t kind;
+  uint8_t data[3];
+  uint16_t cycles;   /* Delay before an ASYNC_CYCLED write */
+  uint32_t time_us;  /* Queued at, used for the coalescing window */
+} usbsid_queued;
+
+struct usbsid_dev;
+struct usbsid_ctx;
+
+/* user_data of an async transfer */
+typedef struct {
+  struct usbsid_dev *dev;
+  int index;
+} usbsid_slot;
+
+/* Per device state ~ each device has its own queue and transfer pool */
+typedef struct usbsid_dev {
+  struct usbsid_ctx *us;  /* Owning driver instance */
+  libusb_device_handle *devh;
+  char serial[USBSID_SERIAL_LEN];  /* mcu_get_unique_id of the Pico as hex string */
+  int numsids;   /* SIDs in the socket config */
+  int first_id;  /* HardSID DeviceID of the first SID */
+
+  /* Synchronous transfers */
+  uint8_t *out_buffer, *in_buffer;
+  int out_buffer_length;
+  struct libusb_transfer *transfer_out;  /* OUT-going transfers (OUT from host PC to USB-device) */
+  struct libusb_transfer *transfer_in;   /* IN-coming transfers (IN to host PC from USB-device) */
+  int read_completed, write_completed;
+
+  /* Async write engine */
+  usbsid_queued ring[ASYNC_RING_SIZE];
+  std::atomic<uint32_t> ring_head, ring_tail;
+  std::atomic<int> in_flight;
+  uint32_t pump_head;  /* Ring head as last seen by the pump */
+  std::atomic<bool> flush_request;  /* Set by usbsid_flush from any thread, the pump sends the partial packet */
+  struct libusb_transfer *transfer[ASYNC_TRANSFERS];
+  uint8_t *buffer[ASYNC_TRANSFERS];
+  usbsid_slot slot[ASYNC_TRANSFERS];
+  int free[ASYNC_TRANSFERS], n_free;  /* Only touched by the event thread */
+  bool dma;  /* Buffers came from libusb_dev_mem_alloc */
+
+  /* Pipelined reads ~ IN transfers stay posted, the event thread appends what they receive to rx */
+  struct libusb_transfer *transfer_rx[ASYNC_READS];
+  uint8_t *buffer_rx[ASYNC_READS];
+  std::atomic<int> rx_posted;
+  uint8_t rx[ASYNC_RX_SIZE];
+  std::atomic<uint32_t> rx_head;  /* Bytes received */
+  uint32_t rx_want;  /* Bytes asked for by readers, only touched by the reading thread */
+
+  /* Cycled writes ~ every SID has its own timeline, merged into the device timeline */
+  uint64_t sid_clock[4];
+  uint64_t clock;
+  int64_t pace_start_ns;
+  bool pace_started;
+
+  /* Shadow registers ~ last value written, or read for the live registers */
+  uint8_t shadow[4][32];
+  uint32_t shadow_read_us[4][32];  /* When a live register was last read from the device */
+  uint8_t mute[4];  /* MUTE_VOICE and MUTE_VOLUME bits as last sent with SID_MUTE */
+
+  /* Drift estimation ~ CYCLE_COUNT probes go out as reads, the event thread stamps and parses the reply */
+  double cycle_ns;  /* Nanoseconds per cycle as played by this device, on the host clock */
+  uint32_t nominal_millihz;  /* Clock the device reports it runs at, 0 until known and then clock_hz is used */
+  bool drift_off;   /* Firmware without CYCLE_COUNT */
+  std::atomic<bool> probe_pending, probe_done;
+  uint32_t probe_end;  /* rx position after the probe reply */
+  int64_t probe_sent_ns;
+  int64_t probe_ns;        /* Host time the reply came in, with probe_cycles and probe_ok */
+  uint64_t probe_cycles;
+  uint32_t probe_millihz;
+  bool probe_ok;
+  int64_t drift_base_ns;   /* First sample of the fit */
+  uint64_t drift_base_cycles;
+  bool drift_started;
+  int64_t drift_span_ns;
+  double drift_ppm;  /* Device PHI2 against its nominal rate */
+} usbsid_dev;
+
+#define EP_OUT_ADDR 0x02
+#define EP_IN_ADDR  0x82
 
 
 // Clock cycles for the MOS6502
@@ -65,67 +216,204 @@ extern int out_buffer_length;
 #define HERTZ_50      19950  // 50Hz ~ 20000 == 20us / 50.125Hz ~ 19.950124688279us exact
 #define HERTZ_60      16715  // 60Hz ~ 16667 == 16.67us / 59.826Hz ~ 16.715140574332 exact
 
+typedef std::chrono::high_resolution_clock::time_point timestamp_t;
+typedef std::chrono::nanoseconds  duration_t;
+typedef std::nano                 ratio_t;
 
-// int usbsid_init(void);
-// int usbsid_close(void);
-void usbsid_reset(void);
-int usbsid_open(void);
-int usbsid_read(uint16_t addr, int chipno);
-void usbsid_store(uint16_t addr, uint8_t val, int chipno);
+/* WaitForCycle timing */
+#define WAIT_MIN_NS     20000   /* Shorter waits are carried over to the next call */
+#define WAIT_LATE_NS    50000000 /* Restart the timeline when this late */
+#define SPIN_DEFAULT_NS 50000   /* Initial spin tail before a deadline */
+#define SPIN_MIN_NS     5000
+#define SPIN_MAX_NS     500000
+#define JITTER_BUCKETS  10      /* Lateness buckets < 1, 2, 5, 10, 20, 50, 100, 200, 500 and >= 500 us */
+
+/* SID address layout of a SIDTYPE */
+typedef struct {
+  int numsids;
+  uint16_t addr[4];  /* Base address of SID 1 to 4 */
+  uint16_t mask[4];
+} usbsid_sidtype;
+
+/* Driver instance ~ owns a libusb context, the devices found on it and the event thread
+ * Instances share nothing, each emulator thread can open its own */
+typedef struct usbsid_ctx {
+  libusb_context *ctx;
+  pthread_t ptid;
+  std::atomic<int> exit_thread;
+  bool thread_started;
+  std::atomic<int> async_idle;         /* Event thread is blocked waiting for events */
+  std::atomic<uint32_t> coalesce_us;   /* Time a partial WRITE packet waits for more writes */
+
+  /* Opened devices sorted by serial, and the HardSID DeviceID to (device, SID) map */
+  usbsid_dev *devices[USBSID_MAX_DEVICES];
+  int n_devices;
+  char serials[USBSID_SERIALS_LEN];  /* Comma separated serials this instance may open, empty for all */
+  struct {
+    usbsid_dev *dev;
+    int sidno;
+  } sid_map[USBSID_MAX_SIDS];
+  int n_sids;
+  const usbsid_sidtype *sidtype;  /* Address mapping for sid_address and the SID count fallback */
+  uint32_t read_stale_us;  /* Staleness bound for live register reads */
+  uint32_t ahead_cycles;   /* How far cycled writes may run ahead of the host clock */
+  bool drift_correct;      /* Pace on the measured device clock instead of its nominal rate */
+  uint64_t reads_cached, reads_device;
+
+  /* Timing */
+  uint32_t clock_hz;
+  double cycle_ns, inv_cycle_ns;  /* Nanoseconds per cycle and its inverse */
+  timestamp_t start_time;
+  int64_t wait_start_ns, wait_cycles;
+  bool wait_started;
+  int64_t spin_ns, oversleep_avg_ns;
+  uint64_t jitter_hist[JITTER_BUCKETS];
+} usbsid_ctx;
+
+
+/* Create a driver instance, reads USBSID_COALESCE_US, USBSID_SIDTYPE, USBSID_CLOCK, USBSID_READ_STALE_US,
+ * USBSID_DRIFT_CORRECT and USBSID_SERIALS from the environment */
+usbsid_ctx *usbsid_create(void);
+/* Close and free a driver instance */
+void usbsid_destroy(usbsid_ctx *us);
+/* Only open the devices with these comma separated serials, NULL or "" opens every device
+ * Instances in one process need disjoint lists, a device can only be claimed once. Call before usbsid_open */
+int usbsid_set_serials(usbsid_ctx *us, const char *serials);
+int usbsid_open(usbsid_ctx *us);
+int usbsid_close(usbsid_ctx *us);
+void usbsid_reset(usbsid_ctx *us, int chipno);
+int usbsid_sids(usbsid_ctx *us);
+void usbsid_serial(usbsid_ctx *us, int chipno, char *output, int size);
+/* addr is either a SID register ($00-$1F) of chipno, or a C64 address ($D400 and up) that the SIDTYPE
+ * mapping turns into a register of chipno or one of the SIDs after it, the same for the store calls */
+int usbsid_read(usbsid_ctx *us, uint16_t addr, int chipno);
+void usbsid_store(usbsid_ctx *us, uint16_t addr, uint8_t val, int chipno);
+void usbsid_store_cycled(usbsid_ctx *us, uint16_t addr, uint8_t val, int chipno, uint32_t cycles);
+void usbsid_delay_cycled(usbsid_ctx *us, int chipno, uint32_t cycles);
+/* Send the partial packets of every device, safe to call from any thread */
+void usbsid_flush(usbsid_ctx *us);
+void usbsid_set_coalesce(usbsid_ctx *us, uint32_t window_us);
+/* Set the SID clock in Hz used for pacing, e.g. CLOCK_PAL or CLOCK_NTSC */
+void usbsid_set_clock(usbsid_ctx *us, uint32_t clock_hz);
+/* Select the address mapping, one of SIDTYPE0 to SIDTYPE5 */
+int usbsid_set_sidtype(usbsid_ctx *us, int sidtype);
+/* Serve OSC3/ENV3/POTX/POTY reads from the cache when the last device read is at most stale_us old */
+void usbsid_set_read_stale(usbsid_ctx *us, uint32_t stale_us);
+/* Send what is queued for the device of chipno and wait until it left the host */
+void usbsid_wait(usbsid_ctx *us, int chipno);
+/* Wait until the device of chipno has played everything queued for it */
+void usbsid_sync(usbsid_ctx *us, int chipno);
+/* Set how far cycled writes may run ahead of the host clock, 0 is USBSID_AHEAD_CYCLES */
+void usbsid_set_ahead(usbsid_ctx *us, uint32_t cycles);
+/* Mute or unmute a voice (0 to 2) of a SID */
+void usbsid_mute(usbsid_ctx *us, int chipno, int voice, bool mute);
+/* Mute or unmute a whole SID through its master volume */
+void usbsid_mute_all(usbsid_ctx *us, int chipno, bool mute);
+/* Mute or unmute every device with the MUTE and UNMUTE commands */
+void usbsid_mute_line(usbsid_ctx *us, bool mute);
+/* Measured PHI2 rate of the device of chipno against the rate it reports in ppm, 0 until known */
+double usbsid_drift_ppm(usbsid_ctx *us, int chipno);
+/* Pace on the measured device clock (default) or only report the drift */
+void usbsid_set_drift_correction(usbsid_ctx *us, bool correct);
 
 /*  */
 
-typedef std::chrono::high_resolution_clock::time_point timestamp_t;
-typedef std::chrono::nanoseconds  duration_t;
-typedef std::nano                 ratio_t;
+int64_t CycleFromTimestamp(usbsid_ctx *us, timestamp_t timestamp);
+int WaitForCycle(usbsid_ctx *us, int cycle);
 
-int64_t CycleFromTimestamp(timestamp_t timestamp);
-int WaitForCycle(int cycle);
+/* Copy the WaitForCycle lateness histogram, JITTER_BUCKETS entries */
+void usbsid_jitter_histogram(usbsid_ctx *us, uint64_t *hist);
 
+/* Print the WaitForCycle lateness histogram */
+void usbSIDPrintJitter(usbsid_ctx *us);
 
-timestamp_t           m_StartTime = std::chrono::high_resolution_clock::now();
-timestamp_t           m_NextTime = std::chrono::high_resolution_clock::now();
-timestamp_t           m_CurrentTime = std::chrono::high_resolution_clock::now();
-double                m_CPUcycleDuration = ratio_t::den / CLOCK_PAL;
-double                m_InvCPUcycleDurationNanoSeconds = 1.0 / (1000000000 / CLOCK_PAL);
+/* Keeps the cycled writes of a device at most ahead_cycles ahead of the host clock */
+void usbSIDPace(usbsid_dev *dev);
 
 /* USBSID-Pico driver functions */
 
-/* Setup USBSID driver */
-int usbSIDSetup(void);
+/* Setup USBSID driver ~ opens every attached USBSID-Pico */
+int usbSIDSetup(usbsid_ctx *us);
 
 /* Break down USBSID driver */
-int usbSIDExit(void);
+int usbSIDExit(usbsid_ctx *us);
+
+/* Open, configure and map a single device */
+int usbSIDOpen(usbsid_ctx *us, usbsid_dev *dev);
+
+/* Close a single device */
+void usbSIDClose(usbsid_dev *dev);
+
+/* Read the socket config of a device into numsids */
+int usbSIDReadSocketConfig(usbsid_dev *dev);
+
+/* Read the PHI2 cycle count and clock in mHz of a device with plain bulk transfers, before the reads are posted */
+int usbSIDReadCycleCount(usbsid_dev *dev, uint64_t *cycles, uint32_t *millihz);
+
+/* Send a CYCLE_COUNT probe when due and fit its reply against the host clock */
+void usbSIDDrift(usbsid_dev *dev, int64_t now);
 
-/* Async write thread */
-void* usbSIDStart(void *);
+/* Async event thread ~ takes the usbsid_ctx it serves */
+void* usbSIDStart(void *arg);
+
+/* Setup the async transfer pool */
+int usbSIDAsyncSetup(usbsid_dev *dev);
+
+/* Free the async transfer pool */
+void usbSIDAsyncFree(usbsid_dev *dev);
+
+/* Queue an entry for the async event thread ~ single producer */
+void usbSIDQueue(usbsid_dev *dev, uint8_t kind, uint8_t d0, uint8_t d1, uint8_t d2, uint16_t cycles = 0);
+
+/* Pack queued entries into free transfers and submit them ~ event thread only
+ * Returns the microseconds until a partial WRITE packet is due */
+int usbSIDPump(usbsid_dev *dev);
+
+/* Wait until all queued entries are sent */
+void usbSIDWaitIdle(usbsid_dev *dev);
+
+/* Post the IN transfers of the pipelined read path */
+int usbSIDArmReads(usbsid_dev *dev);
+
+/* Queue a packet behind the pending writes and wait for its n byte reply
+ * Returns n or -1 on timeout */
+int usbSIDReadAsync(usbsid_dev *dev, const uint8_t *packet, uint8_t *reply, int n);
 
 /* Write buffer to USBSID */
-void usbSIDWrite(unsigned char *buff);
+void usbSIDWrite(usbsid_dev *dev, unsigned char *buff);
 
-/* Read from USBSID ~ callback reads into result buffer*/
-void usbSIDRead_toBuff(unsigned char *writebuff);
+/* Read from USBSID ~ result ends up in dev->in_buffer */
+void usbSIDRead_toBuff(usbsid_dev *dev, unsigned char *writebuff);
 
 /* Read from USBSID ~ returning function */
-unsigned char usbSIDRead(unsigned char *writebuff, unsigned char *buff);
+unsigned char usbSIDRead(usbsid_dev *dev, unsigned char *writebuff, unsigned char *buff);
 
 /* Pause USBSID */
-void usbSIDPause(void);
+void usbSIDPause(usbsid_dev *dev);
 
 /* Reset USBSID */
-void usbSIDReset(void);
+void usbSIDReset(usbsid_dev *dev);
+
+/* Mute or unmute all SIDs of a device */
+void usbSIDMute(usbsid_dev *dev, bool mute);
 
 /* Outgoing callback function */
 void LIBUSB_CALL sid_out(struct libusb_transfer *transfer);
 
+/* Outgoing callback function for the async transfer pool */
+void LIBUSB_CALL sid_async_out(struct libusb_transfer *transfer);
+
+/* Incoming callback function for the pre-posted read transfers */
+void LIBUSB_CALL sid_async_in(struct libusb_transfer *transfer);
+
 /* Incoming callback function */
 void LIBUSB_CALL sid_in(struct libusb_transfer *transfer);
 
 /* libusb transfer debugging print */
 void print_libusb_transfer(struct libusb_transfer *p_t);
 
-/* Address conversion */
-uint16_t sid_address(uint16_t addr);
+/* Address conversion ~ C64 address to the $D400-$D47F layout of the selected SIDTYPE */
+uint16_t sid_address(usbsid_ctx *us, uint16_t addr);
 
 /* SIDTYPE ~ Defaults to 0
  *
@@ -177,77 +465,14 @@ uint16_t sid_address(uint16_t addr);
 #define SIDTYPE4 4
 #define SIDTYPE5 5
 
-/* Temporary */
-#define SIDTYPE SIDTYPE4
-
-/* Default config for SID type */
+/* Default config for SID type ~ changeable at runtime with usbsid_set_sidtype
+ * or the USBSID_SIDTYPE environment variable */
 #ifndef SIDTYPE
-#define SIDTYPE SIDTYPE0
+#define SIDTYPE SIDTYPE4
 #endif
 
 /* SID type masks for GPIO */
 #define SIDUMASK 0xFF00
 #define SIDLMASK 0xFF
-#if SIDTYPE == SIDTYPE0
-#define NUMSIDS  1
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0x0
-#define SID2MASK 0x0
-#define SID3ADDR 0x0
-#define SID3MASK 0x0
-#define SID4ADDR 0x0
-#define SID4MASK 0x0
-#elif SIDTYPE == SIDTYPE1
-#define NUMSIDS  2
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0xD420  /* SID 2 - socket 1 ~ OPTIONAL */
-#define SID2MASK 0x3F
-#define SID3ADDR 0x0
-#define SID3MASK 0x0
-#define SID4ADDR 0x0
-#define SID4MASK 0x0
-#elif SIDTYPE == SIDTYPE2
-#define NUMSIDS  2
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0xD440  /* SID 2 - socket 2 */
-#define SID2MASK 0x5F
-#define SID3ADDR 0x0
-#define SID3MASK 0x0
-#define SID4ADDR 0x0
-#define SID4MASK 0x0
-#elif SIDTYPE == SIDTYPE3
-#define NUMSIDS  3
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0xD420  /* SID 2 - socket 1 */
-#define SID2MASK 0x3F
-#define SID3ADDR 0xD440  /* SID 3 - socket 2 */
-#define SID3MASK 0x5F
-#define SID4ADDR 0x0
-#define SID4MASK 0x0
-#elif SIDTYPE == SIDTYPE4  /* SKPico only */
-#define NUMSIDS  4
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0xD420  /* SID 2 - socket 1 */
-#define SID2MASK 0x3F
-#define SID3ADDR 0xD440  /* SID 3 - socket 2 */
-#define SID3MASK 0x5F
-#define SID4ADDR 0xD460  /* SID 4 - socket 2 */
-#define SID4MASK 0x7F
-#elif SIDTYPE == SIDTYPE5  /* SKPico only */
-#define NUMSIDS  4
-#define SID1ADDR 0xD400  /* SID 1 - socket 1 */
-#define SID1MASK 0x1F
-#define SID2ADDR 0xD440  /* SID 2 - socket 2 */
-#define SID2MASK 0x5F
-#define SID3ADDR 0xD420  /* SID 3 - socket 1 */
-#define SID3MASK 0x3F
-#define SID4ADDR 0xD460  /* SID 4 - socket 2 */
-#define SID4MASK 0x7F
-#endif
 
 #endif /* _USBSID_DRIVER_H_ */
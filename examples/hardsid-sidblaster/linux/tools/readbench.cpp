@@ -0,0 +1,68 @@
+#include "../src/usbsid.hpp"
+
+#include <vector>
+
+/* Read latency benchmark
+ *
+ * Polls $D41B (OSC3) and $D41C (ENV3) of the first SID like emulators do for random
+ * numbers and envelope following, once on an idle queue and once with writes queued
+ * in front of every read. Prints the round trip per read in microseconds.
+ *
+ * Usage: readbench [reads] [writes in front]
+ */
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void bench(usbsid_ctx *us, const char *name, int reads, int writes)
+{
+    std::vector<int64_t> lat;
+    lat.reserve(reads);
+    for (int i = 0; i < reads; i++) {
+        for (int w = 0; w < writes; w++) {
+            usbsid_store(us, 0x0E, (uint8_t)(i + w), 0);  /* Voice 3 frequency lo */
+        }
+        int64_t start = now_ns();
+        usbsid_read(us, ((i & 1) ? 0x1C : 0x1B), 0);
+        lat.push_back(now_ns() - start);
+    }
+    std::sort(lat.begin(), lat.end());
+    int64_t total = 0;
+    for (int64_t l : lat) total += l;
+    printf("[READBENCH] %-16s %6d reads  avg %7.1f  min %7.1f  p50 %7.1f  p99 %7.1f  max %7.1f us\r\n",
+        name, reads, (total / 1000.0 / reads), (lat.front() / 1000.0), (lat[reads / 2] / 1000.0),
+        (lat[(reads * 99) / 100] / 1000.0), (lat.back() / 1000.0));
+}
+
+int main(int argc, char **argv)
+{
+    int reads = (argc > 1 ? atoi(argv[1]) : 1000);
+    int writes = (argc > 2 ? atoi(argv[2]) : 8);
+    if (reads <= 0) reads = 1000;
+
+    usbsid_ctx *us = usbsid_create();
+    if (usbsid_open(us) < 0 || usbsid_sids(us) == 0) {
+        usbsid_destroy(us);
+        return 1;
+    }
+
+    /* Voice 3 on noise with a gate so OSC3 and ENV3 keep changing */
+    usbsid_store(us, 0x0F, 0x80, 0);  /* Frequency hi */
+    usbsid_store(us, 0x13, 0x00, 0);  /* Attack/decay */
+    usbsid_store(us, 0x14, 0xF0, 0);  /* Sustain/release */
+    usbsid_store(us, 0x12, 0x81, 0);  /* Noise, gate */
+    usbsid_store(us, 0x18, 0x80, 0);  /* Voice 3 off the output */
+    usbsid_flush(us);
+
+    bench(us, "idle", reads, 0);
+    bench(us, "behind writes", reads, writes);
+
+    usbsid_store(us, 0x12, 0x00, 0);
+    usbsid_store(us, 0x18, 0x00, 0);
+    usbsid_destroy(us);
+    return 0;
+}
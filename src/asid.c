@@ -38,9 +38,16 @@
 
 /* GPIO externals */
 extern uint8_t bus_operation(uint8_t command, uint8_t address, uint8_t data);
+extern void cycled_bus_operation(uint8_t address, uint8_t data, uint16_t cycles);
 extern void pause_sid(void);
 extern void reset_sid(void);
 
+/* Midi externals */
+extern void mod_set_param(int channel, int param, uint8_t value);
+
+/* SID externals */
+extern bool sid_test_owns(uint8_t address);
+
 /* Well, it does what it does */
 void handle_asid_message(uint8_t sid, uint8_t* buffer, int size)
 {
@@ -56,7 +63,8 @@ void handle_asid_message(uint8_t sid, uint8_t* buffer, int size)
         }
         uint8_t address = asid_sid_registers[mask * 7 + bit];
         dtype = asid;  /* Set data type to asid */
-        bus_operation(0x10, (address |= sid), register_value);
+        address |= sid;
+        if (!sid_test_owns(address)) bus_operation(0x10, address, register_value);
         reg++;
       }
     }
@@ -96,6 +104,61 @@ void decode_asid_message(uint8_t* buffer, int size)
   }
 }
 
+/* Unpacks 7 bit SysEx data, returns the unpacked size */
+int unpack_sysex(uint8_t* in, int size, uint8_t* out)
+{
+  int n = 0;
+  for (int i = 0; i < size; i += 8) {
+    uint8_t msbs = in[i];
+    for (int j = 1; j < 8 && (i + j) < size; j++) {
+      out[n++] = (in[i + j] | ((msbs & (1 << (j - 1))) ? 0x80 : 0));
+    }
+  }
+  return n;
+}
+
+/* Feeds the cycled write pipeline, same as CYCLED_WRITE over USB */
+void handle_bulk_write(uint8_t* buffer, int size)
+{
+  uint8_t records[64];
+  int n = unpack_sysex(&buffer[3], (size - 4), records);  /* Skip F0 7D 20 and F7 */
+  int i = 0;
+  dtype = midi;  /* Set data type to midi */
+  while (i + 1 < n) {
+    uint8_t address = records[i];
+    if (address & 0x80) {  /* Write or wait with cycle delay */
+      if (i + 3 >= n) break;
+      uint16_t cycles = ((records[i + 2] << 8) | records[i + 3]);
+      if ((address == 0xFF && records[i + 1] == 0xFF) || sid_test_owns(address & 0x7F)) {
+        if (cycles >= 1) cycled_bus_operation(0xFF, 0xFF, cycles);  /* Keep the delay of dropped writes */
+      } else {
+        cycled_bus_operation((address & 0x7F), records[i + 1], cycles);
+      }
+      i += 4;
+    } else {  /* Same minimal 10 cycles in between as WRITE over USB */
+      if (!sid_test_owns(address)) cycled_bus_operation(address, records[i + 1], 10);
+      i += 2;
+    }
+  }
+}
+
+/* Our very own */
+void decode_usbsid_message(uint8_t* buffer, int size)
+{
+  switch(buffer[2]) {
+    case SYSEX_MOD_PARAM:  /* F0 7D 10 <channel> <parameter> <value> F7 */
+      if (size < 7) break;
+      mod_set_param(buffer[3], buffer[4], buffer[5]);
+      break;
+    case SYSEX_BULK_WRITE:  /* F0 7D 20 <packed records> F7 */
+      if (size < 7) break;
+      handle_bulk_write(buffer, size);
+      break;
+    default:
+      break;
+  }
+}
+
 /* Is it ? */
 void process_sysex(uint8_t* buffer, int size)
 {
@@ -103,6 +166,9 @@ void process_sysex(uint8_t* buffer, int size)
     case 0x2D:  /* 0x2D = ASID sysex message */
       decode_asid_message(buffer, size);
       break;
+    case USBSID_SYSEX_ID:  /* 0x7D = USBSID sysex message */
+      decode_usbsid_message(buffer, size);
+      break;
     default:
       break;
   }
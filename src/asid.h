@@ -80,6 +80,21 @@ static const uint8_t asid_sid_registers[] =
   0x12, // 27 <= secondary for reg 18
 };
 
+/* USBSID specific SysEx ~ F0 7D <command> <data...> F7 */
+#define USBSID_SYSEX_ID 0x7D  /* Manufacturer ID for non-commercial use */
+
+enum {
+  SYSEX_MOD_PARAM = 0x10,   /* <channel> <parameter> <value> ~ set a modulation parameter */
+  SYSEX_BULK_WRITE = 0x20,  /* <packed records> ~ register writes, see below */
+};
+
+/* Bulk write records before 7 bit packing
+ * <addr> <value>                       ~ write 10 cycles after the previous one like WRITE, addr $00 ~ $7F
+ * <addr|$80> <value> <cycles hi> <lo>  ~ write after waiting n SID clock cycles
+ * <$FF> <$FF> <cycles hi> <lo>         ~ wait n SID clock cycles only
+ * Packing: every 7 data bytes are preceded by a byte holding their MSB's,
+ * bit 0 for the first byte up to bit 6 for the seventh */
+
 
 #ifdef __cplusplus
   }
@@ -34,6 +34,8 @@
 #include "midi.h"
 #include "sid.h"
 #include "logging.h"
+#define CONFIG_TLV_FIRMWARE
+#include "config_tlv.h"
 
 
 /* USBSID externals */
@@ -48,30 +50,89 @@ extern uint8_t *write_buffer_p;
 extern double cpu_mhz, cpu_us;
 extern double sid_hz, sid_mhz, sid_us;
 extern uint8_t sid_memory[];
+extern uint32_t last_rx_us;
 
 /* SID externals */
-extern uint8_t detect_sid_version(uint8_t start_addr);
-extern void sid_test(int sidno, char test, char wf);
+extern void sid_test_start(uint8_t kind, int first_sid, int last_sid, int wf);
+extern void sid_test_stop(void);
+extern void sid_test_report(uint8_t command, uint8_t *buf);
+extern void sid_char_report(uint8_t command, int sidno, uint8_t *buf);
 
 /* GPIO externals */
-extern void restart_bus(void);
+extern void swap_bus_mapping(void);
+extern void set_sid_mute(int sidno, uint8_t mask);
+extern void set_bus_clocks(void);
+extern uint32_t get_sidclock_divider(void);
+extern uint32_t sidclock_millihz(uint32_t divider);
+extern uint32_t measure_phi2(uint32_t gate_ms);
+extern bool phi2_counter_start(void);
+extern uint32_t phi2_counter_elapsed_us(void);
+extern uint32_t phi2_counter_stop(void);
 
 /* Midi externals */
 extern void midi_bus_operation(uint8_t a, uint8_t b);
+extern void midi_select_note_table(uint32_t clock_rate);
 
 /* MCU externals */
 extern void mcu_reset(void);
 
+/* Util externals */
+extern uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len);
+
 /* Pre declarations */
 void apply_config(void);
 void apply_socket_change(void);
 void apply_clockrate(int n_clock);
+int set_clockrate(uint32_t clock_rate, bool force);
+int calibrate_external_clock(uint32_t gate_ms);
+void start_clock_measurement(uint32_t gate_ms);
+bool clockrate_in_range(uint32_t clock_rate);
+void handle_config_tlv(uint8_t * buffer);
+void queue_save_config(void);
+void verify_clockrate(void);
+void read_config(Config* config);
+void write_back_data(size_t buffersize);
 
 /* Init local vars */
 static uint8_t config_array[FLASH_PAGE_SIZE]; /* 256 MIN ~ FLASH_PAGE_SIZE & 4096 MAX ~ FLASH_SECTOR_SIZE  */
 static uint8_t socket_config_array[10]; /* 10 bytes is enough for now */
 static uint8_t p_version_array[MAX_BUFFER_SIZE];
 
+/* Config journal record header, the Config struct follows directly after */
+typedef struct {
+  uint32_t magic;     /* CONFIG_JOURNAL_MAGIC */
+  uint32_t sequence;  /* Incremented on every save, the highest valid record wins */
+  uint32_t length;    /* Payload length */
+  uint32_t crc;       /* CRC32 over sequence, length and payload */
+} config_record;
+
+/* Single page journal write, passed to flash_safe_execute */
+typedef struct {
+  uint32_t offset;  /* Flash offset of the slot */
+  bool erase;       /* Erase the sector before programming */
+  uint8_t page[FLASH_PAGE_SIZE];
+} config_write;
+
+static_assert((sizeof(config_record) + sizeof(Config)) <= FLASH_PAGE_SIZE, "[CONFIG SAVE ERROR] Config struct doesn't fit inside a journal page");
+
+static int journal_slot = -1;  /* Slot of the newest record */
+static uint32_t journal_sequence = 0;
+
+/* Deferred saving */
+static int save_status = CONFIG_PERSISTED;
+static uint32_t save_requested_us = 0;
+
+/* Last measured external clock */
+static uint32_t phi2_millihz = 0;
+
+/* On demand external clock measurement, finished by clock_measure_task */
+static bool measure_running = false;
+static uint32_t measure_gate_us = 0;
+static char measure_dtype = 0;  /* Interface to send the clock report to */
+
+/* Interface that asked for SID detection */
+static char detect_dtype = 0;
+
 /* Init vars */
 int sock_one = 0, sock_two = 0, sids_one = 0, sids_two = 0, numsids = 0, act_as_one = 0;
 uint8_t one = 0, two = 0, three = 0, four = 0;
@@ -154,24 +215,33 @@ void print_cfg(const uint8_t *buf, size_t len) {
   return;
 }
 
+/* Starts SID detection, detect_sid_types_done replies with the updated config when finished */
 void detect_sid_types(void)
+{
+  detect_dtype = dtype;
+  sid_test_start(SIDTEST_DETECT, 0, numsids, 0);
+  return;
+}
+
+/* Called from sid_test_task when detection is finished */
+void detect_sid_types_done(const uint8_t types[4])
 {
   int sid1 = 0, sid2 = 0, sid3 = 0, sid4 = 0;
 
   if (numsids >= 1) {
-    sid1 = detect_sid_version(0x00);
+    sid1 = types[0];
     CFG("[READ SID1] [%02x %s]\n", sid1, sidtypes[sid1]);
   }
   if (numsids >= 2) {
-    sid2 = detect_sid_version(0x20);
+    sid2 = types[1];
     CFG("[READ SID2] [%02x %s]\n", sid2, sidtypes[sid2]);
   }
   if (numsids >= 3) {
-    sid3 = detect_sid_version(0x40);
+    sid3 = types[2];
     CFG("[READ SID3] [%02x %s]\n", sid3, sidtypes[sid3]);
   }
   if (numsids == 4) {
-    sid4 = detect_sid_version(0x60);
+    sid4 = types[3];
     CFG("[READ SID4] [%02x %s]\n", sid4, sidtypes[sid4]);
   }
 
@@ -227,6 +297,13 @@ void detect_sid_types(void)
   CFG("[SOCKET TWO SID1 TYPE] %s\n", sidtypes[usbsid_config.socketTwo.sid1type]);
   CFG("[SOCKET TWO SID2 TYPE] %s\n", sidtypes[usbsid_config.socketTwo.sid2type]);
 
+  memset(write_buffer_p, 0 ,64);  /* Empty the write buffer pointer */
+  read_config(&usbsid_config);  /* Read the config into the config buffer */
+  memcpy(write_buffer_p, config_array, 64);  /* Copy the first 64 bytes from the buffer into the write buffer */
+  char current = dtype;
+  dtype = detect_dtype;
+  write_back_data(64);
+  dtype = current;
   return;
 }
 
@@ -304,37 +381,148 @@ void default_config(Config* config)
   return;
 }
 
+static inline const config_record * journal_record(int slot)
+{
+  return (const config_record *)(XIP_BASE + CONFIG_JOURNAL_OFFSET + (slot * FLASH_PAGE_SIZE));
+}
+
+static uint32_t journal_crc(const config_record * record)
+{
+  uint32_t crc = crc32(0, (const uint8_t *)&record->sequence, (sizeof(record->sequence) + sizeof(record->length)));
+  return crc32(crc, ((const uint8_t *)record + sizeof(config_record)), record->length);
+}
+
+static bool journal_slot_blank(int slot)
+{
+  const uint32_t *p = (const uint32_t *)journal_record(slot);
+  for (uint i = 0; i < (FLASH_PAGE_SIZE / sizeof(uint32_t)); i++) {
+    if (p[i] != 0xFFFFFFFF) return false;
+  }
+  return true;
+}
+
+int journal_scan(void)
+{ /* Finds the newest valid record, headers are checked first so only candidates are CRC'd */
+  int newest = -1;
+  for (int slot = 0; slot < CONFIG_JOURNAL_SLOTS; slot++) {
+    const config_record *record = journal_record(slot);
+    if (!((record->magic == CONFIG_JOURNAL_TLV_MAGIC && record->length <= (FLASH_PAGE_SIZE - sizeof(config_record)))
+      || (record->magic == CONFIG_JOURNAL_MAGIC && record->length == sizeof(Config)))) continue;
+    if (newest >= 0 && (int32_t)(record->sequence - journal_sequence) <= 0) continue;
+    if (journal_crc(record) != record->crc) {
+      CFG("[JOURNAL] CRC mismatch in slot %d\n", slot);
+      continue;
+    }
+    newest = slot;
+    journal_sequence = record->sequence;
+  }
+  /* Without records the next save starts at slot 0 */
+  journal_slot = (newest >= 0) ? newest : (CONFIG_JOURNAL_SLOTS - 1);
+  CFG("[JOURNAL] Newest slot %d sequence %lu\n", newest, journal_sequence);
+  return newest;
+}
+
 void load_config(Config* config)
 {
-  CFG("[COPY CONFIG] [FROM]0x%x [TO]0x%x [SIZE]%u\n", XIP_BASE + FLASH_TARGET_OFFSET, (uint)&config, sizeof(Config));
-  memcpy(config, (void *)(XIP_BASE + FLASH_TARGET_OFFSET), sizeof(Config));
+  int slot = journal_scan();
+  if (slot >= 0 && journal_record(slot)->magic == CONFIG_JOURNAL_TLV_MAGIC) {
+    const config_record *record = journal_record(slot);
+    const uint8_t *payload = ((const uint8_t *)record + sizeof(config_record));
+    CFG("[LOAD CONFIG] Slot %d schema version %u [SIZE]%lu\n", slot, payload[0], record->length);
+    default_config(config);  /* Fields not in the record keep their defaults */
+    if (record->length > 0 && payload[0] > CONFIG_TLV_VERSION) {  /* Tags may mean something else */
+      CFG("[LOAD CONFIG] Schema version %u is newer than %u, using defaults\n", payload[0], CONFIG_TLV_VERSION);
+      return;
+    }
+    if (record->length == 0 || config_tlv_decode(config, (payload + 1), (record->length - 1), NULL) < 0) {
+      CFG("[LOAD CONFIG] Malformed record, using defaults\n");
+      default_config(config);
+      return;
+    }
+    return;
+  }
+  if (slot >= 0) {  /* Raw struct record from before the tagged format */
+    CFG("[COPY CONFIG] [FROM]0x%x [TO]0x%x [SIZE]%u\n", (uint)journal_record(slot) + sizeof(config_record), (uint)&config, sizeof(Config));
+    memcpy(config, ((const uint8_t *)journal_record(slot) + sizeof(config_record)), sizeof(Config));
+  } else {  /* No journal yet, migrate from the legacy location */
+    CFG("[COPY CONFIG] [FROM]0x%x [TO]0x%x [SIZE]%u\n", XIP_BASE + FLASH_TARGET_OFFSET, (uint)&config, sizeof(Config));
+    memcpy(config, (void *)(XIP_BASE + FLASH_TARGET_OFFSET), sizeof(Config));
+  }
   stdio_flush();
   if (config->magic != MAGIC_SMOKE) {
       default_config(config);
       return;
   }
+  queue_save_config();  /* Rewrite in the tagged format */
   return;
 }
 
-void save_config_lowlevel(void* config_data)
+void save_config_lowlevel(void* data)
 {
+  config_write *write = (config_write *)data;
   uint32_t ints = save_and_disable_interrupts();
-  flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);  /* 4096 Bytes (sector aligend) erase as per SDK manual */
-  flash_range_program(FLASH_TARGET_OFFSET, config_data, CONFIG_SIZE /* FLASH_PAGE_SIZE */);  /* 256 Bytes (page aligned) write as per SDK manual */
+  if (write->erase) {
+    flash_range_erase((write->offset & ~(FLASH_SECTOR_SIZE - 1)), FLASH_SECTOR_SIZE);  /* 4096 Bytes (sector aligend) erase as per SDK manual */
+  }
+  flash_range_program(write->offset, write->page, FLASH_PAGE_SIZE);  /* 256 Bytes (page aligned) write as per SDK manual */
   restore_interrupts(ints);
   return;
 }
 
-void save_config(const Config* config)
+int save_config(const Config* config)
 {
-  uint8_t config_data[CONFIG_SIZE] = {0};
-  static_assert(sizeof(Config) < CONFIG_SIZE, "[CONFIG SAVE ERROR] Config struct doesn't fit inside CONFIG_SIZE");
-  memcpy(config_data, config, sizeof(Config));
-  int err = flash_safe_execute(save_config_lowlevel, config_data, 100);
+  static config_write write;
+  int slot = ((journal_slot + 1) % CONFIG_JOURNAL_SLOTS);
+  write.erase = ((slot % CONFIG_SLOTS_PER_SECTOR) == 0);  /* Only erase when entering the next sector */
+  if (!write.erase && !journal_slot_blank(slot)) {  /* Damaged slot, continue in the next sector */
+    slot = ((((slot / CONFIG_SLOTS_PER_SECTOR) + 1) * CONFIG_SLOTS_PER_SECTOR) % CONFIG_JOURNAL_SLOTS);
+    write.erase = true;
+  }
+  write.offset = (CONFIG_JOURNAL_OFFSET + (slot * FLASH_PAGE_SIZE));
+
+  config_record *record = (config_record *)write.page;
+  memset(write.page, 0xFF, FLASH_PAGE_SIZE);
+  uint8_t *payload = (write.page + sizeof(config_record));
+  record->magic = CONFIG_JOURNAL_TLV_MAGIC;
+  record->sequence = (journal_sequence + 1);
+  payload[0] = CONFIG_TLV_VERSION;
+  record->length = (1 + config_tlv_encode(config, (payload + 1), (FLASH_PAGE_SIZE - sizeof(config_record) - 1), true));
+  record->crc = journal_crc(record);
+
+  int err = flash_safe_execute(save_config_lowlevel, &write, 100);
   if (err) {
     CFG("[SAVE ERROR] %d\n", err);
+    return err;
+  }
+  journal_slot = slot;
+  journal_sequence++;
+  CFG("[SAVE CONFIG] Slot %d sequence %lu%s\n", slot, journal_sequence, (write.erase ? " (erased sector)" : ""));
+  return 0;
+}
+
+void queue_save_config(void)
+{ /* Returns immediately, the save is committed by config_save_task */
+  if (save_status != CONFIG_PENDING) save_requested_us = time_us_32();
+  save_status = CONFIG_PENDING;
+  CFG("[SAVE QUEUED]\n");
+  return;
+}
+
+void commit_save_config(void)
+{
+  if (save_status == CONFIG_PERSISTED) return;
+  save_status = (save_config(&usbsid_config) == 0) ? CONFIG_PERSISTED : CONFIG_SAVE_FAILED;
+  if (save_status == CONFIG_SAVE_FAILED) save_requested_us = time_us_32();  /* Retry after the max delay */
+  return;
+}
+
+void config_save_task(void)
+{ /* Runs from the core 0 main loop, never from a USB callback */
+  if (save_status == CONFIG_PERSISTED) return;
+  uint32_t now = time_us_32();
+  if ((now - last_rx_us) >= CONFIG_SAVE_IDLE_US || (now - save_requested_us) >= CONFIG_SAVE_MAX_US) {
+    commit_save_config();
   }
-  sleep_ms(100);
   return;
 }
 
@@ -351,6 +539,139 @@ void write_back_data(size_t buffersize)
   return;
 }
 
+static uint32_t achieved_millihz(uint32_t divider)
+{ /* Generated clock from its divider, else the measured external clock, else the configured rate */
+  return (divider != 0) ? sidclock_millihz(divider)
+    : (phi2_millihz != 0) ? phi2_millihz : (usbsid_config.clock_rate * 1000);
+}
+
+void write_clock_report(uint8_t command, int status)
+{ /* [command, status, requested Hz, achieved mHz, error ppb, divider 16.8] ~ big endian */
+  uint32_t divider = get_sidclock_divider();
+  uint32_t achieved = achieved_millihz(divider);
+  int32_t error = (int32_t)((((int64_t)achieved - ((int64_t)usbsid_config.clock_rate * 1000)) * 1000000) / (int64_t)usbsid_config.clock_rate);
+  CFG("[CLOCK] %s %lu Hz [ACHIEVED] %lu mHz [ERROR] %ld ppb [DIV] %lu+%lu/256\n",
+    (status == 0 ? "OK" : "ERROR"), usbsid_config.clock_rate, achieved, error, (divider >> 8), (divider & 0xFF));
+  memset(write_buffer_p, 0, MAX_BUFFER_SIZE);
+  write_buffer_p[0] = command;
+  write_buffer_p[1] = (status == 0) ? 0 : 1;
+  for (int i = 0; i < 4; i++) {
+    write_buffer_p[2 + i] = (usbsid_config.clock_rate >> (24 - (i * 8))) & BYTE;
+    write_buffer_p[6 + i] = (achieved >> (24 - (i * 8))) & BYTE;
+    write_buffer_p[10 + i] = ((uint32_t)error >> (24 - (i * 8))) & BYTE;
+  }
+  write_buffer_p[14] = (divider >> 16) & BYTE;
+  write_buffer_p[15] = (divider >> 8) & BYTE;
+  write_buffer_p[16] = divider & BYTE;
+  write_back_data(MAX_BUFFER_SIZE);
+  return;
+}
+
+void write_cycle_report(uint8_t command)
+{ /* [command, status, timer us 64, PHI2 cycles 64, achieved mHz] ~ big endian
+   * PHI2 runs off the same crystal as the timer or was measured against it,
+   * so the cycle count follows from the timer and the host can fit it against its own clock */
+  uint64_t now_us = time_us_64();
+  uint32_t achieved = achieved_millihz(get_sidclock_divider());
+  uint64_t cycles = (((now_us / 1000000) * achieved) / 1000) + (((now_us % 1000000) * achieved) / 1000000000);
+  memset(write_buffer_p, 0, MAX_BUFFER_SIZE);
+  write_buffer_p[0] = command;
+  write_buffer_p[1] = 0;
+  for (int i = 0; i < 8; i++) {
+    write_buffer_p[2 + i] = (now_us >> (56 - (i * 8))) & BYTE;
+    write_buffer_p[10 + i] = (cycles >> (56 - (i * 8))) & BYTE;
+  }
+  for (int i = 0; i < 4; i++) {
+    write_buffer_p[18 + i] = (achieved >> (24 - (i * 8))) & BYTE;
+  }
+  write_back_data(MAX_BUFFER_SIZE);
+  return;
+}
+
+static void config_tlv_reply(uint8_t command, uint8_t status, size_t length)
+{ /* Payload is already in config_array after the header, sent in MAX_BUFFER_SIZE chunks */
+  config_array[0] = command;
+  config_array[1] = CONFIG_TLV_VERSION;
+  config_array[2] = status;
+  config_array[3] = (length >> 8) & BYTE;
+  config_array[4] = length & BYTE;
+  size_t total = (CONFIG_TLV_REPLY_HEADER + length);
+  uint16_t crc = config_tlv_crc16(&config_array[1], (total - 1));
+  config_array[total++] = (crc >> 8) & BYTE;
+  config_array[total++] = crc & BYTE;
+  for (size_t i = 0; i < total; i += MAX_BUFFER_SIZE) {
+    memset(write_buffer_p, 0, MAX_BUFFER_SIZE);
+    memcpy(write_buffer_p, (config_array + i), (((total - i) < MAX_BUFFER_SIZE) ? (total - i) : MAX_BUFFER_SIZE));
+    write_back_data(MAX_BUFFER_SIZE);
+  }
+  return;
+}
+
+void handle_config_tlv(uint8_t * buffer)
+{ /* [command][version][flags][length][payload ...][crc hi][crc lo] */
+  static Config staged;
+  uint8_t command = buffer[0], flags = buffer[2], length = buffer[3];
+  uint8_t *payload = &buffer[CONFIG_TLV_REQ_HEADER];
+  uint8_t *out = &config_array[CONFIG_TLV_REPLY_HEADER];
+  size_t max = (sizeof(config_array) - CONFIG_TLV_REPLY_HEADER - CONFIG_TLV_CRC_SIZE);
+  size_t n = 0;
+
+  if ((CONFIG_TLV_REQ_HEADER + length + CONFIG_TLV_CRC_SIZE) > CONFIG_TLV_MAX_REQUEST) {
+    config_tlv_reply(command, CONFIG_TLV_ERR_FORMAT, 0);
+    return;
+  }
+  if (config_tlv_crc16(&buffer[1], (CONFIG_TLV_REQ_HEADER - 1 + length)) != ((payload[length] << 8) | payload[length + 1])) {
+    CFG("[CONFIG TLV] CRC ERROR\n");
+    config_tlv_reply(command, CONFIG_TLV_ERR_CRC, 0);
+    return;
+  }
+
+  if (command == CONFIG_TLV_READ) {
+    if (length == 0) {
+      n = config_tlv_encode(&usbsid_config, out, max, false);
+    } else {
+      for (int i = 0; i < length; i++) {
+        n += config_tlv_encode_field(&usbsid_config, payload[i], (out + n), (max - n));
+      }
+    }
+    CFG("[CONFIG TLV READ] %d tags, %u bytes\n", length, n);
+    config_tlv_reply(command, CONFIG_TLV_OK, n);
+    return;
+  }
+
+  if (buffer[1] > CONFIG_TLV_VERSION) {  /* Tags may mean something else */
+    CFG("[CONFIG TLV] SCHEMA VERSION %u IS NEWER THAN %u\n", buffer[1], CONFIG_TLV_VERSION);
+    config_tlv_reply(command, CONFIG_TLV_ERR_VERSION, 0);
+    return;
+  }
+
+  /* Decode into a copy so a malformed request changes nothing */
+  int skipped = 0;
+  memcpy(&staged, &usbsid_config, sizeof(Config));
+  int applied = config_tlv_decode(&staged, payload, length, &skipped);
+  if (applied < 0) {
+    config_tlv_reply(command, CONFIG_TLV_ERR_FORMAT, 0);
+    return;
+  }
+  uint32_t clock_rate = staged.clock_rate;
+  staged.clock_rate = usbsid_config.clock_rate;
+  memcpy(&usbsid_config, &staged, sizeof(Config));
+  if (clock_rate != usbsid_config.clock_rate) {  /* Validated, only retuned when applying */
+    if (flags & CONFIG_TLV_APPLY) {
+      set_clockrate(clock_rate, false);
+    } else if (clockrate_in_range(clock_rate)) {
+      usbsid_config.clock_rate = clock_rate;
+    }
+  }
+  CFG("[CONFIG TLV WRITE] %d applied, %d skipped, flags %02x\n", applied, skipped, flags);
+  if (flags & CONFIG_TLV_APPLY) apply_config();
+  if (flags & CONFIG_TLV_SAVE) queue_save_config();
+  out[0] = applied;
+  out[1] = skipped;
+  config_tlv_reply(command, CONFIG_TLV_OK, 2);
+  return;
+}
+
 void set_socket_config(uint8_t cmd, bool s1en, bool s1dual, uint8_t s1chip, bool s2en, bool s2dual, uint8_t s2chip, bool as_one)
 {
   usbsid_config.socketOne.enabled = s1en;
@@ -361,9 +682,8 @@ void set_socket_config(uint8_t cmd, bool s1en, bool s1dual, uint8_t s1chip, bool
   usbsid_config.socketTwo.chiptype = s2chip;  /* Chiptype must be clone for dualsid to work! */
   usbsid_config.socketTwo.act_as_one = as_one;
   if (cmd == 0) {
-    save_config(&usbsid_config);
-    load_config(&usbsid_config);
     apply_config();
+    queue_save_config();
   } else if (cmd == 1) {
     apply_socket_change();
   }
@@ -384,6 +704,7 @@ void handle_config_request(uint8_t * buffer)
   switch (buffer[0]) {
     case RESET_USBSID:
       CFG("[RESET_USBSID]\n");
+      commit_save_config();
       mcu_reset();
       break;
     case READ_CONFIG:
@@ -414,13 +735,11 @@ void handle_config_request(uint8_t * buffer)
       break;
     case RELOAD_CONFIG:
       CFG("[RELOAD_CONFIG]\n");
+      commit_save_config();
       load_config(&usbsid_config);
       apply_config();
-      for (int i = 0; i < count_of(clockrates); i++) {
-        if (clockrates[i] == usbsid_config.clock_rate) {
-          apply_clockrate(i);
-        }
-      }
+      verify_clockrate();
+      set_clockrate(usbsid_config.clock_rate, true);  /* The loaded rate may differ from the running one */
       break;
     case SET_CONFIG:
       CFG("[SET_CONFIG]\n");
@@ -567,22 +886,35 @@ void handle_config_request(uint8_t * buffer)
       break;
     case SAVE_CONFIG:
       CFG("[SAVE_CONFIG] and RESET_MCU\n");
-      save_config(&usbsid_config);
-      load_config(&usbsid_config);
+      save_status = CONFIG_PENDING;
+      commit_save_config();  /* Synchronous, we reset right after */
       mcu_reset();
       break;
     case SAVE_NORESET:
       CFG("[SAVE_CONFIG]\n");
-      save_config(&usbsid_config);
-      load_config(&usbsid_config);
       apply_config();
+      queue_save_config();
       break;
     case RESET_CONFIG:
       CFG("[RESET_CONFIG]\n");
       default_config(&usbsid_config);
-      save_config(&usbsid_config);
-      load_config(&usbsid_config);
       apply_config();
+      queue_save_config();
+      break;
+    case SAVE_STATUS:
+      CFG("[SAVE_STATUS] %d\n", save_status);
+      memset(write_buffer_p, 0, MAX_BUFFER_SIZE);
+      write_buffer_p[0] = SAVE_STATUS;
+      write_buffer_p[1] = save_status;
+      write_buffer_p[2] = (journal_sequence >> 24) & BYTE;
+      write_buffer_p[3] = (journal_sequence >> 16) & BYTE;
+      write_buffer_p[4] = (journal_sequence >> 8) & BYTE;
+      write_buffer_p[5] = journal_sequence & BYTE;
+      write_back_data(MAX_BUFFER_SIZE);
+      break;
+    case CONFIG_TLV_READ:
+    case CONFIG_TLV_WRITE:
+      handle_config_tlv(buffer);
       break;
     case WRITE_CONFIG:
       /* TODO: FINISH */
@@ -645,7 +977,7 @@ void handle_config_request(uint8_t * buffer)
         }
         CFG("\n");
       }
-      save_config(&usbsid_config);
+      queue_save_config();
       break;
     case RESET_MIDI_STATE: /* Reset all settings to zero */
       CFG("[RESET_MIDI_STATE]\n");
@@ -659,59 +991,67 @@ void handle_config_request(uint8_t * buffer)
         }
         CFG("\n");
       }
-      save_config(&usbsid_config);
+      queue_save_config();
       /* mcu_reset(); */
       break;
     case SET_CLOCK: /* Change SID clock frequency */
       CFG("[SET_CLOCK]\n");
       apply_clockrate((int)buffer[1]);
       break;
-    case DETECT_SIDS:
+    case SET_CLOCK_HZ: /* Change SID clock to any frequency within range */
+      CFG("[SET_CLOCK_HZ]\n");
+      write_clock_report(SET_CLOCK_HZ,
+        set_clockrate((((uint32_t)buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]), false));
+      break;
+    case CLOCK_INFO:
+      CFG("[CLOCK_INFO]\n");
+      write_clock_report(CLOCK_INFO, 0);
+      break;
+    case MEASURE_CLOCK: /* Re-measure the external clock, gate in 100ms steps */
+      CFG("[MEASURE_CLOCK]\n");
+      start_clock_measurement(constrain(buffer[1], 1, 10) * 100);  /* Replies when the gate ends */
+      break;
+    case DETECT_SIDS:  /* Replies with the config once detection is finished */
       CFG("[DETECT_SIDS]\n");
       detect_sid_types();
-      memset(write_buffer_p, 0 ,64);  /* Empty the write buffer pointer */
-      read_config(&usbsid_config);  /* Read the config into the config buffer */
-      memcpy(write_buffer_p, config_array, 64);  /* Copy the first 64 bytes from the buffer into the write buffer */
-      switch (dtype) {
-        case 'C':
-          cdc_write(cdc_itf, 64);
-          break;
-        case 'W':
-          webserial_write(wusb_itf, 64);
-          break;
-      }
       break;
-    case TEST_ALLSIDS:  /* ISSUE: This must be run on Core 1 so we can actually stop it! */
+    case TEST_ALLSIDS:
       CFG("[TEST_ALLSIDS]\n");
-      for (int s = 0; s < numsids; s++) {
-        CFG("[START TEST SID %d]\n", s);
-        sid_test(s, '1', 'A');
-      };
+      sid_test_start(SIDTEST_ALL, 0, numsids, 4);
       break;
-    /* ISSUE: This must be run on Core 1 so we can actually stop it! */
     case TEST_SID1:
     case TEST_SID2:
     case TEST_SID3:
     case TEST_SID4:
-      int s = (buffer[0] == TEST_SID1 ? 0
-        : buffer[0] == TEST_SID2 ? 1
-        : buffer[0] == TEST_SID3 ? 2
-        : buffer[0] == TEST_SID4 ? 3
-        : 0);  /* Fallback to SID 0 */
-      int t = (buffer[1] == 1 ? '1'  /* All tests */
-        : buffer[1] == 2 ? '2'  /* All waveforms test */
-        : buffer[1] == 3 ? '3'  /* Filter tests */
-        : buffer[1] == 4 ? '4'  /* Envelope tests */
-        : buffer[1] == 5 ? '5'  /* Modulation tests */
-        : '1');  /* Fallback to all tests */
-      int wf = (buffer[2] == 0 ? 'A'  /* All */
-        : buffer[2] == 1 ? 'T'  /* Triangle */
-        : buffer[2] == 2 ? 'S'  /* Sawtooth */
-        : buffer[2] == 3 ? 'P'  /* Pulse */
-        : buffer[2] == 4 ? 'N'  /* Noise */
-        : 'P');  /* Fallback to pulse waveform */
-      CFG("[TEST_SID%d] TEST: %c WF: %c\n", (s + 1), t, wf);
-      sid_test(s, t, wf);
+      int s = (buffer[0] - TEST_SID1);
+      int t = ((buffer[1] >= SIDTEST_ALL && buffer[1] <= SIDTEST_CHARACTERIZE)
+        ? buffer[1]  /* 1 All, 2 waveforms, 3 filter, 4 envelope, 5 modulation, 6 characterization */
+        : SIDTEST_ALL);  /* Fallback to all tests */
+      int wf = (buffer[2] == 0 ? 4  /* All */
+        : buffer[2] <= 4 ? (buffer[2] - 1)  /* Triangle, sawtooth, pulse, noise */
+        : 2);  /* Fallback to pulse waveform */
+      CFG("[TEST_SID%d] TEST: %d WF: %d\n", (s + 1), t, wf);
+      sid_test_start(t, s, (s + 1), wf);
+      break;
+    case TEST_STATUS:
+      sid_test_report(TEST_STATUS, write_buffer_p);
+      write_back_data(SIDTEST_REPORT_SIZE);
+      break;
+    case TEST_STOP:
+      CFG("[TEST_STOP]\n");
+      sid_test_stop();
+      sid_test_report(TEST_STOP, write_buffer_p);
+      write_back_data(SIDTEST_REPORT_SIZE);
+      break;
+    case TEST_REPORT:  /* Characterization results of the SID in byte 1 */
+      sid_char_report(TEST_REPORT, buffer[1], write_buffer_p);
+      write_back_data(SIDCHAR_REPORT_SIZE);
+      break;
+    case CYCLE_COUNT:  /* No logging, polled during playback */
+      write_cycle_report(CYCLE_COUNT);
+      break;
+    case SID_MUTE:  /* No logging, sent during playback */
+      set_sid_mute(((buffer[1] >> 4) & 0x3), (buffer[1] & 0xF));
       break;
     case USBSID_VERSION:
       CFG("[READ_FIRMWARE_VERSION]\n");
@@ -734,6 +1074,8 @@ void handle_config_request(uint8_t * buffer)
       CFG("[FLASH_SECTOR_SIZE]0x%x\n", FLASH_SECTOR_SIZE);
       CFG("[FLASH_PAGE_SIZE]0x%x\n", FLASH_PAGE_SIZE);
       CFG("[CONFIG_SIZE]0x%x\n", CONFIG_SIZE);
+      CFG("[CONFIG_JOURNAL_OFFSET]0x%x\n", CONFIG_JOURNAL_OFFSET);
+      CFG("[CONFIG_JOURNAL] Slot %d sequence %lu\n", journal_slot, journal_sequence);
       CFG("A %x %x %d\n", usbsid_config.magic, MAGIC_SMOKE, usbsid_config.magic != MAGIC_SMOKE);
       CFG("A %x %x %d\n", (uint32_t)usbsid_config.magic, (uint32_t)MAGIC_SMOKE, usbsid_config.magic != MAGIC_SMOKE);
       CFG("A %d %d\n", (int)usbsid_config.magic, (int)MAGIC_SMOKE);
@@ -957,6 +1299,7 @@ void apply_bus_config(void)
       }
     }
   }
+  swap_bus_mapping();
   return;
 }
 
@@ -1012,46 +1355,120 @@ void detect_default_config(void)
   return;
 }
 
-void apply_clockrate(int n_clock)
+static void retime_clock(void)
+{ /* Cycle conversion, Midi note tables and the PIO dividers all follow clock_rate */
+  sid_hz = usbsid_config.clock_rate;
+  sid_mhz = (sid_hz / 1000 / 1000);
+  sid_us = (1 / sid_mhz);
+  CFG("[CFG PICO] %lu Hz, %.0f MHz, %.4f uS\n", clock_get_hz(clk_sys), cpu_mhz, cpu_us);
+  CFG("[CFG C64]  %.0f Hz, %.6f MHz, %.4f uS\n", sid_hz, sid_mhz, sid_us);
+  /* Keep Midi notes in tune */
+  midi_select_note_table(usbsid_config.clock_rate);
+  /* Retune the running bus and clock, no teardown needed */
+  set_bus_clocks();
+  return;
+}
+
+bool clockrate_in_range(uint32_t clock_rate)
+{ /* The bus runs at 32 times the SID clock and its divider cannot go below 1 */
+  return (clock_rate >= CLOCK_MIN && clock_rate <= CLOCK_MAX
+    && clock_rate <= (clock_get_hz(clk_sys) / 64));
+}
+
+int set_clockrate(uint32_t clock_rate, bool force)
+{
+  if (usbsid_config.external_clock) {
+    CFG("[CLOCK] EXTERNAL CLOCK, SKIPPING SET_CLOCK\n");
+    return -1;
+  }
+  if (!clockrate_in_range(clock_rate)) {
+    CFG("[CLOCK ERROR] %lu Hz OUT OF RANGE (%d ~ %d)\n", clock_rate, CLOCK_MIN, CLOCK_MAX);
+    return -1;
+  }
+  if (clock_rate == usbsid_config.clock_rate && !force) {
+    CFG("[CLOCK FROM]%lu AND [CLOCK TO]%lu ARE THE SAME, SKIPPING SET_CLOCK\n", usbsid_config.clock_rate, clock_rate);
+    return 0;
+  }
+  CFG("[CLOCK FROM]%lu [CLOCK TO]%lu\n", usbsid_config.clock_rate, clock_rate);
+  usbsid_config.clock_rate = clock_rate;
+  retime_clock();
+  return 0;
+}
+
+static int apply_measured_clock(uint32_t millihz)
 {
+  phi2_millihz = millihz;
+  uint32_t clock_rate = ((phi2_millihz + 500) / 1000);
+  int status = 0;
+  if (!clockrate_in_range(clock_rate)) {
+    CFG("[CLOCK ERROR] MEASURED %lu Hz OUT OF RANGE, ASSUMING %d Hz\n", clock_rate, CLOCK_DEFAULT);
+    clock_rate = CLOCK_DEFAULT;
+    phi2_millihz = 0;
+    status = -1;
+  }
+  CFG("[EXTERNAL CLOCK] %lu Hz\n", clock_rate);
+  usbsid_config.clock_rate = clock_rate;
+  retime_clock();
+  return status;
+}
+
+int calibrate_external_clock(uint32_t gate_ms)
+{ /* Blocks for the whole gate, boot only */
   if (!usbsid_config.external_clock) {
-    if (clockrates[n_clock] != usbsid_config.clock_rate) {
-      CFG("[CLOCK FROM]%d [CLOCK TO]%d\n", usbsid_config.clock_rate, clockrates[n_clock]);
-      usbsid_config.clock_rate = clockrates[n_clock];
-      /* Cycled write buffer vars */
-      sid_hz = usbsid_config.clock_rate;
-      sid_mhz = (sid_hz / 1000 / 1000);
-      sid_us = (1 / sid_mhz);
-      CFG("[CFG PICO] %lu Hz, %.0f MHz, %.4f uS\n", clock_get_hz(clk_sys), cpu_mhz, cpu_us);
-      CFG("[CFG C64]  %.0f Hz, %.6f MHz, %.4f uS\n", sid_hz, sid_mhz, sid_us);
-      /* Start clock set */
-      deinit_sidclock();
-      init_sidclock();
-      restart_bus();
-      return;
-    } else {
-      CFG("[CLOCK FROM]%d AND [CLOCK TO]%d ARE THE SAME, SKIPPING SET_CLOCK\n", usbsid_config.clock_rate, clockrates[n_clock]);
-      return;
-    }
+    CFG("[CLOCK] NO EXTERNAL CLOCK TO MEASURE\n");
+    return -1;
   }
+  return apply_measured_clock(measure_phi2(gate_ms));
+}
+
+void start_clock_measurement(uint32_t gate_ms)
+{ /* Returns immediately, the clock report is sent by clock_measure_task */
+  if (measure_running) return;  /* The running measurement replies */
+  if (!usbsid_config.external_clock) {
+    CFG("[CLOCK] NO EXTERNAL CLOCK TO MEASURE\n");
+    write_clock_report(MEASURE_CLOCK, -1);
+    return;
+  }
+  if (!phi2_counter_start()) {
+    write_clock_report(MEASURE_CLOCK, -1);
+    return;
+  }
+  measure_gate_us = (gate_ms * 1000);
+  measure_dtype = dtype;
+  measure_running = true;
+  return;
+}
+
+void clock_measure_task(void)
+{ /* Runs from the core 0 main loop */
+  if (!measure_running || phi2_counter_elapsed_us() < measure_gate_us) return;
+  measure_running = false;
+  uint32_t millihz = phi2_counter_stop();
+  int status = usbsid_config.external_clock ? apply_measured_clock(millihz) : -1;  /* Switched to internal meanwhile */
+  char current = dtype;
+  dtype = measure_dtype;
+  write_clock_report(MEASURE_CLOCK, status);
+  dtype = current;
+  return;
+}
+
+void apply_clockrate(int n_clock)
+{
+  if (n_clock < 0 || n_clock >= count_of(clockrates)) {
+    CFG("[CLOCK ERROR] UNKNOWN CLOCK INDEX %d\n", n_clock);
+    return;
+  }
+  set_clockrate(clockrates[n_clock], false);
+  return;
 }
 
 void verify_clockrate(void)
 {
   if (!usbsid_config.external_clock) {
-    switch (usbsid_config.clock_rate) {
-      case CLOCK_DEFAULT:
-      case CLOCK_PAL:
-      case CLOCK_NTSC:
-      case CLOCK_DREAN:
-        break;
-      default:
-        CFG("[CLOCK ERROR] Detected unconventional clockrate (%ld) error in config, revert to default\n", usbsid_config.clock_rate);
-        usbsid_config.clock_rate = clockrates[0];
-        save_config(&usbsid_config);
-        load_config(&usbsid_config);
-        mcu_reset();
-        break;
+    if (!clockrate_in_range(usbsid_config.clock_rate)) {
+      CFG("[CLOCK ERROR] Detected unconventional clockrate (%ld) error in config, revert to default\n", usbsid_config.clock_rate);
+      set_clockrate(clockrates[0], true);
+      queue_save_config();
     }
     return;
   }
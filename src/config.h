@@ -48,8 +48,19 @@
 
 
 /* Config constants */
-#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)  /* Legacy single config location, read once for migration */
 #define CONFIG_SIZE (FLASH_SECTOR_SIZE / 4)  /* 1024 Bytes */
+/* Config journal ~ append only, one record per flash page spread over the last sectors of flash */
+#define CONFIG_JOURNAL_SECTORS 4
+#define CONFIG_JOURNAL_OFFSET (PICO_FLASH_SIZE_BYTES - (CONFIG_JOURNAL_SECTORS * FLASH_SECTOR_SIZE))
+#define CONFIG_JOURNAL_SLOTS ((CONFIG_JOURNAL_SECTORS * FLASH_SECTOR_SIZE) / FLASH_PAGE_SIZE)  /* 64 */
+#define CONFIG_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)  /* 16 */
+#define CONFIG_JOURNAL_MAGIC 0x47464355  /* UCFG ~ raw Config struct, only read for migration */
+#define CONFIG_JOURNAL_TLV_MAGIC 0x56544355  /* UCTV ~ schema version byte followed by tagged fields, see config_tlv.h */
+/* Deferred saves are committed once there was no incoming data for CONFIG_SAVE_IDLE_US
+ * or at the latest CONFIG_SAVE_MAX_US after the request */
+#define CONFIG_SAVE_IDLE_US 250000
+#define CONFIG_SAVE_MAX_US 2000000
 /* Compile time variable settings */
 #ifndef MAGIC_SMOKE
 #define MAGIC_SMOKE 19700101  /* DATEOFRELEASE */
@@ -134,6 +145,9 @@ enum
   WRITE_CONFIG     = 0x36,  /* Write full config as bytes */
   READ_SOCKETCFG   = 0x37,  /* Read socket config as bytes */
   RELOAD_CONFIG    = 0x38,  /* Reload and apply stored config from flash */
+  SAVE_STATUS      = 0x39,  /* Read the persisted status of the last save */
+  CONFIG_TLV_READ  = 0x3A,  /* Read tagged config fields, see config_tlv.h */
+  CONFIG_TLV_WRITE = 0x3B,  /* Write tagged config fields, see config_tlv.h */
 
   SINGLE_SID       = 0x40,
   DUAL_SID         = 0x41,
@@ -151,6 +165,14 @@ enum
   TEST_SID2        = 0x54,
   TEST_SID3        = 0x55,
   TEST_SID4        = 0x56,
+  SET_CLOCK_HZ     = 0x57,  /* Set SID clock in Hz, replies with a clock report */
+  CLOCK_INFO       = 0x58,  /* Read the clock report */
+  MEASURE_CLOCK    = 0x59,  /* Measure the external clock, replies with a clock report after the gate */
+  TEST_STATUS      = 0x5A,  /* Read the SID test or detection status report */
+  TEST_STOP        = 0x5B,  /* Abort a running SID test, replies with a status report */
+  TEST_REPORT      = 0x5C,  /* Read the characterization report of a SID */
+  CYCLE_COUNT      = 0x5D,  /* Read the timer and the PHI2 cycles since boot */
+  SID_MUTE         = 0x5E,  /* Mute voices of a SID, byte 1 SID in bits 4-5, voices in bits 0-2, volume in bit 3 */
 
   LOAD_MIDI_STATE  = 0x60,
   SAVE_MIDI_STATE  = 0x61,
@@ -161,6 +183,14 @@ enum
   TEST_FN          = 0x99,  /* TODO: Remove before v1 release */
 };
 
+/* Save status as returned by SAVE_STATUS */
+enum
+{
+  CONFIG_PERSISTED   = 0,  /* Nothing pending, flash matches the last save request */
+  CONFIG_PENDING     = 1,  /* Save queued, not yet written */
+  CONFIG_SAVE_FAILED = 2,  /* Last flash write failed, will be retried */
+};
+
 
 #ifdef __cplusplus
   }
@@ -0,0 +1,236 @@
+/*
+ * USBSID-Pico is a RPi Pico (RP2040) based board for interfacing one or two
+ * MOS SID chips and/or hardware SID emulators over (WEB)USB with your computer,
+ * phone or ASID supporting player
+ *
+ * config_tlv.h
+ * This file is part of USBSID-Pico (https://github.com/LouDnl/USBSID-Pico)
+ * File author: LouD
+ *
+ * Copyright (c) 2024-2025 LouD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _USBSID_CONFIG_TLV_H_
+#define _USBSID_CONFIG_TLV_H_
+#pragma once
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+
+/* Shared between the firmware and examples/config-tool, keep it free of Pico includes
+ * Include after the Config struct is defined, both sides use the same field names */
+
+/* Default includes */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+
+/* Schema version ~ bump when the meaning of an existing tag changes
+ * Adding tags does not need a bump, readers skip tags they don't know */
+#define CONFIG_TLV_VERSION 1
+
+/* Fields as X(tag, length, member) ~ values are big endian
+ * Tags are grouped as (Config struct item << 4) | field and are never renumbered or reused */
+#define CONFIG_TLV_FIELDS(X) \
+  X(0x01, 1, external_clock) \
+  X(0x02, 4, clock_rate) \
+  X(0x10, 1, socketOne.enabled) \
+  X(0x11, 1, socketOne.dualsid) \
+  X(0x12, 1, socketOne.chiptype) \
+  X(0x13, 1, socketOne.clonetype) \
+  X(0x14, 1, socketOne.sid1type) \
+  X(0x15, 1, socketOne.sid2type) \
+  X(0x20, 1, socketTwo.enabled) \
+  X(0x21, 1, socketTwo.dualsid) \
+  X(0x22, 1, socketTwo.chiptype) \
+  X(0x23, 1, socketTwo.clonetype) \
+  X(0x24, 1, socketTwo.sid1type) \
+  X(0x25, 1, socketTwo.sid2type) \
+  X(0x26, 1, socketTwo.act_as_one) \
+  X(0x30, 1, LED.enabled) \
+  X(0x31, 1, LED.idle_breathe) \
+  X(0x40, 1, RGBLED.enabled) \
+  X(0x41, 1, RGBLED.idle_breathe) \
+  X(0x42, 1, RGBLED.brightness) \
+  X(0x43, 1, RGBLED.sid_to_use) \
+  X(0x50, 1, Cdc.enabled) \
+  X(0x60, 1, WebUSB.enabled) \
+  X(0x70, 1, Asid.enabled) \
+  X(0x80, 1, Midi.enabled)
+
+/* Fields only the firmware stores */
+#ifdef CONFIG_TLV_FIRMWARE
+#define CONFIG_TLV_FIRMWARE_FIELDS(X) \
+  X(0x03, 1, default_config)
+#else
+#define CONFIG_TLV_FIRMWARE_FIELDS(X)
+#endif
+
+/* Bulk fields are only read when asked for by tag */
+#define CONFIG_TAG_MIDI_STATES 0x81  /* Midi.sid_states, 128 bytes */
+
+/* Frames ~ sent after the CONFIG command byte, replies start at byte 0
+ * Request: [command][version][flags][length][payload ...][crc hi][crc lo]
+ * Reply:   [command][version][status][length hi][length lo][payload ...][crc hi][crc lo]
+ * The CRC covers everything between the command byte and the CRC itself
+ * Read payload is a list of tags, an empty list reads all non bulk fields
+ * Write payload is a list of [tag][length][value ...] records and is replied with [applied][skipped] */
+#define CONFIG_TLV_REQ_HEADER  4
+#define CONFIG_TLV_REPLY_HEADER 5
+#define CONFIG_TLV_CRC_SIZE 2
+#define CONFIG_TLV_MAX_REQUEST 63  /* USB packet minus the command byte */
+#define CONFIG_TLV_MAX_REPLY 256
+
+/* Write flags */
+enum
+{
+  CONFIG_TLV_APPLY = 0x01,  /* Apply the config after writing */
+  CONFIG_TLV_SAVE  = 0x02,  /* Queue a save after writing */
+};
+
+/* Reply status */
+enum
+{
+  CONFIG_TLV_OK         = 0,
+  CONFIG_TLV_ERR_CRC    = 1,  /* Request CRC mismatch */
+  CONFIG_TLV_ERR_FORMAT = 2,  /* Request or record length out of bounds */
+  CONFIG_TLV_ERR_VERSION = 3,  /* Write from a newer schema version than the firmware knows */
+};
+
+
+/* CRC16-CCITT, polynomial 0x1021 with 0xFFFF as initial value */
+static inline uint16_t config_tlv_crc16(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t)(*data++ << 8);
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+/* Writes a big endian value of len bytes */
+static inline void config_tlv_put_value(uint8_t *buf, uint32_t value, uint8_t len)
+{
+  for (int i = 0; i < len; i++) {
+    buf[i] = (value >> ((len - 1 - i) * 8)) & 0xFF;
+  }
+}
+
+/* Reads a big endian value of len bytes */
+static inline uint32_t config_tlv_get_value(const uint8_t *buf, uint8_t len)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < len; i++) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+/* Encodes a single field as [tag][length][value], returns the bytes written
+ * or 0 when the tag is unknown or the record does not fit */
+static inline size_t config_tlv_encode_field(const Config *config, uint8_t tag, uint8_t *buf, size_t max)
+{
+  #define CONFIG_TLV_ENCODE(t, l, member) \
+    case t: \
+      if (max < (2 + l)) return 0; \
+      buf[0] = t; buf[1] = l; \
+      config_tlv_put_value(&buf[2], (uint32_t)config->member, l); \
+      return (2 + l);
+  switch (tag) {
+    CONFIG_TLV_FIELDS(CONFIG_TLV_ENCODE)
+    CONFIG_TLV_FIRMWARE_FIELDS(CONFIG_TLV_ENCODE)
+    case CONFIG_TAG_MIDI_STATES:
+      if (max < (2 + sizeof(config->Midi.sid_states))) return 0;
+      buf[0] = tag; buf[1] = sizeof(config->Midi.sid_states);
+      memcpy(&buf[2], config->Midi.sid_states, sizeof(config->Midi.sid_states));
+      return (2 + sizeof(config->Midi.sid_states));
+    default:
+      return 0;
+  }
+  #undef CONFIG_TLV_ENCODE
+}
+
+/* Decodes a single field value, returns false when the tag is unknown or
+ * the length does not match so the caller can skip it */
+static inline bool config_tlv_decode_field(Config *config, uint8_t tag, const uint8_t *value, uint8_t len)
+{
+  #define CONFIG_TLV_DECODE(t, l, member) \
+    case t: \
+      if (len != l) return false; \
+      config->member = config_tlv_get_value(value, l); \
+      return true;
+  switch (tag) {
+    CONFIG_TLV_FIELDS(CONFIG_TLV_DECODE)
+    CONFIG_TLV_FIRMWARE_FIELDS(CONFIG_TLV_DECODE)
+    case CONFIG_TAG_MIDI_STATES:
+      if (len != sizeof(config->Midi.sid_states)) return false;
+      memcpy(config->Midi.sid_states, value, len);
+      return true;
+    default:
+      return false;
+  }
+  #undef CONFIG_TLV_DECODE
+}
+
+/* Encodes all fields, bulk fields included when asked, returns the bytes written */
+static inline size_t config_tlv_encode(const Config *config, uint8_t *buf, size_t max, bool bulk)
+{
+  static const uint8_t tags[] = {
+    #define CONFIG_TLV_TAG(t, l, member) t,
+    CONFIG_TLV_FIELDS(CONFIG_TLV_TAG)
+    CONFIG_TLV_FIRMWARE_FIELDS(CONFIG_TLV_TAG)
+    #undef CONFIG_TLV_TAG
+  };
+  size_t pos = 0;
+  for (size_t i = 0; i < sizeof(tags); i++) {
+    pos += config_tlv_encode_field(config, tags[i], &buf[pos], (max - pos));
+  }
+  if (bulk) pos += config_tlv_encode_field(config, CONFIG_TAG_MIDI_STATES, &buf[pos], (max - pos));
+  return pos;
+}
+
+/* Decodes a list of records on top of the current values
+ * Unknown tags are skipped, returns the number of applied fields or -1 when malformed */
+static inline int config_tlv_decode(Config *config, const uint8_t *buf, size_t len, int *skipped)
+{
+  int applied = 0;
+  size_t pos = 0;
+  if (skipped) *skipped = 0;
+  while (pos < len) {
+    if ((len - pos) < 2 || (len - pos - 2) < buf[pos + 1]) return -1;
+    if (config_tlv_decode_field(config, buf[pos], &buf[pos + 2], buf[pos + 1])) {
+      applied++;
+    } else if (skipped) {
+      (*skipped)++;
+    }
+    pos += (2 + buf[pos + 1]);
+  }
+  return applied;
+}
+
+
+#ifdef __cplusplus
+  }
+#endif
+
+#endif /* _USBSID_CONFIG_TLV_H_ */
@@ -47,7 +47,21 @@ static uint sm_delay, offset_delay;
 static int dma_tx_control, dma_tx_data, dma_rx_data, dma_tx_delay;
 static uint16_t control_word, delay_word;
 static uint32_t data_word, read_data, dir_mask;
-static float sidclock_frequency, busclock_frequency;
+static uint32_t sidclock_divider, busclock_divider;  /* PIO clock dividers in 16.8 fixed point */
+static bool bus_running = false;
+
+/* Chip select and address mask per SID slot, built from the globals set in apply_bus_config
+ * Double buffered so a mapping is only ever read whole, never half updated */
+typedef struct {
+  uint8_t cs[4];
+  uint8_t mask[4];
+} bus_mapping;
+static bus_mapping bus_maps[2];
+static bus_mapping *volatile bus_map = &bus_maps[0];
+
+/* Mask per SID register for what goes out on the bus, set with set_sid_mute
+ * sid_memory keeps the value as written, so unmuting puts it back */
+static uint8_t write_mask[0x80] = { [0 ... 0x7F] = 0xFF };
 
 static int paused_state = 0;
 static uint8_t volume_state[4] = {0};
@@ -109,17 +123,53 @@ void init_vu(void)
   return;
 }
 
+/* Nearest 16.8 fixed point divider for numerator / denominator, clamped to the PIO range */
+static uint32_t clock_divider(uint64_t numerator, uint32_t denominator)
+{
+  if (denominator == 0) denominator = CLOCK_DEFAULT;
+  uint64_t divider = ((numerator + (denominator / 2)) / denominator);
+  return (uint32_t)((divider < 0x100) ? 0x100 : (divider > 0xFFFFFF) ? 0xFFFFFF : divider);
+}
+
+/* Achieved PHI2 frequency in millihertz for a 16.8 SID clock divider */
+uint32_t sidclock_millihz(uint32_t divider)
+{
+  return (uint32_t)((((uint64_t)clock_get_hz(clk_sys) * 128000) + (divider / 2)) / divider);
+}
+
+/* PHI2 toggles every state machine cycle, so PHI2 = sys_clk / (2 * div) and
+ * in 16.8 fixed point div = sys_clk * 128 / clock_rate
+ * The fractional divider dithers the edges by one system clock, an integer
+ * divider is preferred when it lands within CLOCK_INTEGER_PPM of the target */
+uint32_t calc_sidclock_divider(uint32_t clock_rate)
+{
+  uint64_t numerator = ((uint64_t)clock_get_hz(clk_sys) << 7);
+  uint32_t divider = clock_divider(numerator, clock_rate);
+  uint32_t whole = ((divider + 0x80) & 0xFFFFFF00);
+  if (whole != divider && whole != 0) {
+    int64_t error = ((int64_t)sidclock_millihz(whole) - ((int64_t)clock_rate * 1000));
+    if (error < 0) error = -error;
+    if ((error * 1000) <= ((int64_t)clock_rate * CLOCK_INTEGER_PPM)) divider = whole;
+  }
+  return divider;
+}
+
+/* The bus runs at 32 times PHI2, div = sys_clk * 4 / clock_rate in 16.8 fixed point */
+static uint32_t calc_busclock_divider(uint32_t clock_rate)
+{
+  return clock_divider(((uint64_t)clock_get_hz(clk_sys) << 2), clock_rate);
+}
+
 void setup_piobus(void)
 {
-  uint32_t pico_hz = clock_get_hz(clk_sys);
-  busclock_frequency = (float)pico_hz / (usbsid_config.clock_rate * 32) / 2;  /* Clock frequency is 8 times the SID clock */
+  busclock_divider = calc_busclock_divider(usbsid_config.clock_rate);  /* Clock frequency is 32 times the SID clock */
 
   CFG("[BUS CLK INIT] START\n");
-  CFG("[PI CLK]@%dMHz [DIV]@%.2f [BUS CLK]@%.2f [CFG SID CLK]%d\n",
-     (pico_hz / 1000 / 1000),
-     busclock_frequency,
-     ((float)pico_hz / busclock_frequency / 2),
-     (int)usbsid_config.clock_rate);
+  CFG("[PI CLK]@%luMHz [DIV]@%lu+%lu/256 [BUS CLK]@%luHz [CFG SID CLK]%lu\n",
+     (clock_get_hz(clk_sys) / 1000 / 1000),
+     (busclock_divider >> 8), (busclock_divider & 0xFF),
+     (uint32_t)(((uint64_t)clock_get_hz(clk_sys) << 7) / busclock_divider),
+     usbsid_config.clock_rate);
 
   { /* control bus */
     offset_control = pio_add_program(bus_pio, &bus_control_program);
@@ -131,7 +181,7 @@ void setup_piobus(void)
     sm_config_set_out_pins(&c_control, RW, 3);
     sm_config_set_in_pins(&c_control, D0);
     sm_config_set_jmp_pin(&c_control, RW);
-    sm_config_set_clkdiv(&c_control, busclock_frequency);
+    sm_config_set_clkdiv_int_frac(&c_control, (busclock_divider >> 8), (busclock_divider & 0xFF));
     pio_sm_init(bus_pio, sm_control, offset_control, &c_control);
     pio_sm_set_enabled(bus_pio, sm_control, true);
   }
@@ -147,7 +197,7 @@ void setup_piobus(void)
     pio_sm_set_pindirs_with_mask(bus_pio, sm_data, PIO_PINDIRMASK, PIO_PINDIRMASK);  /* WORKING */
     sm_config_set_out_pins(&c_data, D0, A5 + 1);
     sm_config_set_fifo_join(&c_data, PIO_FIFO_JOIN_TX);
-    sm_config_set_clkdiv(&c_data, busclock_frequency);
+    sm_config_set_clkdiv_int_frac(&c_data, (busclock_divider >> 8), (busclock_divider & 0xFF));
     pio_sm_init(bus_pio, sm_data, offset_data, &c_data);
     pio_sm_set_enabled(bus_pio, sm_data, true);
   }
@@ -209,6 +259,7 @@ void setup_dmachannels(void)
   }
   CFG("[DMA CHANNELS CLAIMED] C:%d TX:%d RX:%d D:%d\n", dma_tx_control, dma_tx_data, dma_rx_data, dma_tx_delay);
 
+  bus_running = true;
   CFG("[DMA CHANNELS INIT] FINISHED\n");
   return;
 }
@@ -228,6 +279,7 @@ void sync_pios(void)
 void restart_bus(void)
 {
   CFG("[RESTART BUS START]\n");
+  bus_running = false;
   /* disable delay timer dma */
   dma_channel_unclaim(dma_tx_delay);
   /* disable databus rx dma */
@@ -258,6 +310,79 @@ void restart_bus(void)
   return;
 }
 
+/* Wait until the DMA channels are idle and every bus state machine is
+ * stalled on its first pull with an empty FIFO, ie. the last queued
+ * bus cycle (including cycled write delays) has completed */
+static void drain_bus(void)
+{
+  if (!bus_running) return;
+  uint32_t start = time_us_32();
+  while (dma_channel_is_busy(dma_tx_control)
+    || dma_channel_is_busy(dma_tx_data)
+    || dma_channel_is_busy(dma_rx_data)
+    || dma_channel_is_busy(dma_tx_delay)
+    || !pio_sm_is_tx_fifo_empty(bus_pio, sm_control)
+    || !pio_sm_is_tx_fifo_empty(bus_pio, sm_data)
+    || !pio_sm_is_tx_fifo_empty(bus_pio, sm_delay)
+    || pio_sm_get_pc(bus_pio, sm_control) != offset_control
+    || pio_sm_get_pc(bus_pio, sm_data) != offset_data
+    || pio_sm_get_pc(bus_pio, sm_delay) != offset_delay) {
+    if ((time_us_32() - start) > BUS_DRAIN_TIMEOUT_US) {
+      CFG("[BUS DRAIN] TIMEOUT AFTER %dus\n", BUS_DRAIN_TIMEOUT_US);
+      break;
+    }
+    tight_loop_contents();
+  }
+  return;
+}
+
+/* Build the bus mapping from the current config globals and swap it in
+ * once the bus is drained, called from apply_bus_config */
+void swap_bus_mapping(void)
+{
+  bus_mapping *next = (bus_map == &bus_maps[0]) ? &bus_maps[1] : &bus_maps[0];
+  next->cs[0] = one;
+  next->cs[1] = two;
+  next->cs[2] = three;
+  next->cs[3] = four;
+  next->mask[0] = one_mask;
+  next->mask[1] = two_mask;
+  next->mask[2] = three_mask;
+  next->mask[3] = four_mask;
+  drain_bus();
+  bus_map = next;
+  CFG("[BUS MAPPING] SWAPPED\n");
+  return;
+}
+
+/* Change the SID and bus clock dividers in place without removing the PIO
+ * programs or releasing the DMA channels, called from apply_clockrate */
+void set_bus_clocks(void)
+{
+  busclock_divider = calc_busclock_divider(usbsid_config.clock_rate);
+  sidclock_divider = calc_sidclock_divider(usbsid_config.clock_rate);
+
+  CFG("[BUS CLK SET] START\n");
+  CFG("[PI CLK]@%luMHz [BUS DIV]@%lu+%lu/256 [SID DIV]@%lu+%lu/256 [SID CLK]@%lumHz [CFG SID CLK]%lu\n",
+    (clock_get_hz(clk_sys) / 1000 / 1000),
+    (busclock_divider >> 8), (busclock_divider & 0xFF),
+    (sidclock_divider >> 8), (sidclock_divider & 0xFF),
+    sidclock_millihz(sidclock_divider),
+    usbsid_config.clock_rate);
+  drain_bus();
+  uint32_t sm_mask = ((1u << sm_control) | (1u << sm_data) | (1u << sm_delay));
+  pio_sm_set_clkdiv_int_frac(bus_pio, sm_control, (busclock_divider >> 8), (busclock_divider & 0xFF));
+  pio_sm_set_clkdiv_int_frac(bus_pio, sm_data, (busclock_divider >> 8), (busclock_divider & 0xFF));
+  if (!usbsid_config.external_clock) {
+    pio_sm_set_clkdiv_int_frac(bus_pio, sm_clock, (sidclock_divider >> 8), (sidclock_divider & 0xFF));
+    sm_mask |= (1u << sm_clock);
+  }
+  /* Realign the divider phases so the bus stays in lockstep with PHI2 */
+  pio_clkdiv_restart_sm_mask(bus_pio, sm_mask);
+  CFG("[BUS CLK SET] FINISHED\n");
+  return;
+}
+
 /* Detect clock signal */
 int detect_clocksignal(void)
 {
@@ -276,22 +401,90 @@ int detect_clocksignal(void)
   return r;  /* 1 if clock detected */
 }
 
+/* External PHI2 edge counter, runs on a spare state machine between start and stop */
+static int sm_phi2 = -1;
+static uint offset_phi2;
+static uint64_t phi2_start_us;
+
+/* Starts counting rising edges on PHI2, returns false when no state machine is free */
+bool phi2_counter_start(void)
+{
+  if (sm_phi2 >= 0) return true;  /* Already counting */
+  int sm = pio_claim_unused_sm(bus_pio, false);
+  if (sm < 0 || !pio_can_add_program(bus_pio, &phi_counter_program)) {
+    if (sm >= 0) pio_sm_unclaim(bus_pio, sm);
+    CFG("[PHI2 MEASURE] NO FREE STATE MACHINE OR PROGRAM SPACE\n");
+    return false;
+  }
+  sm_phi2 = sm;
+  offset_phi2 = pio_add_program(bus_pio, &phi_counter_program);
+  pio_sm_config c = phi_counter_program_get_default_config(offset_phi2);
+  pio_sm_init(bus_pio, sm_phi2, offset_phi2, &c);
+  pio_sm_clear_fifos(bus_pio, sm_phi2);
+  pio_sm_exec(bus_pio, sm_phi2, pio_encode_mov_not(pio_x, pio_null));  /* x = 0xFFFFFFFF */
+
+  uint32_t irq = save_and_disable_interrupts();
+  phi2_start_us = time_us_64();
+  pio_sm_set_enabled(bus_pio, sm_phi2, true);
+  restore_interrupts(irq);
+  return true;
+}
+
+/* Microseconds since phi2_counter_start */
+uint32_t phi2_counter_elapsed_us(void)
+{
+  return (sm_phi2 < 0) ? 0 : (uint32_t)(time_us_64() - phi2_start_us);
+}
+
+/* Stops counting and frees the state machine, returns millihertz or 0 on failure
+ * Accuracy is +/- 1 edge and 1us over the gate, ~20ppm with a 100ms gate */
+uint32_t phi2_counter_stop(void)
+{
+  if (sm_phi2 < 0) return 0;
+  uint32_t irq = save_and_disable_interrupts();
+  pio_sm_set_enabled(bus_pio, sm_phi2, false);
+  uint64_t elapsed = (time_us_64() - phi2_start_us);
+  restore_interrupts(irq);
+
+  pio_sm_exec(bus_pio, sm_phi2, pio_encode_mov(pio_isr, pio_x));
+  pio_sm_exec(bus_pio, sm_phi2, pio_encode_push(false, false));
+  uint32_t edges = ~pio_sm_get(bus_pio, sm_phi2);
+  pio_remove_program(bus_pio, &phi_counter_program, offset_phi2);
+  pio_sm_unclaim(bus_pio, sm_phi2);
+  sm_phi2 = -1;
+
+  if (elapsed == 0) return 0;
+  uint32_t millihz = (uint32_t)((((uint64_t)edges * 1000000000) + (elapsed / 2)) / elapsed);
+  CFG("[PHI2 MEASURE] %lu EDGES IN %lu us = %lu mHz\n", edges, (uint32_t)elapsed, millihz);
+  return millihz;
+}
+
+/* Measure the external PHI2 frequency during a gate of gate_ms, returns millihertz or 0 on failure
+ * Blocks for the whole gate, only use it during boot, see clock_measure_task in config.c */
+uint32_t measure_phi2(uint32_t gate_ms)
+{
+  if (!phi2_counter_start()) return 0;
+  while (phi2_counter_elapsed_us() < (gate_ms * 1000)) {
+    tight_loop_contents();
+  }
+  return phi2_counter_stop();
+}
+
 /* Init nMHz square wave output */
 void init_sidclock(void)
 {
-  uint32_t pico_hz = clock_get_hz(clk_sys);
-  sidclock_frequency = (float)pico_hz / usbsid_config.clock_rate / 2;
+  sidclock_divider = calc_sidclock_divider(usbsid_config.clock_rate);
 
   CFG("[SID CLK INIT] START\n");
-  CFG("[PI CLK]@%dMHz [DIV]@%.2f [SID CLK]@%.2f [CFG SID CLK]%d\n",
-    (pico_hz / 1000 / 1000),
-    sidclock_frequency,
-    ((float)pico_hz / sidclock_frequency / 2),
-    (int)usbsid_config.clock_rate);
+  CFG("[PI CLK]@%luMHz [DIV]@%lu+%lu/256 [SID CLK]@%lumHz [CFG SID CLK]%lu\n",
+    (clock_get_hz(clk_sys) / 1000 / 1000),
+    (sidclock_divider >> 8), (sidclock_divider & 0xFF),
+    sidclock_millihz(sidclock_divider),
+    usbsid_config.clock_rate);
   offset_clock = pio_add_program(bus_pio, &clock_program);
   sm_clock = 0;  /* PIO1 SM0 */
   pio_sm_claim(bus_pio, sm_clock);
-  clock_program_init(bus_pio, sm_clock, offset_clock, PHI, sidclock_frequency);
+  clock_program_init(bus_pio, sm_clock, offset_clock, PHI, (sidclock_divider >> 8), (sidclock_divider & 0xFF));
   CFG("[SID CLK INIT] FINISHED\n");
   return;
 }
@@ -304,30 +497,19 @@ void deinit_sidclock(void)
   return;
 }
 
-static int __not_in_flash_func(set_bus_bits)(uint8_t address, uint8_t data)
+/* Current SID clock divider, 0 when running from an external clock */
+uint32_t get_sidclock_divider(void)
 {
-  switch (address) {
-    case 0x00 ... 0x1F:
-      if (one == 0b110 || one == 0b111) return 0;
-      data_word = (address & one_mask) << 8 | data;
-      control_word |= one;
-      break;
-    case 0x20 ... 0x3F:
-      if (two == 0b110 || two == 0b111) return 0;
-      data_word = (address & two_mask) << 8 | data;
-      control_word |= two;
-      break;
-    case 0x40 ... 0x5F:
-      if (three == 0b110 || three == 0b111) return 0;
-      data_word = (address & three_mask) << 8 | data;
-      control_word |= three;
-      break;
-    case 0x60 ... 0x7F:
-      if (four == 0b110 || four == 0b111) return 0;
-      data_word = (address & four_mask) << 8 | data;
-      control_word |= four;
-      break;
-  }
+  return (usbsid_config.external_clock ? 0 : sidclock_divider);
+}
+
+static int __not_in_flash_func(set_bus_bits)(uint8_t address, uint8_t data)
+{ /* one == 0x00, two == 0x20, three == 0x40, four == 0x60 */
+  const bus_mapping *map = bus_map;
+  uint8_t slot = ((address >> 5) & 0x3);
+  if (map->cs[slot] == 0b110 || map->cs[slot] == 0b111) return 0;
+  data_word = (address & map->mask[slot]) << 8 | (data & write_mask[address & 0x7F]);
+  control_word |= map->cs[slot];
   return 1;
 }
 
@@ -445,6 +627,21 @@ void mute_sid(void)
   return;
 }
 
+void set_sid_mute(int sidno, uint8_t mask)
+{ /* Voices lose their waveform bits, volume its low nibble, then the registers are sent again as written */
+  if (sidno < 0 || sidno > 3) return;
+  uint8_t base = (0x20 * sidno);
+  for (int v = 0; v < 3; v++) {
+    write_mask[(base + (7 * v) + 0x04)] = ((mask & (1 << v)) ? 0x0F : 0xFF);
+  }
+  write_mask[(base + 0x18)] = ((mask & 0x08) ? 0xF0 : 0xFF);
+  for (int v = 0; v < 3; v++) {
+    bus_operation((0x10 | WRITE), (base + (7 * v) + 0x04), sid_memory[(base + (7 * v) + 0x04)]);
+  }
+  bus_operation((0x10 | WRITE), (base + 0x18), sid_memory[(base + 0x18)]);
+  return;
+}
+
 void enable_sid(void)
 {
   paused_state = 0;
@@ -110,6 +110,19 @@
 /* Util */
 #define bPIN(i) ( 1 << i )
 
+/* Maximum time to wait for in flight bus cycles before reconfiguring */
+#define BUS_DRAIN_TIMEOUT_US 10000
+
+/* Prefer a jitter free integer SID clock divider when it is within this many ppm */
+#ifndef CLOCK_INTEGER_PPM
+#define CLOCK_INTEGER_PPM 20
+#endif /* CLOCK_INTEGER_PPM */
+
+/* External PHI2 measurement gate time */
+#ifndef PHI2_GATE_MS
+#define PHI2_GATE_MS 100
+#endif /* PHI2_GATE_MS */
+
 
 #ifdef __cplusplus
   }
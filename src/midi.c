@@ -45,6 +45,9 @@ extern uint8_t __not_in_flash_func(bus_operation)(uint8_t command, uint8_t addre
 /* ASID externals */
 extern void process_sysex(uint8_t *buffer, int size);
 
+/* SID externals */
+extern bool sid_test_owns(uint8_t address);
+
 /* Util externals */
 extern long map(long x, long in_min, long in_max, long out_min, long out_max);
 
@@ -62,6 +65,8 @@ int vt[12] = { 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2 };  /* Voice table */
 int voices[12] = {0};
 int voice = 0;
 int curr_midi_channel;  /* For use in config.c */
+const uint16_t *musical_scale = musical_scale_default;  /* Note frequencies for the active clock rate */
+static uint16_t musical_scale_custom[128];  /* Built at runtime for non standard clock rates */
 // int freevoice = 0;
 
 void midi_bus_operation(uint8_t a, uint8_t b);
@@ -73,21 +78,67 @@ void midi_init(void)
   memset(midimachine.usbstreambuffer, 0, sizeof midimachine.usbstreambuffer);
   memset(midimachine.channelkey_states, 0, sizeof midimachine.channelkey_states);
   memset(midimachine.bank1channelgate, true, sizeof midimachine.bank1channelgate);
+  memset(midimachine.cc_dirty, 0, sizeof midimachine.cc_dirty);
+  memset(midimachine.channelbend, 0, sizeof midimachine.channelbend);
+  midi_select_note_table(usbsid_config.clock_rate);
+  mod_init();
 
   /* Initial state and index */
   midimachine.bus = FREE;
   midimachine.state = IDLE;
   midimachine.index = 0;
+  midimachine.running_status = 0;
+  midimachine.running = false;
   curr_midi_channel = 0;
 
   /* NOTE: Midi state is not loaded from config on init, needs LOAD_MIDI_STATE command once */
 }
 
 
+void midi_select_note_table(uint32_t clock_rate)
+{
+  switch (clock_rate) {
+    case CLOCK_PAL:
+      musical_scale = musical_scale_pal;
+      break;
+    case CLOCK_NTSC:
+      musical_scale = musical_scale_ntsc;
+      break;
+    case CLOCK_DREAN:
+      musical_scale = musical_scale_drean;
+      break;
+    case 0:
+    case CLOCK_DEFAULT:
+      musical_scale = musical_scale_default;
+      break;
+    default:  /* Any other rate gets its own table */
+      for (int i = 0; i < 128; i++) {
+        uint64_t frequency = ((((uint64_t)musical_scale_millihz[i] << 24) + ((uint64_t)clock_rate * 500)) / ((uint64_t)clock_rate * 1000));
+        musical_scale_custom[i] = (frequency > 0xFFFF) ? 0xFFFF : (uint16_t)frequency;
+      }
+      musical_scale = musical_scale_custom;
+      break;
+  }
+}
+
+uint16_t note_frequency(int channel, uint8_t note)
+{ /* Integer only, pitch bend is applied from the fine step table */
+  uint32_t frequency = musical_scale[(note & 0x7F)];
+  int bend = midimachine.channelbend[channel];
+  if (bend != 0) {
+    frequency = ((frequency * pitch_bend_fine[((bend >> 6) + 128)]) >> 15);
+  }
+  return (frequency > 0xFFFF ? 0xFFFF : frequency);
+}
+
+
 /* Write helper functions */
 
 void midi_bus_operation(uint8_t a, uint8_t b)
 {
+  /* A direct write supersedes any pending CC value for this register */
+  midimachine.cc_dirty[((a >> 5) & 0x3)] &= ~(1u << (a & 0x1F));
+  if (sid_test_owns(a)) return;  /* A running test has the SID to itself */
   bus_operation(0x10, a, b);
 }
 
@@ -104,6 +155,42 @@ void write_triple(int channel, int sidno, int reg)
   }
 }
 
+void midi_queue_register(uint8_t sidno, uint8_t reg, uint8_t value)
+{  /* Deferred ~ only the last value before the next flush reaches the bus */
+  midimachine.cc_shadow[sidno][reg] = value;
+  midimachine.cc_dirty[sidno] |= (1u << reg);
+}
+
+void write_cc(int channel, int sidno, int reg)
+{
+  midi_queue_register(sidno, reg, midimachine.channel_states[channel][sidno][reg]);
+}
+
+void write_cc_triple(int channel, int sidno, int reg)
+{
+  for (int i = 0; i < 3; i++) {
+    write_cc(channel, sidno, ((i * 7) + reg));
+  }
+}
+
+void __not_in_flash_func(midi_cc_flush_task)(void)
+{
+  static uint32_t last_flush = 0;
+  uint32_t now = time_us_32();
+  if ((now - last_flush) < MIDI_CC_FLUSH_US) return;
+  last_flush = now;
+  for (int sidno = 0; sidno < 4; sidno++) {
+    uint32_t dirty = midimachine.cc_dirty[sidno];
+    midimachine.cc_dirty[sidno] = 0;
+    if (sid_test_owns(0x20 * sidno)) continue;
+    while (dirty) {
+      int reg = __builtin_ctz(dirty);
+      dirty &= (dirty - 1);
+      bus_operation(0x10, ((0x20 * sidno) | reg), midimachine.cc_shadow[sidno][reg]);
+    }
+  }
+}
+
 void write_voice(int channel, int sidno, int voice)
 {  /* Voice specific */
   addr = (0x20 * sidno);
@@ -115,6 +202,7 @@ void write_voice(int channel, int sidno, int voice)
 
 void write_note(int channel, int sidno, int voice)
 {
+  if (midimachine.mod_params[channel][MOD_PORTA] != 0) return;  /* Modulation engine glides to the new note */
   addr = (0x20 * sidno);
   midi_bus_operation((addr | (0x00 + voice)), midimachine.channel_states[channel][sidno][NOTELO + voice]);
   midi_bus_operation((addr | (0x01 + voice)), midimachine.channel_states[channel][sidno][NOTEHI + voice]);
@@ -182,10 +270,10 @@ void bank_zero_sidsetter_dualregister(int channel, int val, int hi, int lo, int
   for (int sid = 0; sid < numsids; sid++) {
     /* Dual Hi */
     midimachine.channel_states[channel][sid][hi] = ((val & himask) >> hishift);
-    write(channel, sid, hi);  /* HI REG */
+    write_cc(channel, sid, hi);  /* HI REG */
     /* Dual Lo */
     midimachine.channel_states[channel][sid][lo] = (val & lomask);
-    write(channel, sid, lo);  /* LO REG */
+    write_cc(channel, sid, lo);  /* LO REG */
   }
 }
 
@@ -193,10 +281,10 @@ void bank_one_sidsetter_dualregister(int channel, int sidno, int val, int hi, in
 { /* For provided hi and lo registers of provided SID */
   /* Dual Hi */
   midimachine.channel_states[channel][sidno][hi] = ((val & himask) >> hishift);
-  write(channel, sidno, hi);
+  write_cc(channel, sidno, hi);
   /* Dual Lo */
   midimachine.channel_states[channel][sidno][lo] = (val & lomask);
-  write(channel, sidno, lo);
+  write_cc(channel, sidno, lo);
 }
 
 void bank_zero_voicesetter_dualregister(int channel, int val, int hi, int lo, int himask, int lomask, int hishift)
@@ -208,8 +296,8 @@ void bank_zero_voicesetter_dualregister(int channel, int val, int hi, int lo, in
       /* Dual Lo */
       midimachine.channel_states[channel][sid][(i * 7) + lo] = (val & lomask);
     }
-    write_triple(channel, sid, hi);  /* HI REG */
-    write_triple(channel, sid, lo);  /* LO REG */
+    write_cc_triple(channel, sid, hi);  /* HI REG */
+    write_cc_triple(channel, sid, lo);  /* LO REG */
   }
 }
 
@@ -217,10 +305,10 @@ void bank_one_voicesetter_dualregister(int channel, int sidno, int voiceno, int
 { /* For provided hi and lo registers of provided voice of provided SID */
   /* Dual Hi */
   midimachine.channel_states[channel][sidno][(voiceno * 7) + hi] = ((val & himask) >> hishift);
-  write(channel, sidno, ((voiceno * 7) + hi));
+  write_cc(channel, sidno, ((voiceno * 7) + hi));
   /* Dual Lo */
   midimachine.channel_states[channel][sidno][(voiceno * 7) + lo] = (val & lomask);
-  write(channel, sidno, ((voiceno * 7) + lo));
+  write_cc(channel, sidno, ((voiceno * 7) + lo));
 }
 
 void bank_zero_sidsetter_singleregister(int channel, int val, int reg, int mask)
@@ -231,7 +319,7 @@ void bank_zero_sidsetter_singleregister(int channel, int val, int reg, int mask)
     keep_state &= mask;
     val = keep_state | val;
     midimachine.channel_states[channel][sid][reg] = val;
-    write(channel, sid, reg);
+    write_cc(channel, sid, reg);
   }
 }
 
@@ -242,7 +330,7 @@ void bank_one_sidsetter_singleregister(int channel, int sidno, int val, int reg,
   keep_state &= mask;
   val = keep_state | val;
   midimachine.channel_states[channel][sidno][reg] = val;
-  write(channel, sidno, reg);
+  write_cc(channel, sidno, reg);
 }
 
 void bank_one_voicesetter_singleregister(int channel, int sidno, int voiceno, int val, int reg, int mask)
@@ -252,7 +340,7 @@ void bank_one_voicesetter_singleregister(int channel, int sidno, int voiceno, in
   keep_state &= mask;
   val = keep_state | val;
   midimachine.channel_states[channel][sidno][((voiceno * 7) + reg)] = val;
-  write(channel, sidno, ((voiceno * 7) + reg));
+  write_cc(channel, sidno, ((voiceno * 7) + reg));
 }
 
 void bank_zero_voicetoggle(int channel, int val, int reg, uint8_t toggle)
@@ -264,7 +352,7 @@ void bank_zero_voicetoggle(int channel, int val, int reg, uint8_t toggle)
       val = val == 1 ? keep_state |= toggle : keep_state & ~(toggle);
       midimachine.channel_states[channel][sid][(i * 7) + reg] = val;
     }
-    write_triple(channel, sid, reg);
+    write_cc_triple(channel, sid, reg);
   }
 }
 
@@ -274,7 +362,7 @@ void bank_one_voicetoggle(int channel, int sidno, int voiceno, int val, int reg,
   keep_state = midimachine.channel_states[channel][sidno][(voiceno * 7) + reg];
   val = val == 1 ? keep_state |= toggle : keep_state & ~(toggle);
   midimachine.channel_states[channel][sidno][(voiceno * 7) + reg] = val;
-  write(channel, sidno, (voiceno * 7) + reg);
+  write_cc(channel, sidno, (voiceno * 7) + reg);
 }
 
 // void bank_zero_sidsetter_single(int channel, int val, int reg, int mask)
@@ -384,6 +472,7 @@ void bank_null_on(int channel, int sidno, uint8_t Flo, uint8_t Fhi)
   midimachine.channel_states[channel][sidno][NOTEHI + 14] = Fhi;
   write_triple(channel, sidno, NOTELO);
   write_triple(channel, sidno, NOTEHI);
+  for (int i = 0; i < 3; i++) mod_note_on(channel, sidno, i);
   midimachine.channelkey_states[channel][sidno][N_KEYS]++;
 }
 
@@ -446,6 +535,7 @@ void bank_zero_on(int channel, int sidno, uint8_t note, uint8_t Flo, uint8_t Fhi
   midimachine.channel_states[channel][sidno][NOTELO + (vt[voice] * 7)] = Flo;
   midimachine.channel_states[channel][sidno][NOTEHI + (vt[voice] * 7)] = Fhi;
   write_note(channel, sidno, (vt[voice] * 7));
+  mod_note_on(channel, sidno, vt[voice]);
   /* Control ~ Gate bit on */
   val = midimachine.channel_states[channel][sidno][CONTR + (vt[voice] * 7)] & 0xFE;
   val |= 0x1;
@@ -471,10 +561,12 @@ void bank_one_on(int channel, int sidno, int voiceno, uint8_t note, uint8_t Flo,
   // printf("%d %d %d\n", channel, sidno, voiceno);
   /* Keepstate */
   voices[voice] = note;
+  midimachine.channelnote[channel] = note;
   /* Note Lo & Hi */
   midimachine.channel_states[channel][sidno][NOTELO + (voiceno * 7)] = Flo;
   midimachine.channel_states[channel][sidno][NOTEHI + (voiceno * 7)] = Fhi;
   write_note(channel, sidno, (voiceno * 7));
+  mod_note_on(channel, sidno, voiceno);
   /* Control ~ Gate bit on */
   if (midimachine.bank1channelgate[channel]) {
     int val;
@@ -497,14 +589,15 @@ long map_to_onoff(long in)
 
 void process_midi(uint8_t *buffer, int size)
 {
+  int /* in, */ out, volume, channel, voiceno, sidno, bank, program;
+  curr_midi_channel = channel = (buffer[0] & R_NIBBLE);  /* 1 -> 16 ~ 0x0 -> 0xF */
+
   uint8_t note_index = buffer[1];
-  uint16_t frequency = musical_scale_values[note_index];
+  uint16_t frequency = note_frequency(channel, note_index);
   uint8_t Flo, Fhi;
   Flo = (frequency & VOICE_FREQLO);
-  Fhi = ((frequency >> 8) >= VOICE_FREQHI ? VOICE_FREQHI : (frequency >> 8));
+  Fhi = ((frequency >> 8) & VOICE_FREQHI);
 
-  int /* in, */ out, volume, channel, voiceno, sidno, bank, program;
-  curr_midi_channel = channel = (buffer[0] & R_NIBBLE);  /* 1 -> 16 ~ 0x0 -> 0xF */
   bank = midimachine.channelbank[channel];  /* Set Bank */
   program = midimachine.channelprogram[channel]; /* Set Program */
   voiceno = vt[(int)channel];  /* Sets the sid voice according the the channel we're on, max voices is 12 with 4x SID */ // TODO: Limit at max voices
@@ -693,10 +786,11 @@ void process_midi(uint8_t *buffer, int size)
               break;
             case CC_NOTE:  /* Note frequency */  // NOTE: NOT AVAILABLE FOR BANK ZERO FOR NOW
               uint8_t b1_note_index = buffer[2];
-              uint16_t b1_frequency = musical_scale_values[b1_note_index];
+              uint16_t b1_frequency = note_frequency(channel, b1_note_index);
               uint8_t b1_Flo, b1_Fhi;
               b1_Flo = (b1_frequency & VOICE_FREQLO);
-              b1_Fhi = ((b1_frequency >> 8) >= VOICE_FREQHI ? VOICE_FREQHI : (b1_frequency >> 8));
+              b1_Fhi = ((b1_frequency >> 8) & VOICE_FREQHI);
+              midimachine.channelnote[channel] = b1_note_index;
               /* Keepstate */
               voices[voice] = buffer[2];
               /* Note Lo & Hi */
@@ -758,6 +852,40 @@ void process_midi(uint8_t *buffer, int size)
               if (bank == 0) bank_zero_voicetoggle(channel, out, CONTR, BIT_0);
               if (bank == 1) bank_one_voicetoggle(channel, sidno, voiceno, out, CONTR, BIT_0);
               break;
+            /* Modulation engine */
+            case CC_VIBR:  /* Vibrato rate */
+              mod_set_param(channel, MOD_VIB_RATE, buffer[2]);
+              break;
+            case CC_VIBD:  /* Vibrato depth */
+              mod_set_param(channel, MOD_VIB_DEPTH, buffer[2]);
+              break;
+            case CC_PWMR:  /* Pulse width LFO rate */
+              mod_set_param(channel, MOD_PWM_RATE, buffer[2]);
+              break;
+            case CC_PWMD:  /* Pulse width LFO depth */
+              mod_set_param(channel, MOD_PWM_DEPTH, buffer[2]);
+              break;
+            case CC_FLTR:  /* Filter LFO rate */
+              mod_set_param(channel, MOD_FLT_RATE, buffer[2]);
+              break;
+            case CC_FLTD:  /* Filter LFO depth */
+              mod_set_param(channel, MOD_FLT_DEPTH, buffer[2]);
+              break;
+            case CC_PORT:  /* Portamento time */
+              mod_set_param(channel, MOD_PORTA, buffer[2]);
+              break;
+            case CC_PENV:  /* Pitch envelope depth */
+              mod_set_param(channel, MOD_PENV_DEPTH, buffer[2]);
+              break;
+            case CC_PENT:  /* Pitch envelope time */
+              mod_set_param(channel, MOD_PENV_TIME, buffer[2]);
+              break;
+            case CC_WENV:  /* Pulse width envelope depth */
+              mod_set_param(channel, MOD_WENV_DEPTH, buffer[2]);
+              break;
+            case CC_WENT:  /* Pulse width envelope time */
+              mod_set_param(channel, MOD_WENV_TIME, buffer[2]);
+              break;
             case CC_GTEN:  /* Custom setting for handling gate on and gate off in noteon and noteoff */
               out = map_to_onoff(buffer[2]);
               midimachine.bank1channelgate[channel] = (bool)out;
@@ -891,6 +1019,28 @@ void process_midi(uint8_t *buffer, int size)
     case 0xD0 ... 0xDF:  /* Channel 0~16 Pressure (After-touch) */
       break;
     case 0xE0 ... 0xEF:  /* Channel 0~16 Pitch Bend Change */
+      midimachine.channelbend[channel] = (((buffer[2] & MIDI_CC_MAX) << 7) | (buffer[1] & MIDI_CC_MAX)) - 8192;
+      switch (bank) {
+        case 0:  /* Bank 0 ~ Every sounding voice */
+          for (int i = 0; i < (numsids * 3); i++) {
+            if (voices[i] == 0) continue;
+            frequency = note_frequency(channel, voices[i]);
+            midimachine.channel_states[channel][st[i]][NOTELO + (vt[i] * 7)] = (frequency & VOICE_FREQLO);
+            midimachine.channel_states[channel][st[i]][NOTEHI + (vt[i] * 7)] = ((frequency >> 8) & VOICE_FREQHI);
+            write_cc(channel, st[i], NOTELO + (vt[i] * 7));
+            write_cc(channel, st[i], NOTEHI + (vt[i] * 7));
+          }
+          break;
+        case 1:  /* Bank 1 ~ Single voice */
+          frequency = note_frequency(channel, midimachine.channelnote[channel]);
+          midimachine.channel_states[channel][sidno][NOTELO + (voiceno * 7)] = (frequency & VOICE_FREQLO);
+          midimachine.channel_states[channel][sidno][NOTEHI + (voiceno * 7)] = ((frequency >> 8) & VOICE_FREQHI);
+          write_cc(channel, sidno, NOTELO + (voiceno * 7));
+          write_cc(channel, sidno, NOTEHI + (voiceno * 7));
+          break;
+        default:
+          break;
+      }
       break;
     default:
       break;
@@ -926,6 +1076,34 @@ void process_midi(uint8_t *buffer, int size)
 
 int stream_size;
 
+#ifdef MIDI_DEBUG
+/* Throughput counters, logged once per second */
+static uint32_t stats_time = 0, stats_notes = 0, stats_cc = 0, stats_other = 0, stats_running = 0;
+
+static void midi_stats(uint8_t status, bool running)
+{
+  switch (status & 0xF0) {
+    case 0x80:
+    case 0x90:
+      stats_notes++;
+      break;
+    case 0xB0:
+      stats_cc++;
+      break;
+    default:
+      stats_other++;
+      break;
+  }
+  if (running) stats_running++;
+  uint32_t now = to_ms_since_boot(get_absolute_time());
+  if ((now - stats_time) >= 1000) {
+    MIDBG("[MIDI STATS] %lu notes/s %lu cc/s %lu other/s (%lu running status)\n",
+      stats_notes, stats_cc, stats_other, stats_running);
+    stats_time = now, stats_notes = 0, stats_cc = 0, stats_other = 0, stats_running = 0;
+  }
+}
+#endif
+
 void process_buffer(uint8_t buffer)
 { /* ISSUE: Processing the stream byte by byte makes it prone to latency */
   if (midimachine.index != 0) {
@@ -936,6 +1114,7 @@ void process_buffer(uint8_t buffer)
     switch (buffer) {
       /* System Exclusive */
       case 0xF0:  /* System Exclusive Start */
+        midimachine.running_status = 0;
         if (midimachine.bus != CLAIMED && midimachine.type == NONE) {
           midimachine.state = RECEIVING;
           midimachine.type = SYSEX;
@@ -947,9 +1126,13 @@ void process_buffer(uint8_t buffer)
         break;
       case 0xF7:  /* System Exclusive End of SysEx (EOX) */
         if (midimachine.bus == CLAIMED && midimachine.type == SYSEX) {
-          midimachine.streambuffer[midimachine.index] = buffer;
-          midimachine.index++;
-          process_sysex(midimachine.streambuffer, midimachine.index);
+          if (midimachine.state == RECEIVING && midimachine.index < count_of(midimachine.streambuffer)) {
+            midimachine.streambuffer[midimachine.index] = buffer;
+            midimachine.index++;
+            process_sysex(midimachine.streambuffer, midimachine.index);
+          } else {  /* Truncated, do not act on a partial message */
+            MIDBG("[SYSEX DROPPED] %d bytes\n", midimachine.index);
+          }
           midimachine.bus = FREE;
           midimachine.type = NONE;
           midimachine.state = IDLE;
@@ -961,6 +1144,9 @@ void process_buffer(uint8_t buffer)
       case 0xF4:  /* System Exclusive Undefined (Reserved) */
       case 0xF5:  /* System Exclusive Undefined (Reserved) */
       case 0xF6:  /* System Exclusive Tune request */
+        midimachine.running_status = 0;  /* System Common cancels running status */
+        break;
+      /* System Real-Time ~ may appear anywhere and leaves running status intact */
       case 0xF8:  /* System Exclusive Timing clock */
       case 0xF9:  /* System Exclusive Undefined (Reserved) */
       case 0xFA:  /* System Exclusive Start */
@@ -974,6 +1160,7 @@ void process_buffer(uint8_t buffer)
       case 0xC0 ... 0xCF:  /* Channel 0~16 Program (Patch) change */
       case 0xD0 ... 0xDF:  /* Channel 0~16 Pressure (After-touch) */
         midi_bytes = 2;
+        midimachine.running_status = buffer;
         if (midimachine.bus != CLAIMED && midimachine.type == NONE) {
           if (midimachine.index == 0) MIDBG("[M][B%d]$%02x#%03d", midimachine.index, buffer, buffer);
           midimachine.type = MIDI;
@@ -991,6 +1178,7 @@ void process_buffer(uint8_t buffer)
       case 0xB0 ... 0xBF:  /* Channel 0~16 Control/Mode Change */
       case 0xE0 ... 0xEF:  /* Channel 0~16 Pitch Bend Change */
         midi_bytes = 3;
+        midimachine.running_status = buffer;
         if (midimachine.bus != CLAIMED && midimachine.type == NONE) {
           if (midimachine.index == 0) MIDBG("[M][B%d]$%02x#%03d", midimachine.index, buffer, buffer);
           midimachine.type = MIDI;
@@ -1005,6 +1193,18 @@ void process_buffer(uint8_t buffer)
         break;
     }
   } else { /* Handle continuing byte stream */
+    if (midimachine.state == IDLE && midimachine.type == NONE
+        && midimachine.bus != CLAIMED && midimachine.running_status != 0) {
+      /* Running status ~ data byte without status byte, reuse the previous channel status */
+      midimachine.running = true;
+      midi_bytes = (((midimachine.running_status & 0xF0) == 0xC0) || ((midimachine.running_status & 0xF0) == 0xD0)) ? 2 : 3;
+      midimachine.type = MIDI;
+      midimachine.state = RECEIVING;
+      midimachine.bus = CLAIMED;
+      midimachine.index = 0;
+      midimachine.streambuffer[midimachine.index++] = midimachine.running_status;
+      MIDBG("[M][RS]$%02x#%03d", midimachine.running_status, midimachine.running_status);
+    }
     if (midimachine.state == RECEIVING) {
       if (midimachine.index < count_of(midimachine.streambuffer)) {
         /* Add midi data to the buffer ~ SysEx & Midi */
@@ -1016,6 +1216,10 @@ void process_buffer(uint8_t buffer)
               MIDBG("\n");
               dtype = midi; /* Set data type to midi */
               process_midi(midimachine.streambuffer, midimachine.index);
+              #ifdef MIDI_DEBUG
+              midi_stats(midimachine.streambuffer[0], midimachine.running);
+              #endif
+              midimachine.running = false;
               midimachine.index = 0;
               midimachine.state = IDLE;
               midimachine.bus = FREE;
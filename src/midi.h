@@ -70,12 +70,30 @@ typedef enum {
 
 extern int midi_bytes;
 
+/* Modulation parameters per channel ~ set via CC or USBSID SysEx */
+enum {
+  MOD_VIB_RATE = 0,  /* Vibrato LFO rate */
+  MOD_VIB_DEPTH,     /* Vibrato LFO depth */
+  MOD_PWM_RATE,      /* Pulse width LFO rate */
+  MOD_PWM_DEPTH,     /* Pulse width LFO depth */
+  MOD_FLT_RATE,      /* Filter cutoff LFO rate */
+  MOD_FLT_DEPTH,     /* Filter cutoff LFO depth */
+  MOD_PORTA,         /* Portamento time ~ 0 is off */
+  MOD_PENV_DEPTH,    /* Pitch envelope depth ~ 64 is centre (off) */
+  MOD_PENV_TIME,     /* Pitch envelope decay time */
+  MOD_WENV_DEPTH,    /* Pulse width envelope depth ~ 64 is centre (off) */
+  MOD_WENV_TIME,     /* Pulse width envelope decay time */
+  MOD_N_PARAMS
+};
+
 typedef struct {
   /* comms */
   bus_state bus;
   sysex_state state;
   midi_type type;
   uint8_t index;
+  uint8_t running_status;  /* Last channel status byte, reused when a message starts with a data byte */
+  bool running;  /* The message being received started from running status */
   uint8_t usbstreambuffer[64];   /* Normal speed max buffer for TinyUSB */
   uint8_t streambuffer[64];   /* Normal speed max buffer for TinyUSB */
   uint8_t channel_states[16][4][32];  /* Stores channel states of each SID ~ 4 sids max */
@@ -84,8 +102,13 @@ typedef struct {
   uint8_t channelbank[16];  /* [Channel][Bank(0)] relation */
   uint8_t channelprogram[16];  /* [Channel][Patch/Program(1)] relation */
   bool bank1channelgate[16];  /* Auto gate on/off per channel on noteon and noteoff */
+  uint8_t channelnote[16];  /* Last note played per channel, used for pitch bend in bank 1 */
+  int16_t channelbend[16];  /* Pitch bend per channel ~ signed 14 bit */
   uint8_t sidaddress;
   int fmopl;
+  uint32_t cc_dirty[4];  /* Bitmask of SID registers with a pending CC value ~ 4 sids max */
+  uint8_t cc_shadow[4][32];  /* Latest CC value per SID register, written on flush */
+  uint8_t mod_params[16][MOD_N_PARAMS];  /* Modulation engine parameters per channel */
 
 } midi_machine;
 
@@ -106,9 +129,41 @@ void midi_init(void);
  * Figures out if we're receiving midi or sysex */
 void process_buffer(uint8_t buffer);
 
+/* Writes pending CC register values to the bus
+ * Called from the main loop, runs at most once every MIDI_CC_FLUSH_US */
+void midi_cc_flush_task(void);
+
+/* Selects the note frequency table matching the SID clock rate */
+void midi_select_note_table(uint32_t clock_rate);
+
+/* Queues a register write for the next CC flush */
+void midi_queue_register(uint8_t sidno, uint8_t reg, uint8_t value);
+
+/* Initialize the modulation engine */
+void mod_init(void);
+
+/* Sets a modulation parameter of a channel ~ value 0-127 */
+void mod_set_param(int channel, int param, uint8_t value);
+
+/* Assigns a voice to a channel and retriggers its envelopes on note on */
+void mod_note_on(int channel, int sidno, int voiceno);
+
+/* Runs the modulation engine, at most once every MIDI_MOD_TICK_US */
+void midi_mod_task(void);
+
 /* Processes the received Midi stream */
 // void process_stream(uint8_t* buffer);  // 20240723 ~ disabled, unused
 
+/* CC register writes are coalesced and flushed at this interval ~ 1000us = 1kHz */
+#ifndef MIDI_CC_FLUSH_US
+#define MIDI_CC_FLUSH_US 1000
+#endif /* MIDI_CC_FLUSH_US */
+
+/* Modulation engine tick interval ~ 1000us = 1kHz */
+#ifndef MIDI_MOD_TICK_US
+#define MIDI_MOD_TICK_US 1000
+#endif /* MIDI_MOD_TICK_US */
+
 /* Custom values from CMakeLists import */
 // TODO: Create import file to use
 
@@ -179,6 +234,40 @@ void process_buffer(uint8_t buffer);
 #ifndef CC_LPF
 #define CC_LPF 0x77   /* 119 ~ Low pass */
 #endif /* CC_LPF */
+/* Modulation engine */
+#ifndef CC_PORT
+#define CC_PORT 0x05  /*   5 ~ Portamento time */
+#endif /* CC_PORT */
+#ifndef CC_PWMR
+#define CC_PWMR 0x1E  /*  30 ~ Pulse width LFO rate */
+#endif /* CC_PWMR */
+#ifndef CC_PWMD
+#define CC_PWMD 0x1F  /*  31 ~ Pulse width LFO depth */
+#endif /* CC_PWMD */
+#ifndef CC_VIBR
+#define CC_VIBR 0x4C  /*  76 ~ Vibrato rate */
+#endif /* CC_VIBR */
+#ifndef CC_VIBD
+#define CC_VIBD 0x4D  /*  77 ~ Vibrato depth */
+#endif /* CC_VIBD */
+#ifndef CC_FLTR
+#define CC_FLTR 0x66  /* 102 ~ Filter LFO rate */
+#endif /* CC_FLTR */
+#ifndef CC_FLTD
+#define CC_FLTD 0x67  /* 103 ~ Filter LFO depth */
+#endif /* CC_FLTD */
+#ifndef CC_PENV
+#define CC_PENV 0x68  /* 104 ~ Pitch envelope depth */
+#endif /* CC_PENV */
+#ifndef CC_PENT
+#define CC_PENT 0x69  /* 105 ~ Pitch envelope time */
+#endif /* CC_PENT */
+#ifndef CC_WENV
+#define CC_WENV 0x6A  /* 106 ~ Pulse width envelope depth */
+#endif /* CC_WENV */
+#ifndef CC_WENT
+#define CC_WENT 0x6B  /* 107 ~ Pulse width envelope time */
+#endif /* CC_WENT */
 
 #endif /* CC_VALUES */
 
@@ -0,0 +1,276 @@
+/*
+ * USBSID-Pico is a RPi Pico (RP2040) based board for interfacing one or two
+ * MOS SID chips and/or hardware SID emulators over (WEB)USB with your computer,
+ * phone or ASID supporting player
+ *
+ * midi_modulation.c
+ * This file is part of USBSID-Pico (https://github.com/LouDnl/USBSID-Pico)
+ * File author: LouD
+ *
+ * Copyright (c) 2024-2025 LouD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "midi.h"
+#include "globals.h"
+#include "sid.h"
+#include "logging.h"
+
+
+/* Config externals */
+extern int numsids;
+
+/* Midi externals */
+extern int st[12];
+
+#define MOD_INVALID 0xFFFFFFFF  /* Forces a register update on the next tick */
+
+typedef struct {
+  int8_t channel;       /* Owning channel, -1 when unassigned */
+  bool modulated;       /* Registers hold modulated values */
+  uint16_t vib_phase;   /* Vibrato LFO phase */
+  uint16_t pwm_phase;   /* Pulse width LFO phase */
+  uint16_t penv_level;  /* Pitch envelope level, decays to 0 */
+  uint16_t wenv_level;  /* Pulse width envelope level, decays to 0 */
+  uint32_t glide;       /* Current frequency in 24.8 fixed point for portamento */
+  uint32_t out_freq;    /* Last queued frequency */
+  uint32_t out_pw;      /* Last queued pulse width */
+} mod_voice;
+
+typedef struct {
+  int8_t channel;       /* Owning channel, -1 when unassigned */
+  bool modulated;       /* Registers hold modulated values */
+  uint16_t phase;       /* Filter LFO phase */
+  uint32_t out_fc;      /* Last queued cutoff */
+} mod_filter;
+
+static mod_voice mod_voices[4][3];
+static mod_filter mod_filters[4];
+
+/* Derived from the parameters when they are set, keeps the tick free of divisions */
+static uint16_t lfo_inc[16][3];   /* Phase increment per tick ~ vibrato, pulse width, filter */
+static uint16_t env_dec[16][2];   /* Level decrement per tick ~ pitch, pulse width */
+static uint32_t porta_coef[16];   /* Glide coefficient in 0.16 fixed point */
+
+
+/* Helpers */
+
+static inline int32_t lfo_triangle(uint16_t phase)
+{ /* -32768 ~ 32766 */
+  int32_t tri = (phase < 0x8000) ? phase : (0xFFFF - phase);
+  return ((tri << 1) - 0x8000);
+}
+
+static inline uint16_t env_step(uint16_t level, uint16_t dec)
+{
+  return (level > dec) ? (level - dec) : 0;
+}
+
+static inline bool mod_voice_active(const uint8_t *p)
+{
+  return (p[MOD_VIB_DEPTH] != 0 || p[MOD_PWM_DEPTH] != 0 || p[MOD_PORTA] != 0
+    || p[MOD_PENV_DEPTH] != 64 || p[MOD_WENV_DEPTH] != 64);
+}
+
+
+/* Parameters */
+
+void mod_set_param(int channel, int param, uint8_t value)
+{
+  if (channel < 0 || channel > 15 || param < 0 || param >= MOD_N_PARAMS) return;
+  value &= MIDI_CC_MAX;
+  midimachine.mod_params[channel][param] = value;
+
+  switch (param) {
+    case MOD_VIB_RATE:
+    case MOD_PWM_RATE:
+    case MOD_FLT_RATE:  /* ~0.015Hz at 0 and 1 up to ~20Hz at 127 with a 1kHz tick and a 16 bit phase */
+      lfo_inc[channel][(param >> 1)] = (((value * value) / 12) + 1);
+      break;
+    case MOD_PENV_TIME:
+    case MOD_WENV_TIME:  /* 1 tick at 0 up to ~4 seconds at 127 with a 1kHz tick */
+      env_dec[channel][(param == MOD_WENV_TIME)] = (0xFFFF / (((value * value) >> 2) + 1));
+      break;
+    case MOD_PORTA:  /* Cubic curve, 0 is an instant jump */
+      porta_coef[channel] = (value == 0) ? 0x10000 : (((128 - value) * (128 - value) * (128 - value)) >> 5);
+      if (porta_coef[channel] == 0) porta_coef[channel] = 1;
+      break;
+    default:
+      break;
+  }
+
+  if (param == MOD_FLT_RATE || param == MOD_FLT_DEPTH) {
+    /* The filter is per SID, follow the bank layout used by the CC setters */
+    if (midimachine.channelbank[channel] == 1) {
+      if (channel < 12 && st[channel] < 4) mod_filters[st[channel]].channel = channel;
+    } else {
+      for (int sidno = 0; sidno < 4; sidno++) mod_filters[sidno].channel = channel;
+    }
+  }
+  MIDBG("[MOD] CH%d P%d V%d\n", channel, param, value);
+}
+
+void mod_init(void)
+{
+  for (int channel = 0; channel < 16; channel++) {
+    for (int param = 0; param < MOD_N_PARAMS; param++) {
+      mod_set_param(channel, param, ((param == MOD_PENV_DEPTH || param == MOD_WENV_DEPTH) ? 64 : 0));
+    }
+  }
+  for (int sidno = 0; sidno < 4; sidno++) {
+    for (int voiceno = 0; voiceno < 3; voiceno++) {
+      memset(&mod_voices[sidno][voiceno], 0, sizeof(mod_voice));
+      mod_voices[sidno][voiceno].channel = -1;
+    }
+    memset(&mod_filters[sidno], 0, sizeof(mod_filter));
+    mod_filters[sidno].channel = -1;
+  }
+}
+
+void mod_note_on(int channel, int sidno, int voiceno)
+{
+  if (sidno < 0 || sidno > 3 || voiceno < 0 || voiceno > 2) return;
+  mod_voice *mv = &mod_voices[sidno][voiceno];
+  const uint8_t *p = midimachine.mod_params[channel];
+  if (mv->channel != channel) {  /* No glide from a note played on another channel */
+    uint8_t *state = midimachine.channel_states[channel][sidno];
+    mv->glide = (((state[NOTEHI + (voiceno * 7)] << 8) | state[NOTELO + (voiceno * 7)]) << 8);
+    mv->channel = channel;
+  }
+  mv->penv_level = (p[MOD_PENV_DEPTH] != 64) ? 0xFFFF : 0;
+  mv->wenv_level = (p[MOD_WENV_DEPTH] != 64) ? 0xFFFF : 0;
+  mv->out_freq = mv->out_pw = MOD_INVALID;  /* The note on wrote the chip directly */
+}
+
+
+/* Tick */
+
+static void mod_voice_tick(int sidno, int voiceno)
+{
+  mod_voice *mv = &mod_voices[sidno][voiceno];
+  if (mv->channel < 0) return;
+  int channel = mv->channel;
+  int offset = (voiceno * 7);
+  const uint8_t *p = midimachine.mod_params[channel];
+  uint8_t *state = midimachine.channel_states[channel][sidno];
+  int32_t target = ((state[NOTEHI + offset] << 8) | state[NOTELO + offset]);
+
+  if (!mod_voice_active(p)) {
+    if (mv->modulated) {  /* Restore the unmodulated values once */
+      midi_queue_register(sidno, (NOTELO + offset), state[NOTELO + offset]);
+      midi_queue_register(sidno, (NOTEHI + offset), state[NOTEHI + offset]);
+      midi_queue_register(sidno, (PWMLO + offset), state[PWMLO + offset]);
+      midi_queue_register(sidno, (PWMHI + offset), state[PWMHI + offset]);
+      mv->modulated = false;
+      mv->out_freq = mv->out_pw = MOD_INVALID;
+    }
+    mv->glide = (target << 8);
+    return;
+  }
+  mv->modulated = true;
+
+  /* Portamento */
+  if (p[MOD_PORTA] == 0) {
+    mv->glide = (target << 8);
+  } else {
+    int32_t diff = ((target << 8) - (int32_t)mv->glide);
+    int32_t step = (int32_t)(((int64_t)diff * porta_coef[channel]) >> 16);
+    if (step == 0 && diff != 0) step = (diff > 0) ? 1 : -1;
+    mv->glide += step;
+  }
+
+  /* Pitch ~ vibrato and envelope scale with the frequency so depth is constant in cents */
+  int32_t freq = (mv->glide >> 8);
+  int32_t pitch = freq;
+  if (p[MOD_VIB_DEPTH] != 0) {  /* Max ~6% or about one semitone */
+    pitch += (int32_t)(((int64_t)freq * p[MOD_VIB_DEPTH] * lfo_triangle(mv->vib_phase)) >> 26);
+  }
+  mv->vib_phase += lfo_inc[channel][0];
+  if (mv->penv_level != 0) {  /* Max +/-50% */
+    pitch += (int32_t)(((int64_t)freq * (p[MOD_PENV_DEPTH] - 64) * mv->penv_level) >> 23);
+    mv->penv_level = env_step(mv->penv_level, env_dec[channel][0]);
+  }
+  pitch = constrain(pitch, 0, 0xFFFF);
+
+  /* Pulse width */
+  int32_t pw = (((state[PWMHI + offset] & R_NIBBLE) << 8) | state[PWMLO + offset]);
+  if (p[MOD_PWM_DEPTH] != 0) {  /* Max +/-2032 */
+    pw += ((p[MOD_PWM_DEPTH] * lfo_triangle(mv->pwm_phase)) >> 11);
+  }
+  mv->pwm_phase += lfo_inc[channel][1];
+  if (mv->wenv_level != 0) {  /* Max +/-2048 */
+    pw += (((p[MOD_WENV_DEPTH] - 64) * mv->wenv_level) >> 11);
+    mv->wenv_level = env_step(mv->wenv_level, env_dec[channel][1]);
+  }
+  pw = constrain(pw, 0, TRIPLE_NIBBLE);
+
+  /* Only queue what changed */
+  if ((uint32_t)pitch != mv->out_freq) {
+    midi_queue_register(sidno, (NOTELO + offset), (pitch & BYTE));
+    midi_queue_register(sidno, (NOTEHI + offset), ((pitch >> 8) & BYTE));
+    mv->out_freq = pitch;
+  }
+  if ((uint32_t)pw != mv->out_pw) {
+    midi_queue_register(sidno, (PWMLO + offset), (pw & BYTE));
+    midi_queue_register(sidno, (PWMHI + offset), ((pw >> 8) & R_NIBBLE));
+    mv->out_pw = pw;
+  }
+}
+
+static void mod_filter_tick(int sidno)
+{
+  mod_filter *mf = &mod_filters[sidno];
+  if (mf->channel < 0) return;
+  int channel = mf->channel;
+  const uint8_t *p = midimachine.mod_params[channel];
+  uint8_t *state = midimachine.channel_states[channel][sidno];
+
+  if (p[MOD_FLT_DEPTH] == 0) {
+    if (mf->modulated) {  /* Restore the unmodulated cutoff once */
+      midi_queue_register(sidno, FC_LO, state[FC_LO]);
+      midi_queue_register(sidno, FC_HI, state[FC_HI]);
+      mf->modulated = false;
+      mf->out_fc = MOD_INVALID;
+    }
+    return;
+  }
+  mf->modulated = true;
+
+  int32_t fc = ((state[FC_HI] << SHIFT_3) | (state[FC_LO] & F_MASK_LO));
+  fc += ((p[MOD_FLT_DEPTH] * lfo_triangle(mf->phase)) >> 12);  /* Max +/-1016 */
+  mf->phase += lfo_inc[channel][2];
+  fc = constrain(fc, 0, (F_MASK_HI | F_MASK_LO));
+
+  if ((uint32_t)fc != mf->out_fc) {
+    midi_queue_register(sidno, FC_LO, (fc & F_MASK_LO));
+    midi_queue_register(sidno, FC_HI, ((fc & F_MASK_HI) >> SHIFT_3));
+    mf->out_fc = fc;
+  }
+}
+
+void __not_in_flash_func(midi_mod_task)(void)
+{
+  static uint32_t last_tick = 0;
+  uint32_t now = time_us_32();
+  if ((now - last_tick) < MIDI_MOD_TICK_US) return;
+  last_tick = now;
+  int sids = (numsids > 4 ? 4 : numsids);
+  for (int sidno = 0; sidno < sids; sidno++) {
+    for (int voiceno = 0; voiceno < 3; voiceno++) {
+      mod_voice_tick(sidno, voiceno);
+    }
+    mod_filter_tick(sidno);
+  }
+}
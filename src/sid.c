@@ -29,249 +29,527 @@
 #include "sid.h"
 #include "logging.h"
 
+#include "hardware/sync.h"
+
 
 /* GPIO externals */
 extern uint8_t __not_in_flash_func(bus_operation)(uint8_t command, uint8_t address, uint8_t data);
 extern void clear_sid_registers(int sidno);
 
+/* Config externals */
+extern void detect_sid_types_done(const uint8_t types[4]);
+
+/* USBSID externals */
+extern double sid_hz;
+
 /* Declare variables */
 uint8_t waveforms[4] = { 16, 32, 64, 128 };
 
-uint8_t detect_sid_version(uint8_t start_addr)  /* Not working on real SIDS!? */
+/* Test and detection job ~ runs from sid_test_task on core 0 so it never races the bus
+ * Sequences are resumable functions, every wait returns to the main loop
+ * Host writes to the SIDs of a running job are dropped, see sid_test_owns */
+#define SIDTEST_MAX_STEPS 17  /* SIDTEST_ALL is the longest plan */
+
+typedef struct {
+  volatile sidtest_state state;
+  uint8_t kind;
+  uint8_t wf;             /* Waveform index 0 ~ 3, 4 is all */
+  uint8_t sidno, first_sid, last_sid;
+  uint8_t plan[SIDTEST_MAX_STEPS];  /* Steps per SID as (group << 4) | waveform */
+  uint8_t step, n_steps;
+  uint16_t line[2];       /* Resume points of the runner and the running group */
+  int loop[5];            /* Loop counters that live across a wait */
+  uint32_t due_us, start_us, ops;
+  uint32_t mark_us, last_us, span_us;  /* Readback timing */
+  uint8_t results[4];
+} sid_test_job;
+
+static sid_test_job job;
+
+/* Characterization results per SID, kept until the next characterization */
+typedef struct {
+  uint8_t model;       /* Detection result, 2 is 8580 and 3 is 6581 */
+  uint8_t readback;    /* SIDCHAR_* bits */
+  int32_t osc_ppm;     /* Oscillator rate error against the SID clock */
+  uint32_t osc_res_ppm; /* Resolution of osc_ppm */
+  uint32_t attack_us;  /* ENV3 from gate on to $FF */
+  uint32_t release_us; /* ENV3 from gate off to $00 */
+  uint32_t clock_hz;   /* SID clock the expectations are based on */
+} sid_metrics;
+
+static sid_metrics metrics[4];
+
+enum {  /* Plan groups */
+  GROUP_CLEAR = 0,
+  GROUP_WAVEFORMS,
+  GROUP_FILTER,
+  GROUP_ENVELOPE,
+  GROUP_MODULATION,
+  GROUP_DETECT,
+  GROUP_READBACK,
+  GROUP_OSCILLATOR,
+  GROUP_ENV_TIMING,
+};
+
+/* Minimal resumable sequence helpers, a wait cannot be placed inside a switch statement */
+#define SEQ_BEGIN(line) switch (line) { case 0:
+#define SEQ_YIELD(line) do { line = __LINE__; return false; case __LINE__:; } while (0)
+#define SEQ_WAIT_US(line, us) do { job.due_us = (time_us_32() + (us)); SEQ_YIELD(line); } while (0)
+#define SEQ_WAIT_MS(line, ms) SEQ_WAIT_US(line, ((ms) * 1000))
+#define SEQ_END(line) } line = 0; return true;
+
+
+/* Helpers */
+
+static inline void test_operation(uint8_t reg, uint8_t val)
 {
-  static int restart = 0;
-restart:
-  bus_operation(0x10, (start_addr + 0x12), 0xFF);  /* Set testbit in voice 3 control register to disable oscillator */
-  sleep_ms(1);
-  bus_operation(0x10, (start_addr + 0x0E), 0xFF);  /* Set frequency in voice 3 to $ffff */
-  sleep_ms(1);
-  bus_operation(0x10, (start_addr + 0x0F), 0xFF);  /* Set frequency in voice 3 to $ffff */
-  sleep_ms(1);
-  bus_operation(0x10, (start_addr + 0x12), 0x20);  /* Set Sawtooth wave and gatebit OFF to start oscillator again */
-  sleep_ms(1);
-  uint8_t sidtype = bus_operation(0x11, (start_addr + 0x1B), 0x00);  /* Accu now has different value depending on sid model (6581=3/8580=2) */
-  if (restart == 3) goto end;
-  if (sidtype != 2 || sidtype != 3) {
-    restart++;
-    goto restart;
-  }
-end:
-  restart = 0;
-  return (sidtype < 4 ? sidtype : 0);  /* that is: Carry flag is set for 6581, and clear for 8580. */
+  bus_operation(0x10, reg, val);
+  job.ops++;
 }
 
-void test_operation(uint8_t reg, uint8_t val)
+static inline uint8_t test_read(uint8_t reg)
 {
-  bus_operation(0x10, reg, val);
-  sleep_us(5);
+  job.ops++;
+  return bus_operation(0x11, reg, 0x00);
 }
 
-void wave_form_test(uint8_t voices[3], int v, int on, int off)
+static inline uint8_t sid_addr(void)
 {
-    test_operation((voices[v] + sid_registers[CONTR]), on);    /* CONTR */
-    for (int f = 1; f <= 255; f++) {
-      test_operation((voices[v] + sid_registers[NOTEHI]), f);  /* NOTEHI */
-      sleep_ms(8);
+  return (job.sidno * 0x20);
+}
+
+static inline uint8_t voice_addr(int v)
+{
+  return (sid_addr() + sid_registers[(v * 7)]);
+}
+
+
+/* Sequences */
+
+static bool seq_detect(void)
+{ /* Voice 3 oscillator readback differs per model ~ 6581 reads 3, 8580 reads 2
+   * At frequency $FFFF OSC3 moves about 1 step per cycle, so the oscillator start
+   * and the read must be back to back on the bus with nothing in between */
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  for (job.loop[0] = 0; job.loop[0] < 3; job.loop[0]++) {  /* Attempts */
+    test_operation((sid_addr() + 0x12), 0xFF);  /* Set testbit in voice 3 control register to disable oscillator */
+    test_operation((sid_addr() + 0x0E), 0xFF);  /* Set frequency in voice 3 to $ffff */
+    test_operation((sid_addr() + 0x0F), 0xFF);  /* Set frequency in voice 3 to $ffff */
+    SEQ_WAIT_MS(*line, 1);  /* Let the testbit reset the oscillator */
+    {
+      uint32_t irq = save_and_disable_interrupts();
+      test_operation((sid_addr() + 0x12), 0x20);  /* Set Sawtooth wave and gatebit OFF to start oscillator again */
+      job.results[job.sidno] = test_read(sid_addr() + 0x1B);
+      restore_interrupts(irq);
     }
-    test_operation((voices[v] + sid_registers[CONTR]), off);   /* CONTR */
+    if (job.results[job.sidno] == 2 || job.results[job.sidno] == 3) break;
+  }
+  if (job.results[job.sidno] >= 4) job.results[job.sidno] = 0;
+  metrics[job.sidno].model = job.results[job.sidno];
+  SEQ_END(*line);
 }
 
-void pulse_sweep_test(uint8_t voices[3], int v, int on, int off)
+/* Voice 3 triangle, pulse and noise read back through OSC3 */
+static bool seq_readback(void)
 {
-  test_operation((voices[v] + sid_registers[CONTR]), on);     /* CONTR */
-  for (int x = 0; x <= 5; x++) {
-    for (int y = 0; y <= 15; y++) {
-      test_operation((voices[v] + sid_registers[PWMHI]), y);  /* PWMHI */
-      sleep_ms(16);
+  static const uint8_t wave[3] = { 0x10, 0x40, 0x80 };
+  static const uint8_t bits[3] = { SIDCHAR_TRIANGLE, SIDCHAR_PULSE, SIDCHAR_NOISE };
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + 0x0E), (SIDCHAR_OSC_FREQ & BYTE));
+  test_operation((sid_addr() + 0x0F), (SIDCHAR_OSC_FREQ >> 8));
+  test_operation((sid_addr() + 0x10), 0x00);  /* Pulse width 50% */
+  test_operation((sid_addr() + 0x11), 0x08);
+  for (job.loop[0] = 0; job.loop[0] < 3; job.loop[0]++) {
+    test_operation((sid_addr() + 0x12), (wave[job.loop[0]] | BIT_3));  /* Testbit resets the oscillator */
+    test_operation((sid_addr() + 0x12), wave[job.loop[0]]);
+    job.loop[2] = 0xFF, job.loop[3] = 0x00, job.loop[4] = 0;  /* Min, max, values other than $00 or $FF */
+    for (job.loop[1] = 0; job.loop[1] < 64; job.loop[1]++) {
+      SEQ_WAIT_US(*line, 100);
+      uint8_t osc = test_read(sid_addr() + sid_registers[V3_OSC]);
+      if (osc < job.loop[2]) job.loop[2] = osc;
+      if (osc > job.loop[3]) job.loop[3] = osc;
+      if (osc != 0x00 && osc != 0xFF) job.loop[4]++;
     }
-    for (int y = 15; y >= 0; y--) {
-      test_operation((voices[v] + sid_registers[PWMHI]), y);  /* PWMHI */
-      sleep_ms(16);
+    bool ok = (wave[job.loop[0]] == 0x40)
+      ? (job.loop[2] == 0x00 && job.loop[3] == 0xFF && job.loop[4] == 0)
+      : ((job.loop[3] - job.loop[2]) >= 0xC0);
+    if (ok) metrics[job.sidno].readback |= bits[job.loop[0]];
+  }
+  test_operation((sid_addr() + 0x12), 0x00);
+  SEQ_END(*line);
+}
+
+/* Voice 3 sawtooth rate through OSC3 against the SID clock
+ * Reads are timestamped, intervals too long to rule out a wrap of OSC3 are left out */
+static bool seq_oscillator(void)
+{
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + 0x0E), (SIDCHAR_OSC_FREQ & BYTE));
+  test_operation((sid_addr() + 0x0F), (SIDCHAR_OSC_FREQ >> 8));
+  test_operation((sid_addr() + 0x12), (0x20 | BIT_3));
+  test_operation((sid_addr() + 0x12), 0x20);
+  job.loop[1] = test_read(sid_addr() + sid_registers[V3_OSC]);
+  job.last_us = time_us_32();
+  job.span_us = 0, job.loop[2] = 0, job.loop[3] = 1;  /* Runs of unbroken samples */
+  /* Longest interval that stays below SIDCHAR_OSC_MAX_STEPS at the configured clock */
+  job.loop[4] = (metrics[job.sidno].clock_hz == 0) ? 0
+    : (int)(((uint64_t)SIDCHAR_OSC_MAX_STEPS * (0x10000 / SIDCHAR_OSC_FREQ) * 1000000) / metrics[job.sidno].clock_hz);
+  for (job.loop[0] = 0; job.loop[0] < SIDCHAR_OSC_SAMPLES; job.loop[0]++) {
+    SEQ_WAIT_MS(*line, 1);
+    uint8_t osc = test_read(sid_addr() + sid_registers[V3_OSC]);
+    uint32_t now = time_us_32();
+    if ((now - job.last_us) < (uint32_t)job.loop[4]) {
+      job.loop[2] += ((osc - job.loop[1]) & BYTE);
+      job.span_us += (now - job.last_us);
+    } else {
+      job.loop[3]++;
     }
+    job.loop[1] = osc, job.last_us = now;
+  }
+  test_operation((sid_addr() + 0x12), 0x00);
+  { /* Steps * 2^16 * 10^6 against frequency * clock * us */
+    sid_metrics *m = &metrics[job.sidno];
+    int64_t measured = ((int64_t)job.loop[2] * 65536 * 1000000);
+    int64_t expected = ((int64_t)SIDCHAR_OSC_FREQ * m->clock_hz * job.span_us);
+    if (job.loop[2] > 0) m->readback |= SIDCHAR_SAWTOOTH;
+    m->osc_ppm = ((expected / 1000000) != 0) ? (int32_t)((measured - expected) / (expected / 1000000)) : 0;
+    m->osc_res_ppm = (job.loop[2] > 0) ? (uint32_t)(((int64_t)job.loop[3] * 1000000) / job.loop[2]) : 0;  /* +/- 1 step per run */
+  }
+  SEQ_END(*line);
+}
+
+/* Voice 3 attack and release time through ENV3 */
+static bool seq_env_timing(void)
+{
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + 0x12), 0x20);  /* Gate off */
+  test_operation((sid_addr() + 0x13), (SIDCHAR_ATTACK_RATE << 4));  /* No decay */
+  test_operation((sid_addr() + 0x14), 0xF0);  /* Full sustain, fastest release */
+  SEQ_WAIT_MS(*line, 20);
+  test_operation((sid_addr() + 0x14), (0xF0 | SIDCHAR_RELEASE_RATE));
+  test_operation((sid_addr() + 0x12), 0x21);  /* Gate on */
+  job.mark_us = time_us_32();
+  do {
+    SEQ_WAIT_US(*line, 250);
+    job.loop[0] = test_read(sid_addr() + sid_registers[V3_ENV]);
+    job.last_us = time_us_32();
+  } while (job.loop[0] != 0xFF && (job.last_us - job.mark_us) < SIDCHAR_TIMEOUT_US);
+  if (job.loop[0] == 0xFF) {
+    metrics[job.sidno].attack_us = (job.last_us - job.mark_us);
+    metrics[job.sidno].readback |= SIDCHAR_ENVELOPE;
+  }
+  test_operation((sid_addr() + 0x12), 0x20);  /* Gate off */
+  job.mark_us = time_us_32();
+  do {
+    SEQ_WAIT_US(*line, 250);
+    job.loop[0] = test_read(sid_addr() + sid_registers[V3_ENV]);
+    job.last_us = time_us_32();
+  } while (job.loop[0] != 0x00 && (job.last_us - job.mark_us) < SIDCHAR_TIMEOUT_US);
+  if (job.loop[0] == 0x00 && (metrics[job.sidno].readback & SIDCHAR_ENVELOPE)) {
+    metrics[job.sidno].release_us = (job.last_us - job.mark_us);
+    metrics[job.sidno].readback |= SIDCHAR_RELEASE;
   }
-  test_operation((voices[v] + sid_registers[CONTR]), off);    /* CONTR */
+  SEQ_END(*line);
 }
 
-void test_all_waveforms(uint8_t addr, uint8_t voices[3])
+static bool seq_waveforms(void)
 {
-  test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-  for (int v = 0; v < 3; v++) {
-    DBG("TEST VOICE %d\n", (v + 1));
-    DBG("WAVEFORM TESTS\n");
-    test_operation((voices[v] + sid_registers[ATTDEC]), 33);   /* ATTDEC 2*16+1 */
-    test_operation((voices[v] + sid_registers[SUSREL]), 242);  /* SUSREL 15*16+2 */
-    test_operation((voices[v] + sid_registers[PWMHI]), 8);     /* PWMHI */
-
-    DBG("TRIANGLE TESTING ");
-    wave_form_test(voices, v, 17, 16);
-    DBG("COMPLETE\n");
-    DBG("SAWTOOTH TESTING ");
-    wave_form_test(voices, v, 33, 32);
-    DBG("COMPLETE\n");
-    DBG("PULSE TESTING ");
-    wave_form_test(voices, v, 65, 64);
-    DBG("COMPLETE\n");
-    DBG("NOISE TESTING ");
-    wave_form_test(voices, v, 129, 128);
-    DBG("COMPLETE\n");
-
-    DBG("PULSE WIDTH SWEEP TESTING ");
-    test_operation((voices[v] + sid_registers[NOTEHI]), 40);  /* NOTEHI */
-    pulse_sweep_test(voices, v, 65, 64);
-    DBG("COMPLETE\n");
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + sid_registers[MODVOL]), 0x0F);  /* Volume to full */
+  for (job.loop[0] = 0; job.loop[0] < 3; job.loop[0]++) {  /* Voice */
+    DBG("TEST VOICE %d WAVEFORMS\n", (job.loop[0] + 1));
+    test_operation((voice_addr(job.loop[0]) + sid_registers[ATTDEC]), 33);   /* ATTDEC 2*16+1 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[SUSREL]), 242);  /* SUSREL 15*16+2 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[PWMHI]), 8);     /* PWMHI */
+    for (job.loop[1] = 0; job.loop[1] < 4; job.loop[1]++) {  /* Triangle, sawtooth, pulse, noise */
+      test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), (waveforms[job.loop[1]] + 1));
+      for (job.loop[2] = 1; job.loop[2] <= 255; job.loop[2]++) {
+        test_operation((voice_addr(job.loop[0]) + sid_registers[NOTEHI]), job.loop[2]);
+        SEQ_WAIT_MS(*line, 8);
+      }
+      test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), waveforms[job.loop[1]]);
+    }
+    /* Pulse width sweep, 6 times up and down */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[NOTEHI]), 40);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), 65);
+    for (job.loop[2] = 0; job.loop[2] < (6 * 32); job.loop[2]++) {
+      int y = (job.loop[2] & 0x1F);
+      test_operation((voice_addr(job.loop[0]) + sid_registers[PWMHI]), (y < 16 ? y : (31 - y)));
+      SEQ_WAIT_MS(*line, 16);
+    }
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), 64);
   }
+  SEQ_END(*line);
 }
 
-void filter_tests(uint8_t addr, uint8_t voices[3], int wf)
+static bool seq_filter(int wf)
 {
-  test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-  DBG("FILTER TESTS %s\n", (wf == 0 ? "TRIANGLE" : wf == 2 ? "SAWTOOTH" : wf == 3 ? "PULSE" : "NOISE"));
-  for (int fq = 15; fq <= 45; fq += 15) {
-    DBG("HIGH FILTER FREQUENCY = %d\n", fq);
-    test_operation(sid_registers[RESFLT], 87);  /* RESFLT 5*16+1+2+4 */
-    for (int flt = 1; flt <= 3; flt++) {
-      DBG("%s PASS\n", (flt == 1 ? "LOW" : flt == 2 ? "BAND" : "HIGH"));
-      test_operation(sid_registers[MODVOL], (flt == 1 ? 31 : flt == 2 ? 47 : 79));  /* MODVOL */
-      for (int v = 0; v < 3; v++) {
-        DBG("VOICE %d TESTING ", (v + 1));
-        test_operation((voices[v] + sid_registers[NOTEHI]), fq);   /* NOTEHI */
-        test_operation((voices[v] + sid_registers[ATTDEC]), 0);    /* ATTDEC */
-        test_operation((voices[v] + sid_registers[SUSREL]), 240);  /* SUSREL */
-        test_operation((voices[v] + sid_registers[PWMHI]), 8);     /* PWMHI */
-        test_operation((voices[v] + sid_registers[CONTR]), waveforms[wf] + 1);  /* CONTR */
-        for (int f = 0; f <= 255; f++) {
-          test_operation((voices[v] + sid_registers[FC_HI]), f);  /* FC_HI */
-          sleep_ms(8);
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + sid_registers[MODVOL]), 0x0F);  /* Volume to full */
+  for (job.loop[0] = 15; job.loop[0] <= 45; job.loop[0] += 15) {  /* Note frequency */
+    test_operation((sid_addr() + sid_registers[RESFLT]), 87);  /* RESFLT 5*16+1+2+4 */
+    for (job.loop[1] = 1; job.loop[1] <= 3; job.loop[1]++) {  /* Low, band and high pass */
+      test_operation((sid_addr() + sid_registers[MODVOL]), (job.loop[1] == 1 ? 31 : job.loop[1] == 2 ? 47 : 79));
+      for (job.loop[2] = 0; job.loop[2] < 3; job.loop[2]++) {  /* Voice */
+        test_operation((voice_addr(job.loop[2]) + sid_registers[NOTEHI]), job.loop[0]);
+        test_operation((voice_addr(job.loop[2]) + sid_registers[ATTDEC]), 0);
+        test_operation((voice_addr(job.loop[2]) + sid_registers[SUSREL]), 240);
+        test_operation((voice_addr(job.loop[2]) + sid_registers[PWMHI]), 8);
+        test_operation((voice_addr(job.loop[2]) + sid_registers[CONTR]), (waveforms[wf] + 1));
+        for (job.loop[3] = 0; job.loop[3] <= 255; job.loop[3]++) {
+          test_operation((sid_addr() + sid_registers[FC_HI]), job.loop[3]);
+          SEQ_WAIT_MS(*line, 8);
         }
-        test_operation((voices[v] + sid_registers[CONTR]), waveforms[wf]);  /* CONTR */
-        DBG("COMPLETE\n");
+        test_operation((voice_addr(job.loop[2]) + sid_registers[CONTR]), waveforms[wf]);
       }
     }
   }
+  SEQ_END(*line);
 }
 
-void envelope_tests(uint8_t addr, uint8_t voices[3], int wf)
+static bool seq_envelope(int wf)
 {
-  test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-  DBG("A D S R TESTS %s\n", (wf == 0 ? "TRIANGLE" : wf == 1 ? "SAWTOOTH" : wf == 2 ? "PULSE" : "NOISE"));
-  for (int v = 0; v < 3; v++) {
-    DBG("VOICE %d A D S R TESTING ", (v + 1));
-    test_operation((voices[v] + sid_registers[ATTDEC]), 170);  /* ATTDEC 10*16+10 */
-    test_operation((voices[v] + sid_registers[SUSREL]), 58);   /* SUSREL 3*16+10 */
-    test_operation((voices[v] + sid_registers[NOTEHI]), 40);   /* NOTEHI */
-    test_operation((voices[v] + sid_registers[PWMHI]), 8);     /* PWMHI */
-    test_operation((voices[v] + sid_registers[CONTR]), (waveforms[wf] + 1));  /* CONTR */
-    sleep_ms(3000);
-    test_operation((voices[v] + sid_registers[CONTR]), waveforms[wf]);  /* CONTR */
-    DBG("RELEASE ");
-    sleep_ms(1000);
-    DBG("COMPLETE\n");
-    sleep_ms(600);
-
-    DBG("VOICE %d S R TESTING ", (v + 1));
-    test_operation((voices[v] + sid_registers[ATTDEC]), 0);    /* ATTDEC */
-    test_operation((voices[v] + sid_registers[SUSREL]), 250);  /* SUSREL 15*16+10 */
-    test_operation((voices[v] + sid_registers[CONTR]), (waveforms[wf] + 1));  /* CONTR */
-    sleep_ms(600);
-    test_operation((voices[v] + sid_registers[CONTR]), waveforms[wf]);  /* CONTR */
-    DBG("RELEASE ");
-    sleep_ms(600);
-    DBG("COMPLETE\n");
-    sleep_ms(600);
-
-    DBG("VOICE %d A D TESTING ", (v + 1));
-    test_operation((voices[v] + sid_registers[ATTDEC]), 170);  /* ATTDEC 10*16+10 */
-    test_operation((voices[v] + sid_registers[SUSREL]), 0);    /* SUSREL */
-    test_operation((voices[v] + sid_registers[CONTR]), (waveforms[wf] + 1));  /* CONTR */
-    sleep_ms(2000);
-    test_operation((voices[v] + sid_registers[CONTR]), waveforms[wf]);  /* CONTR */
-    DBG("RELEASE ");
-    sleep_ms(600);
-    DBG("COMPLETE\n");
-    sleep_ms(600);
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + sid_registers[MODVOL]), 0x0F);  /* Volume to full */
+  for (job.loop[0] = 0; job.loop[0] < 3; job.loop[0]++) {  /* Voice */
+    /* A D S R */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[ATTDEC]), 170);  /* ATTDEC 10*16+10 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[SUSREL]), 58);   /* SUSREL 3*16+10 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[NOTEHI]), 40);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[PWMHI]), 8);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), (waveforms[wf] + 1));
+    SEQ_WAIT_MS(*line, 3000);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), waveforms[wf]);
+    SEQ_WAIT_MS(*line, 1600);
+    /* S R */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[ATTDEC]), 0);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[SUSREL]), 250);  /* SUSREL 15*16+10 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), (waveforms[wf] + 1));
+    SEQ_WAIT_MS(*line, 600);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), waveforms[wf]);
+    SEQ_WAIT_MS(*line, 1200);
+    /* A D */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[ATTDEC]), 170);  /* ATTDEC 10*16+10 */
+    test_operation((voice_addr(job.loop[0]) + sid_registers[SUSREL]), 0);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), (waveforms[wf] + 1));
+    SEQ_WAIT_MS(*line, 2000);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), waveforms[wf]);
+    SEQ_WAIT_MS(*line, 1200);
   }
+  SEQ_END(*line);
 }
 
-void modulation_tests(uint8_t addr, uint8_t voices[3], int wf)
+static bool seq_modulation(int wf)
 {
-  test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-  DBG("RING MODULATION TESTS %s\n", (wf == 0 ? "TRIANGLE" : wf == 1 ? "SAWTOOTH" : wf == 2 ? "PULSE" : "NOISE"));
-  for (int v = 0; v < 3; v++) {
-    int v2 = (v == 1 ? 0 : v == 2 ? 1 : 2);
-    DBG("VOICE %d WITH VOICE %d ", (v + 1), (v2 + 1));
-    test_operation((voices[v] + sid_registers[PWMHI]), 8);     /* PWMHI */
-    test_operation((voices[v] + sid_registers[ATTDEC]), 0);    /* ATTDEC */
-    test_operation((voices[v] + sid_registers[SUSREL]), 250);  /* SUSREL 15*16+10 */
-    test_operation((voices[v2] + sid_registers[NOTEHI]), 10);   /* NOTEHI */
-    test_operation((voices[v] + sid_registers[CONTR]), (waveforms[wf] + 3));  /* CONTR */
-    for (int f = 0; f <= 255; f++) {
-      test_operation((voices[v] + sid_registers[NOTEHI]), f);   /* NOTEHI */
-      sleep_ms(24);
+  uint16_t *line = &job.line[1];
+  SEQ_BEGIN(*line);
+  test_operation((sid_addr() + sid_registers[MODVOL]), 0x0F);  /* Volume to full */
+  for (job.loop[0] = 0; job.loop[0] < 3; job.loop[0]++) {  /* Voice, modulated by the voice before it */
+    job.loop[1] = (job.loop[0] == 0 ? 2 : (job.loop[0] - 1));
+    test_operation((voice_addr(job.loop[0]) + sid_registers[PWMHI]), 8);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[ATTDEC]), 0);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[SUSREL]), 250);  /* SUSREL 15*16+10 */
+    test_operation((voice_addr(job.loop[1]) + sid_registers[NOTEHI]), 10);
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), (waveforms[wf] + 3));  /* Gate and sync */
+    for (job.loop[2] = 0; job.loop[2] <= 255; job.loop[2]++) {
+      test_operation((voice_addr(job.loop[0]) + sid_registers[NOTEHI]), job.loop[2]);
+      SEQ_WAIT_MS(*line, 24);
     }
-    test_operation((voices[v] + sid_registers[CONTR]), 0);   /* CONTR */
-    DBG("COMPLETE\n");
+    test_operation((voice_addr(job.loop[0]) + sid_registers[CONTR]), 0);
   }
+  SEQ_END(*line);
 }
 
-void sid_test(int sidno, char test, char wf)
+static bool seq_group(uint8_t entry)
 {
-  clear_sid_registers(sidno);
-  uint8_t addr = (sidno * 0x20);
-  uint8_t voices[3] = { (sid_registers[0] + addr), (sid_registers[7] + addr), (sid_registers[14] + addr) };
-  test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-
-  switch (test) {
-    case '1':  /* RUN ALL TESTS */
-      test_all_waveforms(addr, voices);
-      clear_sid_registers(sidno);
-      filter_tests(addr, voices, 0);
-      filter_tests(addr, voices, 1);
-      filter_tests(addr, voices, 2);
-      filter_tests(addr, voices, 3);
-      clear_sid_registers(sidno);
-      envelope_tests(addr, voices, 0);
-      envelope_tests(addr, voices, 1);
-      envelope_tests(addr, voices, 2);
-      envelope_tests(addr, voices, 3);
-      clear_sid_registers(sidno);
-      modulation_tests(addr, voices, 0);
-      modulation_tests(addr, voices, 1);
-      modulation_tests(addr, voices, 2);
-      modulation_tests(addr, voices, 3);
-      clear_sid_registers(sidno);
+  int wf = (entry & 0x3);
+  switch (entry >> 4) {
+    case GROUP_DETECT:
+      return seq_detect();
+    case GROUP_READBACK:
+      return seq_readback();
+    case GROUP_OSCILLATOR:
+      return seq_oscillator();
+    case GROUP_ENV_TIMING:
+      return seq_env_timing();
+    case GROUP_WAVEFORMS:
+      return seq_waveforms();
+    case GROUP_FILTER:
+      return seq_filter(wf);
+    case GROUP_ENVELOPE:
+      return seq_envelope(wf);
+    case GROUP_MODULATION:
+      return seq_modulation(wf);
+    case GROUP_CLEAR:
+    default:
+      clear_sid_registers(job.sidno);
+      return true;
+  }
+}
+
+/* Runs the plan on every SID in range */
+static bool seq_run(void)
+{
+  uint16_t *line = &job.line[0];
+  SEQ_BEGIN(*line);
+  for (job.sidno = job.first_sid; job.sidno < job.last_sid; job.sidno++) {
+    DBG("[SIDTEST] SID %d KIND %d\n", (job.sidno + 1), job.kind);
+    if (job.kind != SIDTEST_DETECT) {
+      clear_sid_registers(job.sidno);
+      test_operation((sid_addr() + sid_registers[MODVOL]), 0x0F);  /* Volume to full */
+    }
+    for (job.step = 0; job.step < job.n_steps; job.step++) {
+      while (!seq_group(job.plan[job.step])) SEQ_YIELD(*line);
+    }
+  }
+  SEQ_END(*line);
+}
+
+static void plan_add(uint8_t group, int wf)
+{
+  if (job.n_steps < count_of(job.plan)) job.plan[job.n_steps++] = ((group << 4) | (wf & 0x3));
+}
+
+static void plan_add_waveforms(uint8_t group, int wf)
+{ /* wf 4 adds the group once for every waveform */
+  for (int w = (wf == 4 ? 0 : wf); w <= (wf == 4 ? 3 : wf); w++) plan_add(group, w);
+}
+
+
+/* Jobs */
+
+/* Aborts a running job and silences the SIDs it touched */
+void sid_test_stop(void)
+{
+  if (job.state != SIDTEST_RUNNING) return;
+  job.state = SIDTEST_ABORTED;
+  for (int sidno = job.first_sid; sidno < job.last_sid; sidno++) {
+    clear_sid_registers(sidno);
+  }
+  DBG("[SIDTEST] ABORTED\n");
+}
+
+/* Starts a job on SIDs first_sid up to but not including last_sid, a running job is aborted first
+ * wf is the waveform index 0 ~ 3 or 4 for all */
+void sid_test_start(uint8_t kind, int first_sid, int last_sid, int wf)
+{
+  if (job.state == SIDTEST_RUNNING) sid_test_stop();
+  memset(&job, 0, sizeof(job));
+  job.kind = kind;
+  job.wf = wf;
+  job.first_sid = constrain(first_sid, 0, 4);
+  job.last_sid = constrain(last_sid, job.first_sid, 4);
+  switch (kind) {
+    case SIDTEST_DETECT:
+      plan_add(GROUP_DETECT, 0);
       break;
-    case '2':  /* ALL WAVEFORMS */
-      test_all_waveforms(addr, voices);
+    case SIDTEST_ALL:
+      plan_add(GROUP_WAVEFORMS, 0);
+      plan_add(GROUP_CLEAR, 0);
+      plan_add_waveforms(GROUP_FILTER, 4);
+      plan_add(GROUP_CLEAR, 0);
+      plan_add_waveforms(GROUP_ENVELOPE, 4);
+      plan_add(GROUP_CLEAR, 0);
+      plan_add_waveforms(GROUP_MODULATION, 4);
+      plan_add(GROUP_CLEAR, 0);
       break;
-    case '3':  /* FILTER */
-      if (wf == 'A') {
-        for (int w = 0; w < 4; w++) {
-          filter_tests(addr, voices, w);
-        }
-      } else {
-        filter_tests(addr, voices, (wf == 'T' ? 0 : wf == 'S' ? 1 : wf == 'P' ? 2 : 3));
-      }
+    case SIDTEST_WAVEFORMS:
+      plan_add(GROUP_WAVEFORMS, 0);
       break;
-    case '4':  /* ENVELOPE */
-      if (wf == 'A') {
-        for (int w = 0; w < 4; w++) {
-          envelope_tests(addr, voices, w);
-        }
-      } else {
-        envelope_tests(addr, voices, (wf == 'T' ? 0 : wf == 'S' ? 1 : wf == 'P' ? 2 : 3));
-      }
+    case SIDTEST_FILTER:
+      plan_add_waveforms(GROUP_FILTER, wf);
       break;
-    case '5':  /* MODULATION */
-      test_operation((sid_registers[MODVOL] + addr), 0x0F);  /* Volume to full */
-      if (wf == 'A') {
-        for (int w = 0; w < 4; w++) {
-          modulation_tests(addr, voices, w);
-        }
-      } else {
-        modulation_tests(addr, voices, (wf == 'T' ? 0 : wf == 'S' ? 1 : wf == 'P' ? 2 : 3));
+    case SIDTEST_ENVELOPE:
+      plan_add_waveforms(GROUP_ENVELOPE, wf);
+      break;
+    case SIDTEST_MODULATION:
+      plan_add_waveforms(GROUP_MODULATION, wf);
+      break;
+    case SIDTEST_CHARACTERIZE:
+      plan_add(GROUP_DETECT, 0);
+      plan_add(GROUP_CLEAR, 0);
+      plan_add(GROUP_READBACK, 0);
+      plan_add(GROUP_OSCILLATOR, 0);
+      plan_add(GROUP_ENV_TIMING, 0);
+      plan_add(GROUP_CLEAR, 0);
+      for (int sidno = job.first_sid; sidno < job.last_sid; sidno++) {
+        memset(&metrics[sidno], 0, sizeof(sid_metrics));
+        metrics[sidno].clock_hz = (uint32_t)sid_hz;
       }
       break;
     default:
-      break;
+      return;
+  }
+  job.start_us = job.due_us = time_us_32();
+  job.state = SIDTEST_RUNNING;
+  DBG("[SIDTEST] START KIND %d SIDS %d-%d STEPS %d\n", kind, job.first_sid, job.last_sid, job.n_steps);
+}
+
+/* Advances the running job, called from the main loop */
+void sid_test_task(void)
+{
+  if (job.state != SIDTEST_RUNNING) return;
+  if ((int32_t)(time_us_32() - job.due_us) < 0) return;  /* Waiting */
+  if (!seq_run()) return;
+  if (job.kind != SIDTEST_DETECT) {  /* Leave the SIDs silent like the blocking tests did */
+    for (int sidno = job.first_sid; sidno < job.last_sid; sidno++) {
+      clear_sid_registers(sidno);
+    }
+  }
+  job.state = SIDTEST_DONE;
+  DBG("[SIDTEST] DONE IN %lu MS, %lu OPERATIONS\n", ((time_us_32() - job.start_us) / 1000), job.ops);
+  if (job.kind == SIDTEST_DETECT) detect_sid_types_done(job.results);
+}
+
+/* True when a running job owns the SID at address, host writes to it are dropped until the job ends */
+bool __not_in_flash_func(sid_test_owns)(uint8_t address)
+{
+  if (job.state != SIDTEST_RUNNING) return false;
+  uint8_t sidno = ((address >> 5) & 0x3);
+  return (sidno >= job.first_sid && sidno < job.last_sid);
+}
+
+/* Fills buf with the status report, see SIDTEST_REPORT_SIZE in sid.h */
+void sid_test_report(uint8_t command, uint8_t *buf)
+{
+  uint32_t elapsed_ms = ((job.state == SIDTEST_IDLE ? 0 : (time_us_32() - job.start_us)) / 1000);
+  buf[0] = command;
+  buf[1] = job.state;
+  buf[2] = job.kind;
+  buf[3] = job.sidno;
+  buf[4] = (job.last_sid - job.first_sid);
+  buf[5] = job.step;
+  buf[6] = job.n_steps;
+  buf[7] = job.loop[0];
+  for (int i = 0; i < 4; i++) {
+    buf[8 + i] = (job.ops >> (24 - (i * 8))) & BYTE;
+    buf[12 + i] = (elapsed_ms >> (24 - (i * 8))) & BYTE;
+    buf[16 + i] = job.results[i];
+  }
+}
+
+/* Fills buf with the characterization report of a SID, see SIDCHAR_REPORT_SIZE in sid.h */
+void sid_char_report(uint8_t command, int sidno, uint8_t *buf)
+{
+  sid_metrics *m = &metrics[(sidno & 0x3)];
+  buf[0] = command;
+  buf[1] = (sidno & 0x3);
+  buf[2] = m->model;
+  buf[3] = m->readback;
+  for (int i = 0; i < 4; i++) {
+    buf[4 + i] = ((uint32_t)m->osc_ppm >> (24 - (i * 8))) & BYTE;
+    buf[8 + i] = (m->attack_us >> (24 - (i * 8))) & BYTE;
+    buf[12 + i] = (m->release_us >> (24 - (i * 8))) & BYTE;
+    buf[16 + i] = (m->clock_hz >> (24 - (i * 8))) & BYTE;
+    buf[20 + i] = (m->osc_res_ppm >> (24 - (i * 8))) & BYTE;
   }
+  DBG("[SIDCHAR] SID %d MODEL %d READBACK $%02X OSC %ld +/- %lu PPM ATTACK %lu US RELEASE %lu US\n",
+    (sidno + 1), m->model, m->readback, m->osc_ppm, m->osc_res_ppm, m->attack_us, m->release_us);
 }
@@ -56,6 +56,10 @@ enum config_clockrates
 /* Clock speed array */
 static const enum config_clockrates clockrates[] = { DEFAULT, PAL, NTSC, DREAN };
 
+/* Accepted range for arbitrary clock rates ~ the bus clock divider also needs to stay >= 1 */
+#define CLOCK_MIN  250000
+#define CLOCK_MAX  2000000
+
 /* Hertz ~ refresh rates */
 typedef enum {
     HZ_DEFAULT = 20000, // 50Hz ~ 20000 == 20us
@@ -169,108 +173,242 @@ static const uint8_t attack_decay[] =
 };
 
 /*
- * Osc Fn (Hex), No, Musical Note, Freq (Hz), Osc Fn (Decimal)
+ * Musical scale in Hz, index 0 is C0 (Midi note 12)
+ * Expanded at compile time into an oscillator frequency table per clock rate
  */
-static const uint32_t musical_scale_values[] =
+#define MUSICAL_SCALE_HZ(X) \
+    X(16.351598)  /* 0   C0   */ \
+    X(17.323914)  /* 1   C$0  */ \
+    X(18.354048)  /* 2   D0   */ \
+    X(19.445436)  /* 3   D$0  */ \
+    X(20.601722)  /* 4   E0   */ \
+    X(21.826764)  /* 5   F0   */ \
+    X(23.124651)  /* 6   F$0  */ \
+    X(24.499715)  /* 7   G0   */ \
+    X(25.956544)  /* 8   G$0  */ \
+    X(27.500000)  /* 9   A0   */ \
+    X(29.135235)  /* 10  A$0  */ \
+    X(30.867706)  /* 11  B0   */ \
+    X(32.703196)  /* 12  C1   */ \
+    X(34.647829)  /* 13  C$1  */ \
+    X(36.708096)  /* 14  D1   */ \
+    X(38.890873)  /* 15  D$1  */ \
+    X(41.203445)  /* 16  E1   */ \
+    X(43.653529)  /* 17  F1   */ \
+    X(46.249303)  /* 18  F$1  */ \
+    X(48.999429)  /* 19  G1   */ \
+    X(51.913087)  /* 20  G$1  */ \
+    X(55.000000)  /* 21  A1   */ \
+    X(58.270470)  /* 22  A$1  */ \
+    X(61.735413)  /* 23  B1   */ \
+    X(65.406391)  /* 24  C2   */ \
+    X(69.295658)  /* 25  C$2  */ \
+    X(73.416192)  /* 26  D2   */ \
+    X(77.781746)  /* 27  D$2  */ \
+    X(82.406889)  /* 28  E2   */ \
+    X(87.307058)  /* 29  F2   */ \
+    X(92.498606)  /* 30  F$2  */ \
+    X(97.998859)  /* 31  G2   */ \
+    X(103.826174)  /* 32  G$2  */ \
+    X(110.000000)  /* 33  A2   */ \
+    X(116.540940)  /* 34  A$2  */ \
+    X(123.470825)  /* 35  B2   */ \
+    X(130.812783)  /* 36  C3   */ \
+    X(138.591315)  /* 37  C$3  */ \
+    X(146.832384)  /* 38  D3   */ \
+    X(155.563492)  /* 39  D$3  */ \
+    X(164.813778)  /* 40  E3   */ \
+    X(174.614116)  /* 41  F3   */ \
+    X(184.997211)  /* 42  F$3  */ \
+    X(195.997718)  /* 43  G3   */ \
+    X(207.652349)  /* 44  G$3  */ \
+    X(220.000000)  /* 45  A3   */ \
+    X(233.081881)  /* 46  A$3  */ \
+    X(246.941651)  /* 47  B3   */ \
+    X(261.625565)  /* 48  C4   */ \
+    X(277.182631)  /* 49  C$4  */ \
+    X(293.664768)  /* 50  D4   */ \
+    X(311.126984)  /* 51  D$4  */ \
+    X(329.627557)  /* 52  E4   */ \
+    X(349.228231)  /* 53  F4   */ \
+    X(369.994423)  /* 54  F$4  */ \
+    X(391.995436)  /* 55  G4   */ \
+    X(415.304698)  /* 56  G$4  */ \
+    X(440.000000)  /* 57  A4   */ \
+    X(466.163762)  /* 58  A$4  */ \
+    X(493.883301)  /* 59  B4   */ \
+    X(523.251131)  /* 60  C5   */ \
+    X(554.365262)  /* 61  C$5  */ \
+    X(587.329536)  /* 62  D5   */ \
+    X(622.253967)  /* 63  D$5  */ \
+    X(659.255114)  /* 64  E5   */ \
+    X(698.456463)  /* 65  F5   */ \
+    X(739.988845)  /* 66  F$5  */ \
+    X(783.990872)  /* 67  G5   */ \
+    X(830.609395)  /* 68  G$5  */ \
+    X(880.000000)  /* 69  A5   */ \
+    X(932.327523)  /* 70  A$5  */ \
+    X(987.766603)  /* 71  B5   */ \
+    X(1046.502261)  /* 72  C6   */ \
+    X(1108.730524)  /* 73  C$6  */ \
+    X(1174.659072)  /* 74  D6   */ \
+    X(1244.507935)  /* 75  D$6  */ \
+    X(1318.510228)  /* 76  E6   */ \
+    X(1396.912926)  /* 77  F6   */ \
+    X(1479.977691)  /* 78  F$6  */ \
+    X(1567.981744)  /* 79  G6   */ \
+    X(1661.218790)  /* 80  G$6  */ \
+    X(1760.000000)  /* 81  A6   */ \
+    X(1864.655046)  /* 82  A$6  */ \
+    X(1975.533205)  /* 83  B6   */ \
+    X(2093.004522)  /* 84  C7   */ \
+    X(2217.461048)  /* 85  C$7  */ \
+    X(2349.318143)  /* 86  D7   */ \
+    X(2489.015870)  /* 87  D$7  */ \
+    X(2637.020455)  /* 88  E7   */ \
+    X(2793.825851)  /* 89  F7   */ \
+    X(2959.955382)  /* 90  F$7  */ \
+    X(3135.963488)  /* 91  G7   */ \
+    X(3322.437581)  /* 92  G$7  */ \
+    X(3520.000000)  /* 93  A7   */ \
+    X(3729.310092)  /* 94  A$7  */ \
+    X(3951.066410)  /* 95  B7   */ \
+    X(4186.009045)  /* 96  C8   */ \
+    X(4434.922096)  /* 97  C$8  */ \
+    X(4698.636287)  /* 98  D8   */ \
+    X(4978.031740)  /* 99  D$8  */ \
+    X(5274.040911)  /* 100 E8   */ \
+    X(5587.651703)  /* 101 F8   */ \
+    X(5919.910763)  /* 102 F$8  */ \
+    X(6271.926976)  /* 103 G8   */ \
+    X(6644.875161)  /* 104 G$8  */ \
+    X(7040.000000)  /* 105 A8   */ \
+    X(7458.620184)  /* 106 A$8  */ \
+    X(7902.132820)  /* 107 B8   */ \
+    X(8372.018090)  /* 108 C9   */ \
+    X(8869.844191)  /* 109 C$9  */ \
+    X(9397.272573)  /* 110 D9   */ \
+    X(9956.063479)  /* 111 D$9  */ \
+    X(10548.081821)  /* 112 E9   */ \
+    X(11175.303406)  /* 113 F9   */ \
+    X(11839.821527)  /* 114 F$9  */ \
+    X(12543.853951)  /* 115 G9   */ \
+    X(13289.750323)  /* 116 G$9  */ \
+    X(14080.000000)  /* 117 A9   */ \
+    X(14917.240369)  /* 118 A$9  */ \
+    X(15804.265640)  /* 119 B9   */ \
+    X(16744.036179)  /* 120 C10  */ \
+    X(17739.688383)  /* 121 C$10 */ \
+    X(18794.545147)  /* 122 D10  */ \
+    X(19912.126958)  /* 123 D$10 */ \
+    X(21096.163642)  /* 124 E10  */ \
+    X(22350.606812)  /* 125 F10  */ \
+    X(23679.643054)  /* 126 F$10 */ \
+    X(25087.707903)  /* 127 G10  */
+
+/* Oscillator frequency = Hz * 2^24 / clock, saturated at the 16 bit register maximum */
+#define SID_FREQ(hz, clock) ((((hz) * 16777216.0 / (clock)) + 0.5) >= 65535.0 ? 0xFFFF : (uint16_t)(((hz) * 16777216.0 / (clock)) + 0.5))
+#define SID_FREQ_DEFAULT(hz) SID_FREQ(hz, CLOCK_DEFAULT),
+#define SID_FREQ_PAL(hz) SID_FREQ(hz, CLOCK_PAL),
+#define SID_FREQ_NTSC(hz) SID_FREQ(hz, CLOCK_NTSC),
+#define SID_FREQ_DREAN(hz) SID_FREQ(hz, CLOCK_DREAN),
+
+static const uint16_t musical_scale_default[128] = { MUSICAL_SCALE_HZ(SID_FREQ_DEFAULT) };
+static const uint16_t musical_scale_pal[128] = { MUSICAL_SCALE_HZ(SID_FREQ_PAL) };
+static const uint16_t musical_scale_ntsc[128] = { MUSICAL_SCALE_HZ(SID_FREQ_NTSC) };
+static const uint16_t musical_scale_drean[128] = { MUSICAL_SCALE_HZ(SID_FREQ_DREAN) };
+
+/* Musical scale in millihertz, used to build a table for any other clock rate at runtime */
+#define HZ_TO_MILLIHZ(hz) (uint32_t)(((hz) * 1000.0) + 0.5),
+static const uint32_t musical_scale_millihz[128] = { MUSICAL_SCALE_HZ(HZ_TO_MILLIHZ) };
+
+/*
+ * Pitch bend ratio in 1.15 fixed point, 2^(n / (64 * 12)) for n = -128 ~ 128
+ * 64 fine steps per semitone over a +/- 2 semitone range
+ * Index with (bend >> 6) + 128 where bend is the signed 14 bit Midi value
+ */
+static const uint16_t pitch_bend_fine[257] =
 {
-    0x0112,   // 0    C0    16.35   274
-    0x0123,   // 1    C0$   17.32   291
-    0x0134,   // 2    D0    18.35   308
-    0x0146,   // 3    D0$   19.44   326
-    0x015A,   // 4    E0    20.60   346
-    0x016E,   // 5    F0    21.83   366
-    0x0184,   // 6    F0$   23.12   388
-    0x018B,   // 7    G0    24.50   411
-    0x01B3,   // 8    G0$   25.96   435
-    0x01CD,   // 9    A0    27.50   461
-    0x01E9,   // 10   A0$   29.14   489
-    0x0206,   // 11   B0    30.87   518
-    0x0225,   // 12   C1    32.70   549
-    0x0245,   // 13   C1$   34.65   581
-    0x0268,   // 14   D1    36.71   616
-    0x028C,   // 15   D1$   38.89   652
-    0x02B3,   // 16   E1    41.20   691
-    0x02DC,   // 17   F1    43.65   732
-    0x0308,   // 18   F1$   46.25   776
-    0x0336,   // 19   G1    49.00   822
-    0x0367,   // 20   G1$   51.91   871
-    0x039B,   // 21   A1    55.00   923
-    0x03D2,   // 22   A1$   58.27   978
-    0x040C,   // 23   B1    61.74   1036
-    0x0449,   // 24   C2    65.41   1097
-    0x048B,   // 25   C2$   69.30   1163
-    0x04D0,   // 26   D2    73.42   1232
-    0x0519,   // 27   D2$   77.78   1305
-    0x0567,   // 28   E2    82.41   1383
-    0x05B9,   // 29   F2    87.31   1465
-    0x0610,   // 30   F2$   92.50   1552
-    0x066C,   // 31   G2    98.00   1644
-    0x06CE,   // 32   G2$   103.83   1742
-    0x0735,   // 33   A2    110.00   1845
-    0x07A3,   // 34   A2$   116.54   1955
-    0x0817,   // 35   B2    123.47   2071
-    0x0893,   // 36   C3    130.81   2195
-    0x0915,   // 37   C3$   138.59   2325
-    0x099F,   // 38   D3    146.83   2463
-    0x0A32,   // 39   D3$   155.56   2610
-    0x0ACD,   // 40   E3    164.81   2765
-    0x0B72,   // 41   F3    174.61   2930
-    0x0C20,   // 42   F3$   185.00   3104
-    0x0CD8,   // 43   G3    196.00   3288
-    0x0D9C,   // 44   G3$   207.65   3484
-    0x0E6B,   // 45   A3    220.00   3691
-    0x0F46,   // 46   A3$   233.08   3910
-    0x102F,   // 47   B3    246.94   4143
-    0x1125,   // 48   C4    261.63   4389
-    0x122A,   // 49   C4$   277.18   4650
-    0x133F,   // 50   D4    293.66   4927
-    0x1464,   // 51   D4$   311.13   5220
-    0x159A,   // 52   E4    329.63   5530
-    0x16E3,   // 53   F4    349.23   5859
-    0x183F,   // 54   F4$   370.00   6207
-    0x1981,   // 55   G4    392.00   6577
-    0x1B38,   // 56   G4$   415.30   6968
-    0x1CD6,   // 57   A4    440.00   7382
-    0x1E80,   // 58   A4$   466.16   7821
-    0x205E,   // 59   B4    493.88   8286
-    0x224B,   // 60   C5    523.25   8779
-    0x2455,   // 61   C5$   554.37   9301
-    0x267E,   // 62   D5    587.33   9854
-    0x28C8,   // 63   D5$   622.25   10440
-    0x2B34,   // 64   E5    659.25   11060
-    0x2DC6,   // 65   F5    698.46   11718
-    0x307F,   // 66   F5$   740.00   12415
-    0x3361,   // 67   G5    783.99   13153
-    0x366F,   // 68   G5$   830.61   13935
-    0x39AC,   // 69   A5    880.00   14764
-    0x3D1A,   // 70   A5$   932.33   15642
-    0x40BC,   // 71   B5    987.77   16572
-    0x4495,   // 72   C6    1046.50   17557
-    0x48A9,   // 73   C6$   1108.73   18601
-    0x4CFC,   // 74   D6    1174.66   19709
-    0x518F,   // 75   D6$   1244.51   20897
-    0x5669,   // 76   E6    1381.51   22121
-    0x5B8C,   // 77   F6    1396.91   23436
-    0x60FE,   // 78   F6$   1479.98   24830
-    0x6602,   // 79   G6    1567.98   26306
-    0x6CDF,   // 80   G6$   1661.22   27871
-    0x7358,   // 81   A6    1760.00   29528
-    0x7A34,   // 82   A6$   1864.65   31234
-    0x8178,   // 83   B6    1975.53   33144
-    0x892B,   // 84   C7    2093.00   35115
-    0x9153,   // 85   C7$   2217.46   37203
-    0x99F7,   // 86   D7    2349.32   39415
-    0xA31F,   // 87   D7$   2489.01   41759
-    0xACD2,   // 88   E7    2637.02   44242
-    0xB719,   // 89   F7    2793.83   46873
-    0xC1FC,   // 90   F7$   2959.95   49660
-    0xCD85,   // 91   G7    3135.96   52613
-    0xD9BD,   // 92   G7$   3322.44   55741
-    0xE6B0,   // 93   A7    3520.00   59056
-    0xF467,   // 94   A7$   3729.31   62567
-    0x102F0,  // 95   B7    3951.06   66288
+    0x7209, 0x7223, 0x723E, 0x7258, 0x7273, 0x728D, 0x72A7, 0x72C2,
+    0x72DD, 0x72F7, 0x7312, 0x732C, 0x7347, 0x7362, 0x737C, 0x7397,
+    0x73B2, 0x73CC, 0x73E7, 0x7402, 0x741D, 0x7438, 0x7452, 0x746D,
+    0x7488, 0x74A3, 0x74BE, 0x74D9, 0x74F4, 0x750F, 0x752A, 0x7545,
+    0x7560, 0x757C, 0x7597, 0x75B2, 0x75CD, 0x75E8, 0x7604, 0x761F,
+    0x763A, 0x7655, 0x7671, 0x768C, 0x76A8, 0x76C3, 0x76DE, 0x76FA,
+    0x7715, 0x7731, 0x774D, 0x7768, 0x7784, 0x779F, 0x77BB, 0x77D7,
+    0x77F2, 0x780E, 0x782A, 0x7846, 0x7861, 0x787D, 0x7899, 0x78B5,
+    0x78D1, 0x78ED, 0x7909, 0x7925, 0x7941, 0x795D, 0x7979, 0x7995,
+    0x79B1, 0x79CD, 0x79E9, 0x7A05, 0x7A22, 0x7A3E, 0x7A5A, 0x7A76,
+    0x7A93, 0x7AAF, 0x7ACB, 0x7AE8, 0x7B04, 0x7B21, 0x7B3D, 0x7B5A,
+    0x7B76, 0x7B93, 0x7BAF, 0x7BCC, 0x7BE8, 0x7C05, 0x7C22, 0x7C3E,
+    0x7C5B, 0x7C78, 0x7C95, 0x7CB1, 0x7CCE, 0x7CEB, 0x7D08, 0x7D25,
+    0x7D42, 0x7D5F, 0x7D7C, 0x7D99, 0x7DB6, 0x7DD3, 0x7DF0, 0x7E0D,
+    0x7E2A, 0x7E47, 0x7E65, 0x7E82, 0x7E9F, 0x7EBC, 0x7EDA, 0x7EF7,
+    0x7F14, 0x7F32, 0x7F4F, 0x7F6C, 0x7F8A, 0x7FA7, 0x7FC5, 0x7FE2,
+    0x8000, 0x801E, 0x803B, 0x8059, 0x8077, 0x8094, 0x80B2, 0x80D0,
+    0x80ED, 0x810B, 0x8129, 0x8147, 0x8165, 0x8183, 0x81A1, 0x81BF,
+    0x81DD, 0x81FB, 0x8219, 0x8237, 0x8255, 0x8273, 0x8291, 0x82AF,
+    0x82CE, 0x82EC, 0x830A, 0x8328, 0x8347, 0x8365, 0x8383, 0x83A2,
+    0x83C0, 0x83DF, 0x83FD, 0x841C, 0x843A, 0x8459, 0x8477, 0x8496,
+    0x84B5, 0x84D3, 0x84F2, 0x8511, 0x852F, 0x854E, 0x856D, 0x858C,
+    0x85AB, 0x85CA, 0x85E9, 0x8608, 0x8627, 0x8646, 0x8665, 0x8684,
+    0x86A3, 0x86C2, 0x86E1, 0x8700, 0x871F, 0x873F, 0x875E, 0x877D,
+    0x879C, 0x87BC, 0x87DB, 0x87FB, 0x881A, 0x883A, 0x8859, 0x8879,
+    0x8898, 0x88B8, 0x88D7, 0x88F7, 0x8917, 0x8936, 0x8956, 0x8976,
+    0x8995, 0x89B5, 0x89D5, 0x89F5, 0x8A15, 0x8A35, 0x8A55, 0x8A75,
+    0x8A95, 0x8AB5, 0x8AD5, 0x8AF5, 0x8B15, 0x8B35, 0x8B55, 0x8B76,
+    0x8B96, 0x8BB6, 0x8BD6, 0x8BF7, 0x8C17, 0x8C37, 0x8C58, 0x8C78,
+    0x8C99, 0x8CB9, 0x8CDA, 0x8CFA, 0x8D1B, 0x8D3B, 0x8D5C, 0x8D7D,
+    0x8D9E, 0x8DBE, 0x8DDF, 0x8E00, 0x8E21, 0x8E41, 0x8E62, 0x8E83,
+    0x8EA4, 0x8EC5, 0x8EE6, 0x8F07, 0x8F28, 0x8F49, 0x8F6B, 0x8F8C,
+    0x8FAD,
 };
 
+/* SID test and detection jobs, see sid.c */
+typedef enum {
+  SIDTEST_IDLE = 0,
+  SIDTEST_RUNNING,
+  SIDTEST_DONE,
+  SIDTEST_ABORTED
+} sidtest_state;
+
+/* Job kinds ~ 1 to 5 match the test numbers sent with TEST_SIDx */
+enum {
+  SIDTEST_DETECT     = 0,
+  SIDTEST_ALL        = 1,
+  SIDTEST_WAVEFORMS  = 2,
+  SIDTEST_FILTER     = 3,
+  SIDTEST_ENVELOPE   = 4,
+  SIDTEST_MODULATION = 5,
+  SIDTEST_CHARACTERIZE = 6,
+};
+
+/* Test status report as returned by TEST_STATUS
+ * [command][state][kind][sid][sid count][step][step count][voice][operations 4][elapsed ms 4][result sid 1..4] */
+#define SIDTEST_REPORT_SIZE 20
+
+/* Characterization readback bits */
+enum {
+  SIDCHAR_SAWTOOTH = 0x01,  /* OSC3 sawtooth counts up */
+  SIDCHAR_TRIANGLE = 0x02,  /* OSC3 triangle spans the full range */
+  SIDCHAR_PULSE    = 0x04,  /* OSC3 pulse only reads $00 and $FF */
+  SIDCHAR_NOISE    = 0x08,  /* OSC3 noise spans the full range */
+  SIDCHAR_ENVELOPE = 0x10,  /* ENV3 reached the top of the attack */
+  SIDCHAR_RELEASE  = 0x20,  /* ENV3 released back to zero */
+};
+
+/* Characterization report as returned by TEST_REPORT, values are big endian
+ * [command][sid][model][readback bits][oscillator error ppm 4][attack us 4][release us 4][clock Hz 4][oscillator resolution ppm 4]
+ * The oscillator error is only known to +/- 1 OSC3 step per unbroken run of samples,
+ * the resolution field holds that bound, ~160ppm at 1MHz */
+#define SIDCHAR_REPORT_SIZE 24
+#define SIDCHAR_OSC_FREQ   0x1000  /* OSC3 advances 1 step per 16 cycles */
+#define SIDCHAR_OSC_SAMPLES 100    /* Samples for the oscillator rate, 1 per ms */
+#define SIDCHAR_OSC_MAX_STEPS 192  /* Longest sample interval in OSC3 steps that cannot hide a wrap */
+#define SIDCHAR_ATTACK_RATE  0x8   /* 100ms at 1MHz */
+#define SIDCHAR_RELEASE_RATE 0x8   /* 300ms at 1MHz */
+#define SIDCHAR_TIMEOUT_US 2000000
+
 /* 12 musical note notations */
 static const char notes[12][2] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "H"};
 
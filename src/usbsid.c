@@ -39,17 +39,19 @@ extern int randval(int min, int max);
 static semaphore_t core1_init;
 
 /* Init vars ~ Do not change order to keep memory alignment! */
-uint8_t __not_in_flash("usbsid_buffer") config_buffer[5];
+uint8_t __not_in_flash("usbsid_buffer") config_buffer[(MAX_BUFFER_SIZE - 1)];
 uint8_t __not_in_flash("usbsid_buffer") sid_memory[(0x20 * 4)] __attribute__((aligned(2 * (0x20 * 4))));
 uint8_t __not_in_flash("usbsid_buffer") write_buffer[MAX_BUFFER_SIZE] __attribute__((aligned(2 * MAX_BUFFER_SIZE)));
 uint8_t __not_in_flash("usbsid_buffer") sid_buffer[MAX_BUFFER_SIZE] __attribute__((aligned(2 * MAX_BUFFER_SIZE)));
 uint8_t __not_in_flash("usbsid_buffer") read_buffer[MAX_BUFFER_SIZE] __attribute__((aligned(2 * MAX_BUFFER_SIZE)));
 int usb_connected = 0, usbdata = 0, pwm_value = 0, updown = 1;
+uint32_t last_rx_us = 0;  /* Time of the last incoming data, used to defer config saves to idle time */
 uint32_t cdcread = 0, cdcwrite = 0, webread = 0, webwrite = 0;
 uint8_t *cdc_itf = 0, *wusb_itf = 0;
 uint16_t vu = 0;
 uint32_t breathe_interval_ms = BREATHE_INTV;
-uint32_t start_ms = 0;
+static alarm_pool_t *led_alarm_pool;
+static repeating_timer_t led_timer;
 char ntype = '0', dtype = '0', cdc = 'C', asid = 'A', midi = 'M', wusb = 'W';
 bool web_serial_connected = false;
 double cpu_mhz = 0, cpu_us = 0, sid_hz = 0, sid_mhz = 0, sid_us = 0;
@@ -62,10 +64,14 @@ Config usbsid_config;
 extern int sock_one, sock_two, sids_one, sids_two, numsids, act_as_one;
 extern void default_config(Config * config);
 extern void load_config(Config * config);
-extern void save_config(const Config * config);
+extern int save_config(const Config * config);
+extern void config_save_task(void);
+extern void clock_measure_task(void);
+extern void commit_save_config(void);
 extern void handle_config_request(uint8_t * buffer);
 extern void apply_config(void);
 extern void detect_default_config(void);
+extern int calibrate_external_clock(uint32_t gate_ms);
 extern void verify_clockrate(void);
 
 /* GPIO externals */
@@ -88,6 +94,17 @@ extern void clear_bus_all(void);
 extern uint8_t __not_in_flash_func(bus_operation)(uint8_t command, uint8_t address, uint8_t data);
 extern void __not_in_flash_func(cycled_bus_operation)(uint8_t address, uint8_t data, uint16_t cycles);
 
+/* SID externals */
+extern void sid_test_task(void);
+extern bool sid_test_owns(uint8_t address);
+
+/* VU externals */
+extern void vu_init(void);
+extern void vu_tick(uint32_t elapsed_ms);
+extern uint8_t vu_voice_level(int sidno, int voiceno);
+extern uint16_t vu_sid_level(int sidno);
+extern void vu_report_cost(void);
+
 /* MCU externals */
 extern void mcu_reset(void);
 extern void mcu_jump_to_bootloader(void);
@@ -101,9 +118,10 @@ extern void process_stream(uint8_t *buffer, size_t size);
 #define IS_RGBW false
 PIO pio_rgb = pio1;
 uint ws2812_sm, offset_ws2812;
+int dma_ws2812;
+static uint32_t ws2812_word;  /* Read by DMA, must stay in place while a transfer runs */
 int _rgb = 0;
 uint8_t r_ = 0, g_ = 0, b_ = 0;
-unsigned char o1 = 0, o2 = 0, o3 = 0, o4 = 0, o5 = 0, o6 = 0, o7 = 0, o8 = 0, o9 = 0, o10 = 0, o11 = 0, o12 = 0;
 const __not_in_flash("usbsid_data") unsigned char color_LUT[43][6][3] =
 {
   /* Red Green Blue Yellow Cyan Purple*/
@@ -182,8 +200,10 @@ void reset_reason(void)
 
 #if defined(USE_RGB)
 void put_pixel(uint32_t pixel_grb) {
-  // pio_sm_put_blocking(pio_rgb, ws2812_sm, pixel_grb << 8u);
-  pio_sm_put(pio_rgb, ws2812_sm, pixel_grb << 8u);
+  /* A pixel still on its way out is simply replaced on the next LED tick */
+  if (dma_channel_is_busy(dma_ws2812)) return;
+  ws2812_word = (pixel_grb << 8u);
+  dma_channel_set_read_addr(dma_ws2812, &ws2812_word, true);
   return;
 }
 
@@ -191,10 +211,9 @@ uint32_t urgb_u32(uint8_t r, uint8_t g, uint8_t b) {
   return ((uint32_t) (r) << 8) | ((uint32_t) (g) << 16) | (uint32_t) (b);
 }
 
-uint8_t rgbb(double inp)
-{
-  int r = abs((inp / 255) * usbsid_config.RGBLED.brightness);
-  return (uint8_t)r;
+uint8_t rgbb(uint8_t inp)
+{ /* inp * brightness / 255 without floats */
+  return (uint8_t)(((uint32_t)inp * usbsid_config.RGBLED.brightness * 257) >> 16);
 }
 #endif
 
@@ -223,6 +242,14 @@ void init_rgb(void)
   ws2812_sm = 0;  /* PIO1 SM0 */
   pio_sm_claim(pio_rgb, ws2812_sm);
   ws2812_program_init(pio_rgb, ws2812_sm, offset_ws2812, 23, 800000, IS_RGBW);
+  /* One word per pixel, paced by the state machine */
+  dma_ws2812 = dma_claim_unused_channel(true);
+  dma_channel_config dma_ws2812_config = dma_channel_get_default_config(dma_ws2812);
+  channel_config_set_transfer_data_size(&dma_ws2812_config, DMA_SIZE_32);
+  channel_config_set_read_increment(&dma_ws2812_config, false);
+  channel_config_set_write_increment(&dma_ws2812_config, false);
+  channel_config_set_dreq(&dma_ws2812_config, pio_get_dreq(pio_rgb, ws2812_sm, true));
+  dma_channel_configure(dma_ws2812, &dma_ws2812_config, &pio_rgb->txf[ws2812_sm], &ws2812_word, 1, false);
   put_pixel(urgb_u32(0,0,0));
   #endif
   return;
@@ -254,6 +281,16 @@ void webserial_write(uint8_t * itf, uint32_t n)
 
 /* BUFFER HANDLING */
 
+/* Cycled write from the host, writes to SIDs owned by a running test only keep their delay */
+static void __not_in_flash_func(host_cycled_write)(uint8_t address, uint8_t data, uint16_t cycles)
+{
+  if (!(address == 0xFF && data == 0xFF) && sid_test_owns(address)) {
+    if (cycles >= 1) cycled_bus_operation(0xFF, 0xFF, cycles);
+    return;
+  }
+  cycled_bus_operation(address, data, cycles);
+}
+
 /* Process received usb data */
 void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
 {
@@ -265,7 +302,7 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
   if (command == CYCLED_WRITE) {
     // n_bytes = (n_bytes == 0) ? 4 : n_bytes; /* if byte count is zero, this is a single write packet */
     if (n_bytes == 0) {
-      cycled_bus_operation(sid_buffer[1], sid_buffer[2], (sid_buffer[3] << 8 | sid_buffer[4]));
+      host_cycled_write(sid_buffer[1], sid_buffer[2], (sid_buffer[3] << 8 | sid_buffer[4]));
     } else {
       for (int i = 1; i <= n_bytes; i += 4) {
         usbdata = 1;
@@ -275,7 +312,7 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
           /* return; */
           continue;
         };
-        cycled_bus_operation(sid_buffer[i], sid_buffer[i + 1], (sid_buffer[i + 2] << 8 | sid_buffer[i + 3]));
+        host_cycled_write(sid_buffer[i], sid_buffer[i + 1], (sid_buffer[i + 2] << 8 | sid_buffer[i + 3]));
       };
     }
     return;
@@ -283,6 +320,7 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
   if (command == WRITE) {
     // n_bytes = (n_bytes == 0) ? 2 : n_bytes; /* if byte count is zero, this is a single write packet */
     if (n_bytes == 0) {
+      if (sid_test_owns(sid_buffer[1])) return;  /* A running test has the SID to itself */
       bus_operation(0x10, sid_buffer[1], sid_buffer[2]);  /* write the address and value to the SID */
       IODBG("[I] [%c] $%02X:%02X\n", dtype, sid_buffer[1], sid_buffer[2]);
     } else {
@@ -290,7 +328,7 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
       for (int i = 1; i <= n_bytes; i += 2) {
         IODBG(" $%02X:%02X", sid_buffer[i], sid_buffer[i + 1]);
         /* write the address and value to the SID with minimal 10 cycles in between ~ Thanks for the cycle amount erique! */
-        cycled_bus_operation(sid_buffer[i], sid_buffer[i + 1], 10);
+        host_cycled_write(sid_buffer[i], sid_buffer[i + 1], 10);
       };
       IODBG("\n");
     }
@@ -349,16 +387,18 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
         break;
       case CONFIG:
         DBG("[CONFIG]\n");
-        memcpy(config_buffer, (sid_buffer + 1), 5);
+        memcpy(config_buffer, (sid_buffer + 1), count_of(config_buffer));
         handle_config_request(config_buffer);
         memset(config_buffer, 0, count_of(config_buffer));
         break;
       case RESET_MCU:
         DBG("[RESET_MCU]\n");
+        commit_save_config();
         mcu_reset();
         break;
       case BOOTLOADER:
         DBG("[BOOTLOADER]\n");
+        commit_save_config();
         mcu_jump_to_bootloader();
         break;
       default:
@@ -376,91 +416,35 @@ void __not_in_flash_func(handle_buffer_task)(uint8_t * itf, uint32_t * n)
 void led_vumeter_task(void)
 {
   #if LED_PWM
-  if (to_ms_since_boot(get_absolute_time()) - start_ms < breathe_interval_ms) {
-    return;  /* not enough time */
-  }
-  start_ms = to_ms_since_boot(get_absolute_time());
   if (usbdata == 1 && dtype != ntype) {
-    uint8_t osc1, osc2, osc3;
-    osc1 = (sid_memory[0x00] * 0.596);  /* Frequency in Hz of SID1 @ $D400 Oscillator 1 */
-    osc2 = (sid_memory[0x07] * 0.596);  /* Frequency in Hz of SID1 @ $D400 Oscillator 2 */
-    osc3 = (sid_memory[0x0E] * 0.596);  /* Frequency in Hz of SID1 @ $D400 Oscillator 3 */
+    /* Envelope model of each voice from the shadow registers */
+    vu_tick(breathe_interval_ms);
 
     #if defined(USE_RGB)
     if(usbsid_config.RGBLED.enabled) {
-      r_ = 0, g_ = 0, b_ = 0, o1 = 0, o2 = 0, o3 = 0, o4 = 0, o5 = 0, o6 = 0, o7 = 0, o8 = 0, o9 = 0, o10 = 0, o11 = 0, o12 = 0;
-      uint8_t osc4, osc5, osc6, osc7, osc8, osc9, osc10, osc11, osc12;
-      if (numsids >= 2) {
-        osc4 = (sid_memory[0x00 + 0x20] * 0.596);  /* Frequency in Hz of SID2 @ $D420 Oscillator 1 */
-        osc5 = (sid_memory[0x07 + 0x20] * 0.596);  /* Frequency in Hz of SID2 @ $D420 Oscillator 2 */
-        osc6 = (sid_memory[0x0E + 0x20] * 0.596);  /* Frequency in Hz of SID2 @ $D420 Oscillator 3 */
-      }
-      if (numsids >= 3) {
-        osc7 = (sid_memory[0x00 + 0x40] * 0.596);  /* Frequency in Hz of SID3 @ $D440 Oscillator 1 */
-        osc8 = (sid_memory[0x07 + 0x40] * 0.596);  /* Frequency in Hz of SID3 @ $D440 Oscillator 2 */
-        osc9 = (sid_memory[0x0E + 0x40] * 0.596);  /* Frequency in Hz of SID3 @ $D440 Oscillator 3 */
-      }
-      if (numsids == 4) {
-        osc10 = (sid_memory[0x00 + 0x60] * 0.596);  /* Frequency in Hz of SID4 @ $D460 Oscillator 1 */
-        osc11 = (sid_memory[0x07 + 0x60] * 0.596);  /* Frequency in Hz of SID4 @ $D460 Oscillator 2 */
-        osc12 = (sid_memory[0x0E + 0x60] * 0.596);  /* Frequency in Hz of SID4 @ $D460 Oscillator 3 */
-      }
-      o1 = map(osc1, 0, 255, 0, 43);
-      o2 = map(osc2, 0, 255, 0, 43);
-      o3 = map(osc3, 0, 255, 0, 43);
-      if (numsids >= 2) {
-        o4 = map(osc4, 0, 255, 0, 43);
-        o5 = map(osc5, 0, 255, 0, 43);
-        o6 = map(osc6, 0, 255, 0, 43);
+      /* Default shows SID 1 and 2, otherwise only the chosen SID */
+      int from = 0, to = (numsids >= 2 ? 2 : 1);
+      if (usbsid_config.RGBLED.sid_to_use >= 1 && usbsid_config.RGBLED.sid_to_use <= 4) {
+        from = (usbsid_config.RGBLED.sid_to_use - 1);
+        to = (from < numsids ? (from + 1) : from);
       }
-      if (numsids >= 3) {
-        o7 = map(osc7, 0, 255, 0, 43);
-        o8 = map(osc8, 0, 255, 0, 43);
-        o9 = map(osc9, 0, 255, 0, 43);
-      }
-      if (numsids == 4) {
-        o10 = map(osc10, 0, 255, 0, 43);
-        o11 = map(osc11, 0, 255, 0, 43);
-        o12 = map(osc12, 0, 255, 0, 43);
-      }
-      switch (usbsid_config.RGBLED.sid_to_use) {
-      case 1:
-        r_ += color_LUT[o1][0][0] + color_LUT[o2][1][0] + color_LUT[o3][2][0] ;
-        g_ += color_LUT[o1][0][1] + color_LUT[o2][1][1] + color_LUT[o3][2][1] ;
-        b_ += color_LUT[o1][0][2] + color_LUT[o2][1][2] + color_LUT[o3][2][2] ;
-        break;
-      case 2:
-        r_ += color_LUT[o4][3][0] + color_LUT[o5][4][0] + color_LUT[o6][5][0] ;
-        g_ += color_LUT[o4][3][1] + color_LUT[o5][4][1] + color_LUT[o6][5][1] ;
-        b_ += color_LUT[o4][3][2] + color_LUT[o5][4][2] + color_LUT[o6][5][2] ;
-        break;
-      case 3:
-        r_ += color_LUT[o7][0][0] + color_LUT[o8][1][0] + color_LUT[o9][2][0] ;
-        g_ += color_LUT[o7][0][1] + color_LUT[o8][1][1] + color_LUT[o9][2][1] ;
-        b_ += color_LUT[o7][0][2] + color_LUT[o8][1][2] + color_LUT[o9][2][2] ;
-        break;
-      case 4:
-        r_ += color_LUT[o10][3][0] + color_LUT[o11][4][0] + color_LUT[o12][5][0] ;
-        g_ += color_LUT[o10][3][1] + color_LUT[o11][4][1] + color_LUT[o12][5][1] ;
-        b_ += color_LUT[o10][3][2] + color_LUT[o11][4][2] + color_LUT[o12][5][2] ;
-        break;
-      case 0:
-      default:
-        r_ += color_LUT[o1][0][0] + color_LUT[o2][1][0] + color_LUT[o3][2][0] + color_LUT[o4][3][0] + color_LUT[o5][4][0] + color_LUT[o6][5][0] ;
-        g_ += color_LUT[o1][0][1] + color_LUT[o2][1][1] + color_LUT[o3][2][1] + color_LUT[o4][3][1] + color_LUT[o5][4][1] + color_LUT[o6][5][1] ;
-        b_ += color_LUT[o1][0][2] + color_LUT[o2][1][2] + color_LUT[o3][2][2] + color_LUT[o4][3][2] + color_LUT[o5][4][2] + color_LUT[o6][5][2] ;
-        break;
+      uint16_t r = 0, g = 0, b = 0;
+      for (int sidno = from; sidno < to; sidno++) {
+        for (int voiceno = 0; voiceno < 3; voiceno++) {
+          int level = ((vu_voice_level(sidno, voiceno) * 43) >> 8);  /* 0 ~ 42 */
+          const unsigned char *color = color_LUT[level][(((sidno & 1) * 3) + voiceno)];
+          r += color[0], g += color[1], b += color[2];
+        }
       }
+      r_ = (r > 255 ? 255 : r), g_ = (g > 255 ? 255 : g), b_ = (b > 255 ? 255 : b);
       put_pixel(urgb_u32(rgbb(r_), rgbb(g_), rgbb(b_)));
 
       /* Color LED debugging ~ uncomment for testing */
-      // DBG("[%c][PWM]$%04x [R]%02x [G]%02x [B]%02x [O1]$%02x $%02d [O2]$%02x $%02d [O3]$%02x $%02d [O4]$%02x $%02d [O5]$%02x $%02d [O6]$%02x $%02d\n",
-      //  dtype, vu, r_, g_, b_, osc1, o1, osc2, o2, osc3, o3, osc4, o4, osc5, o5, osc6, o6);
+      // DBG("[%c][PWM]$%04x [R]%02x [G]%02x [B]%02x\n", dtype, vu, r_, g_, b_);
     }
     #endif
 
-    vu = abs((osc1 + osc2 + osc3) / 3.0f);
-    vu = map(vu, 0, HZ_MAX, 0, VU_MAX);
+    vu = vu_sid_level(0);
     if (usbsid_config.LED.enabled) {
       pwm_set_gpio_level(BUILTIN_LED, vu);
     }
@@ -482,11 +466,6 @@ void led_breathe_task(void)
 {
   #if LED_PWM
   if (usbdata == 0 && dtype == ntype) {
-    if (to_ms_since_boot(get_absolute_time()) - start_ms < breathe_interval_ms) {
-      return;  /* not enough time */
-    }
-    start_ms = to_ms_since_boot(get_absolute_time());
-
     if (pwm_value >= VU_MAX) {
       updown = 0;
     }
@@ -523,6 +502,29 @@ void led_breathe_task(void)
   #endif
 }
 
+/* Runs the LED tasks from a timer interrupt on the core that calls this */
+static bool led_timer_callback(repeating_timer_t *rt)
+{
+  (void)rt;
+  usbdata == 1 ? led_vumeter_task() : led_breathe_task();
+  return true;
+}
+
+/* Starts the LED timer ~ must run on core 1 so the interrupt never lands on the bus core */
+void init_led_timer(void)
+{
+  led_alarm_pool = alarm_pool_create_with_unused_hardware_alarm(2);
+  #if PICO_SDK_VERSION_MAJOR < 2
+  uint led_irq = (TIMER_IRQ_0 + alarm_pool_hardware_alarm_num(led_alarm_pool));
+  #else
+  uint led_irq = hardware_alarm_get_irq_num(alarm_pool_hardware_alarm_num(led_alarm_pool));
+  #endif
+  irq_set_priority(led_irq, PICO_LOWEST_IRQ_PRIORITY);
+  /* Negative interval keeps a fixed rate measured from the start of each callback */
+  alarm_pool_add_repeating_timer_ms(led_alarm_pool, -(int32_t)breathe_interval_ms, led_timer_callback, NULL, &led_timer);
+  return;
+}
+
 
 /* USB CALLBACKS */
 
@@ -560,6 +562,7 @@ void tud_cdc_rx_cb(uint8_t itf)
 { /* No need to check available bytes for reading */
   cdc_itf = &itf;
   usbdata = 1, dtype = cdc;
+  last_rx_us = time_us_32();
   vu = vu == 0 ? 100 : vu;  /* NOTICE: Testfix for core1 setting dtype to 0 */
   cdcread = tud_cdc_n_read(*cdc_itf, &read_buffer, MAX_BUFFER_SIZE);  /* Read data from client */
   tud_cdc_n_read_flush(*cdc_itf);
@@ -621,6 +624,7 @@ void tud_midi_rx_cb(uint8_t itf)
 {
   if (tud_midi_n_mounted(itf)) {
     usbdata = 1;
+    last_rx_us = time_us_32();
     while (tud_midi_n_available(itf, 0)) {  /* Loop as long as there is data available */
       uint32_t available = tud_midi_n_stream_read(itf, 0, midimachine.usbstreambuffer, MAX_BUFFER_SIZE);  /* Reads all available bytes at once */
       process_stream(midimachine.usbstreambuffer, available);
@@ -645,6 +649,7 @@ void tud_vendor_rx_cb(uint8_t itf, uint8_t const* buffer, uint16_t bufsize)
   if (web_serial_connected) { /* vendor class has no connect check, thus use this */
     wusb_itf = &itf;
     usbdata = 1, dtype = wusb;
+    last_rx_us = time_us_32();
     webread = tud_vendor_n_read(*wusb_itf, &read_buffer, MAX_BUFFER_SIZE);
     tud_vendor_n_read_flush(*wusb_itf);
     memcpy(sid_buffer, read_buffer, webread);
@@ -758,7 +763,7 @@ void core1_main(void)
     init_sidclock();
   } else {  /* Do nothing gpio acts as input detection */
     usbsid_config.external_clock = true;
-    usbsid_config.clock_rate = CLOCK_DEFAULT;  /* Always 1MHz */
+    calibrate_external_clock(PHI2_GATE_MS);  /* Falls back to 1MHz if the measurement fails */
   }
 
   /* Init RGB LED */
@@ -767,6 +772,7 @@ void core1_main(void)
   memset(sid_memory, 0, sizeof sid_memory);
   /* Start the VU */
   init_vu();
+  vu_init();
 
   /* Init cycled write buffer vars */
   cpu_mhz = (clock_get_hz(clk_sys) / 1000 / 1000);
@@ -782,8 +788,11 @@ void core1_main(void)
 
   int n_checks = 0, m_now = 0;
   m_now = to_ms_since_boot(get_absolute_time());
+  /* LED rendering runs from a low priority timer interrupt, core 1 sleeps in between */
+  init_led_timer();
   while (1) {
-    usbdata == 1 ? led_vumeter_task() : led_breathe_task();
+    __wfi();
+    vu_report_cost();
     if (to_ms_since_boot(get_absolute_time()) - m_now < CHECK_INTV) { /* 20 seconds */
       /* NOTICE: Testfix for core1 setting dtype to 0 */
       /* do nothing */
@@ -845,6 +854,15 @@ int main()
   /* Loop IO tasks forever */
   while (1) {
     tud_task_ext(/* UINT32_MAX */0, false);  // equals tud_task();
+    /* Midi modulation and coalesced CC writes ~ run on core 0 to never race the bus */
+    midi_mod_task();
+    midi_cc_flush_task();
+    /* Commit deferred config saves */
+    config_save_task();
+    /* Finish an on demand clock measurement */
+    clock_measure_task();
+    /* Advance a running SID test or detection */
+    sid_test_task();
   }
 
   /* Point of no return, this should never be reached */
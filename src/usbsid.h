@@ -54,6 +54,9 @@
 #include "hardware/flash.h"
 #include "hardware/uart.h"
 #include "hardware/timer.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "hardware/structs/sio.h"  /* Pico SIO structs */
 
 /* Reboot type logging */
@@ -129,10 +132,11 @@ enum
   ALWAYS_ON = 0,
   CHECK_INTV = 100,
   MAX_CHECKS = 200,  /* 200 checks times 100ms == 20 seconds */
-  BREATHE_INTV = 1,
+  BREATHE_INTV = 1,  /* LED timer interval in ms */
   BREATHE_STEP = 100,
   VU_MAX = 65534,
-  HZ_MAX = 40
+  VU_SCALE = ((VU_MAX << 8) / (3 * 255 * 15)),  /* 3 voices at full level and volume */
+  VU_REPORT_MS = 10000,  /* VU engine cost logging interval */
 };
 
 
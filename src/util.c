@@ -36,3 +36,15 @@ long map(long x, long in_min, long in_max, long out_min, long out_max)
 {
   return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len)
+{ /* CRC-32 (IEEE 802.3), bitwise to save flash ~ pass 0 to start, previous result to continue */
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
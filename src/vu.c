@@ -0,0 +1,213 @@
+/*
+ * USBSID-Pico is a RPi Pico (RP2040) based board for interfacing one or two
+ * MOS SID chips and/or hardware SID emulators over (WEB)USB with your computer,
+ * phone or ASID supporting player
+ *
+ * vu.c
+ * This file is part of USBSID-Pico (https://github.com/LouDnl/USBSID-Pico)
+ * File author: LouD
+ *
+ * Copyright (c) 2024-2025 LouD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Default includes */
+#include <string.h>
+
+#include "globals.h"
+#include "config.h"
+#include "usbsid.h"
+#include "sid.h"
+#include "logging.h"
+
+#include "hardware/clocks.h"
+#if defined(__arm__)
+#include "hardware/structs/systick.h"
+#endif
+
+
+/* Config externals */
+extern int numsids;
+
+/* USBSID externals */
+extern uint8_t sid_memory[];
+extern uint32_t breathe_interval_ms;
+
+/* Envelope levels are 8.16 fixed point, the top 8 bits match the SID envelope counter */
+#define VU_LEVEL_MAX 0xFFFFFF
+#define VU_RATE(ms) (VU_LEVEL_MAX / (ms))
+
+typedef enum {
+  VU_RELEASE = 0,
+  VU_ATTACK,
+  VU_DECAY_SUSTAIN
+} vu_phase;
+
+typedef struct {
+  vu_phase phase;
+  uint8_t control;  /* Control register seen on the previous tick */
+  uint32_t level;
+} vu_voice;
+
+static vu_voice vu_voices[4][3];
+static uint8_t vu_levels[4][3];
+
+/* Envelope counter steps per ms for a full 0 to 255 sweep, from the attack times in sid.h
+ * Decay and release use the same rates slowed down by the exponential counter below */
+static const uint32_t vu_rate[16] = {
+  VU_RATE(2),   VU_RATE(8),   VU_RATE(16),  VU_RATE(24),
+  VU_RATE(38),  VU_RATE(56),  VU_RATE(68),  VU_RATE(80),
+  VU_RATE(100), VU_RATE(250), VU_RATE(500), VU_RATE(800),
+  VU_RATE(1000), VU_RATE(3000), VU_RATE(5000), VU_RATE(8000),
+};
+
+/* Cost of vu_tick on core 1 in cpu cycles */
+static uint32_t cost_start, cost_max, cost_ticks;
+static uint64_t cost_total;
+static uint32_t cost_report_ms;
+
+
+/* Helpers */
+
+/* Shift matching the SID exponential decay counter period of 1, 2, 4, 8, 16 and 30 */
+static inline int vu_exp_shift(uint32_t level)
+{
+  uint8_t env = (level >> 16);
+  return (env > 0x5D) ? 0 : (env > 0x36) ? 1 : (env > 0x1A) ? 2 : (env > 0x0E) ? 3 : (env > 0x06) ? 4 : 5;
+}
+
+static inline uint32_t vu_cycles(void)
+{
+  #if defined(__arm__)
+  return systick_hw->cvr;  /* Counts down */
+  #else
+  return (time_us_32() * (clock_get_hz(clk_sys) / 1000000));
+  #endif
+}
+
+
+/* Engine */
+
+void vu_reset(void)
+{
+  memset(vu_voices, 0, sizeof(vu_voices));
+  memset(vu_levels, 0, sizeof(vu_levels));
+}
+
+void vu_init(void)
+{
+  vu_reset();
+  #if defined(__arm__)
+  /* SysTick is per core, this must run on core 1 */
+  systick_hw->rvr = 0xFFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5;  /* Enabled, processor clock, no interrupt */
+  #endif
+  cost_start = cost_max = cost_ticks = 0;
+  cost_total = 0;
+  cost_report_ms = to_ms_since_boot(get_absolute_time());
+}
+
+/* Advances the envelope of a single voice by elapsed_ms */
+static void vu_voice_tick(vu_voice *v, const uint8_t *regs, uint32_t elapsed_ms)
+{
+  uint8_t control = regs[CONTR];
+  if ((control & BIT_0) && !(v->control & BIT_0)) v->phase = VU_ATTACK;
+  if (!(control & BIT_0)) v->phase = VU_RELEASE;
+  v->control = control;
+
+  uint32_t step;
+  switch (v->phase) {
+    case VU_ATTACK:
+      step = (vu_rate[(regs[ATTDEC] >> 4)] * elapsed_ms);
+      if (step >= (VU_LEVEL_MAX - v->level)) {
+        v->level = VU_LEVEL_MAX;
+        v->phase = VU_DECAY_SUSTAIN;
+      } else {
+        v->level += step;
+      }
+      break;
+    case VU_DECAY_SUSTAIN: {
+      uint32_t sustain = ((uint32_t)((regs[SUSREL] >> 4) * 0x11) << 16);
+      step = ((vu_rate[(regs[ATTDEC] & R_NIBBLE)] * elapsed_ms) >> vu_exp_shift(v->level));
+      if (v->level > sustain) {  /* The SID never climbs back up to a raised sustain level */
+        v->level = ((v->level - sustain) > step) ? (v->level - step) : sustain;
+      }
+      break;
+    }
+    case VU_RELEASE:
+    default:
+      step = ((vu_rate[(regs[SUSREL] & R_NIBBLE)] * elapsed_ms) >> vu_exp_shift(v->level));
+      v->level = (v->level > step) ? (v->level - step) : 0;
+      break;
+  }
+}
+
+/* Updates the envelope model of all voices from the shadow registers
+ * Only sees the register state once per tick, gates toggled in between are missed */
+void vu_tick(uint32_t elapsed_ms)
+{
+  cost_start = vu_cycles();
+  elapsed_ms = constrain(elapsed_ms, 1, 100);  /* Keeps rate * elapsed within 32 bits */
+  int sids = (numsids > 4 ? 4 : numsids);
+  for (int sidno = 0; sidno < sids; sidno++) {
+    const uint8_t *sid = &sid_memory[(sidno * 0x20)];
+    for (int voiceno = 0; voiceno < 3; voiceno++) {
+      const uint8_t *regs = &sid[(voiceno * 7)];
+      vu_voice_tick(&vu_voices[sidno][voiceno], regs, elapsed_ms);
+      /* No waveform selected or voice 3 disconnected from the output means silence */
+      bool audible = ((regs[CONTR] & L_NIBBLE) != 0)
+        && !(voiceno == 2 && (sid[MODVOL] & BIT_7) && !(sid[RESFLT] & BIT_2));
+      vu_levels[sidno][voiceno] = audible ? (vu_voices[sidno][voiceno].level >> 16) : 0;
+    }
+  }
+  #if defined(__arm__)
+  uint32_t cycles = ((cost_start - vu_cycles()) & 0xFFFFFF);
+  #else
+  uint32_t cycles = (vu_cycles() - cost_start);
+  #endif
+  if (cycles > cost_max) cost_max = cycles;
+  cost_total += cycles;
+  cost_ticks++;
+}
+
+/* Envelope level of a single voice ~ 0 to 255 */
+uint8_t vu_voice_level(int sidno, int voiceno)
+{
+  return vu_levels[(sidno & 0x3)][(voiceno % 3)];
+}
+
+/* Average voice level scaled by the master volume ~ 0 to VU_MAX */
+uint16_t vu_sid_level(int sidno)
+{
+  const uint8_t *l = vu_levels[(sidno & 0x3)];
+  uint32_t sum = (l[0] + l[1] + l[2]) * (sid_memory[((sidno & 0x3) * 0x20) + MODVOL] & R_NIBBLE);
+  return (uint16_t)((sum * VU_SCALE) >> 8);
+}
+
+/* Logs the average and peak cost per tick every VU_REPORT_MS */
+void vu_report_cost(void)
+{
+  uint32_t now = to_ms_since_boot(get_absolute_time());
+  if ((now - cost_report_ms) < VU_REPORT_MS || cost_ticks == 0) return;
+  uint32_t avg = (uint32_t)(cost_total / cost_ticks);
+  uint32_t budget = (clock_get_hz(clk_sys) / 1000) * breathe_interval_ms;
+  DBG("[VU] %lu ticks, avg %lu max %lu cycles, %lu.%02lu%% of core 1\n",
+    cost_ticks, avg, cost_max, ((avg * 100) / budget), (((avg * 10000) / budget) % 100));
+  (void)avg, (void)budget;
+  cost_report_ms = now;
+  cost_max = cost_ticks = 0;
+  cost_total = 0;
+}